@@ -0,0 +1,224 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bucket.h"
+
+#define BUCKET_MAGIC 0x6275636b /* set once a bucket of the host is ready */
+#define OPEN_TRIES 1000 /* of 1ms each, waiting for the creator of a bucket */
+#define SCALE 1000000 /* tokens are in millionths of bytes */
+
+struct bucket {
+	uint32_t magic;
+	pthread_mutex_t lock; /* shared by all the processes */
+	uint64_t rate;
+	uint64_t burst;
+	int64_t tokens; /* scaled, negative when in debt */
+	uint64_t last; /* time of the last refill */
+	uint64_t total;
+};
+
+uint64_t bucket_clock(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Initializes the bucket in shared memory.
+ * Returns -1 on error, and 0 otherwise.
+ */
+static int bucket_init(bucket_t *b, uint64_t rate, uint64_t burst) {
+	pthread_mutexattr_t attr;
+	if (pthread_mutexattr_init(&attr) != 0) {
+		return -1;
+	}
+	/* A process may die holding it */
+	int err = pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	err = err || pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	err = err || pthread_mutex_init(&b->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+	if (err) {
+		return -1;
+	}
+
+	b->rate = rate;
+	b->burst = burst;
+	b->tokens = burst * SCALE;
+	b->last = bucket_clock();
+	b->total = 0;
+	return 0;
+}
+
+static void bucket_lock(bucket_t *b) {
+	if (pthread_mutex_lock(&b->lock) == EOWNERDEAD) {
+		/* Its holder died, at worst in the middle of an update, which
+		 * only skews the count a bit */
+		pthread_mutex_consistent(&b->lock);
+	}
+}
+
+/**
+ * Adds the tokens earned since the last refill. Must hold the lock.
+ */
+static void bucket_refill(bucket_t *b, uint64_t now) {
+	/* The clocks of other processes may be slightly behind */
+	if (now <= b->last) {
+		return;
+	}
+
+	int64_t full = b->burst * SCALE;
+	uint64_t elapsed = now - b->last;
+	b->last = now;
+	if (b->rate == 0 || elapsed >= (full - b->tokens) / b->rate) {
+		b->tokens = full;
+	} else {
+		b->tokens += elapsed * b->rate;
+	}
+}
+
+bucket_t *bucket_create(uint64_t rate, uint64_t burst) {
+	bucket_t *b = mmap(NULL, sizeof (bucket_t), PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (b == MAP_FAILED) {
+		return NULL;
+	}
+	if (bucket_init(b, rate, burst) == -1) {
+		munmap(b, sizeof (bucket_t));
+		return NULL;
+	}
+	return b;
+}
+
+bucket_t *bucket_open(const char *name, uint64_t rate, uint64_t burst) {
+	bool created = true;
+	int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0666);
+	if (fd == -1 && errno == EEXIST) {
+		created = false;
+		fd = shm_open(name, O_RDWR, 0);
+	}
+	if (fd == -1) {
+		return NULL;
+	}
+
+	if (created) {
+		if (ftruncate(fd, sizeof (bucket_t)) == -1) {
+			goto fail_fd;
+		}
+	} else {
+		/* Its creator may not have sized it yet */
+		struct stat st;
+		int tries = 0;
+		while (true) {
+			if (fstat(fd, &st) == -1) {
+				goto fail_fd;
+			}
+			if (st.st_size >= (off_t) sizeof (bucket_t)) {
+				break;
+			}
+			if (++tries == OPEN_TRIES) {
+				errno = ETIMEDOUT;
+				goto fail_fd;
+			}
+			usleep(1000);
+		}
+	}
+
+	bucket_t *b = mmap(NULL, sizeof (bucket_t), PROT_READ | PROT_WRITE,
+		MAP_SHARED, fd, 0);
+	if (b == MAP_FAILED) {
+		goto fail_fd;
+	}
+	close(fd);
+
+	if (created) {
+		if (bucket_init(b, rate, burst) == -1) {
+			munmap(b, sizeof (bucket_t));
+			shm_unlink(name);
+			return NULL;
+		}
+		__atomic_store_n(&b->magic, BUCKET_MAGIC, __ATOMIC_RELEASE);
+		return b;
+	}
+
+	/* Nor initialized it */
+	for (int tries = 0; __atomic_load_n(&b->magic, __ATOMIC_ACQUIRE) != BUCKET_MAGIC; tries++) {
+		if (tries == OPEN_TRIES) {
+			munmap(b, sizeof (bucket_t));
+			errno = ETIMEDOUT;
+			return NULL;
+		}
+		usleep(1000);
+	}
+
+	bucket_lock(b);
+	b->rate = rate;
+	b->burst = burst;
+	pthread_mutex_unlock(&b->lock);
+	return b;
+
+fail_fd:
+	close(fd);
+	if (created) {
+		shm_unlink(name);
+	}
+	return NULL;
+}
+
+void bucket_close(bucket_t *b) {
+	munmap(b, sizeof (bucket_t));
+}
+
+uint64_t bucket_rate(bucket_t *b) {
+	return b->rate;
+}
+
+uint64_t bucket_delay(bucket_t *b, uint64_t len, uint64_t now) {
+	bucket_lock(b);
+	bucket_refill(b, now);
+	int64_t want = (len < b->burst ? len : b->burst) * SCALE;
+	uint64_t delay = 0;
+	if (b->tokens < want && b->rate > 0) {
+		delay = (want - b->tokens + b->rate - 1) / b->rate;
+	}
+	pthread_mutex_unlock(&b->lock);
+	return delay;
+}
+
+void bucket_take(bucket_t *b, uint64_t len, uint64_t now) {
+	bucket_lock(b);
+	bucket_refill(b, now);
+	b->tokens -= len * SCALE;
+	b->total += len;
+	pthread_mutex_unlock(&b->lock);
+}
+
+uint64_t bucket_total(bucket_t *b) {
+	bucket_lock(b);
+	uint64_t total = b->total;
+	pthread_mutex_unlock(&b->lock);
+	return total;
+}
+
+int bucket_parse_rate(const char *str, uint64_t *rate) {
+	char *end;
+	double bits = strtod(str, &end);
+	switch (*end) {
+	case 'k': bits *= 1e3; end++; break;
+	case 'M': bits *= 1e6; end++; break;
+	case 'G': bits *= 1e9; end++; break;
+	}
+
+	/* At least a byte per second, and no more than a terabit */
+	if (end == str || *end != '\0' || !(bits >= 8 && bits <= 1e12)) {
+		return -1;
+	}
+	*rate = (uint64_t) (bits / 8 + 0.5);
+	return 0;
+}
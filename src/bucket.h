@@ -0,0 +1,78 @@
+#ifndef __BUCKET_H_
+#define __BUCKET_H_
+
+
+/**
+ * Token buckets capping the rate at which data is sent. A bucket fills with
+ * rate bytes per second up to burst bytes, and sending takes bytes out of it.
+ * It may go into debt by what was sent last, and nothing is sent until the
+ * debt is paid off, which lets packets of any size through while holding the
+ * rate on average.
+ *
+ * Buckets live in shared memory, so that several processes can draw from the
+ * same one: those of a striped transfer from the bucket of the transfer, and
+ * those of the whole host from a named bucket.
+ */
+
+#include <stdint.h>
+
+typedef struct bucket bucket_t;
+
+/**
+ * Creates a bucket shared with the processes forked afterwards, which starts
+ * full.
+ * Returns NULL on error.
+ */
+bucket_t *bucket_create(uint64_t rate, uint64_t burst);
+
+/**
+ * Opens the bucket of the host with the given name (as for shm_open),
+ * creating it if it doesn't exist. Its rate and burst become the given ones,
+ * for the other processes using it as well.
+ * Returns NULL on error (with errno set).
+ */
+bucket_t *bucket_open(const char *name, uint64_t rate, uint64_t burst);
+
+/**
+ * Unmaps the bucket. The bucket of the host stays for other processes.
+ */
+void bucket_close(bucket_t *b);
+
+/**
+ * Returns the rate of the bucket, in bytes per second.
+ */
+uint64_t bucket_rate(bucket_t *b);
+
+/**
+ * Returns the time (in microseconds) from now (as returned by bucket_clock)
+ * until the bucket holds len bytes, or all it can hold if that's less, 0 if
+ * it does already. With len = 0, that's until it lets data be sent.
+ */
+uint64_t bucket_delay(bucket_t *b, uint64_t len, uint64_t now);
+
+/**
+ * Takes the len bytes sent at time now out of the bucket.
+ */
+void bucket_take(bucket_t *b, uint64_t len, uint64_t now);
+
+/**
+ * Returns the number of bytes taken out of the bucket since its creation,
+ * by all processes.
+ */
+uint64_t bucket_total(bucket_t *b);
+
+/**
+ * Returns the current time in microseconds, on a clock shared by all the
+ * processes of the host.
+ */
+uint64_t bucket_clock(void);
+
+/**
+ * Parses a rate in bits per second, with an optional k, M or G suffix (for
+ * powers of 1000), into bytes per second.
+ * Returns -1 if it isn't a valid rate, and 0 otherwise.
+ */
+int bucket_parse_rate(const char *str, uint64_t *rate);
+
+
+#endif  /* __BUCKET_H_ */
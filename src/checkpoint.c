@@ -0,0 +1,70 @@
+#include <endian.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "checkpoint.h"
+
+#define MAGIC "CKP1"
+#define SIZE 16 /* magic, CRC (32 bits) and offset (64 bits), big-endian */
+
+int checkpoint_load(const char *path, checkpoint_t *c) {
+	FILE *f = fopen(path, "rb");
+	if (f == NULL) {
+		return -1;
+	}
+
+	char buf[SIZE];
+	size_t n = fread(buf, 1, SIZE, f);
+	fclose(f);
+	if (n != SIZE || memcmp(buf, MAGIC, 4) != 0) {
+		return -1;
+	}
+
+	uint32_t crc;
+	memcpy(&crc, buf + 4, sizeof (crc));
+	c->crc = be32toh(crc);
+	uint64_t offset;
+	memcpy(&offset, buf + 8, sizeof (offset));
+	c->offset = be64toh(offset);
+	return 0;
+}
+
+int checkpoint_save(const char *path, const checkpoint_t *c) {
+	char buf[SIZE];
+	memcpy(buf, MAGIC, 4);
+	uint32_t crc = htobe32(c->crc);
+	memcpy(buf + 4, &crc, sizeof (crc));
+	uint64_t offset = htobe64(c->offset);
+	memcpy(buf + 8, &offset, sizeof (offset));
+
+	/* Write it aside, then move it over the old one */
+	size_t len = strlen(path) + sizeof (".tmp");
+	char *tmp = malloc(len);
+	if (tmp == NULL) {
+		return -1;
+	}
+	snprintf(tmp, len, "%s.tmp", path);
+
+	FILE *f = fopen(tmp, "wb");
+	if (f == NULL) {
+		free(tmp);
+		return -1;
+	}
+	if (fwrite(buf, 1, SIZE, f) != SIZE || fflush(f) != 0 ||
+	    fdatasync(fileno(f)) == -1) {
+		int err = errno;
+		fclose(f);
+		unlink(tmp);
+		free(tmp);
+		errno = err;
+		return -1;
+	}
+	fclose(f);
+
+	int ret = rename(tmp, path);
+	free(tmp);
+	return ret;
+}
@@ -0,0 +1,32 @@
+#ifndef __CHECKPOINT_H_
+#define __CHECKPOINT_H_
+
+
+/**
+ * Checkpoints saved by the receiver next to its output file, recording how
+ * much of the file is safely on disk so that an interrupted transfer can be
+ * resumed from there.
+ */
+
+#include <stdint.h>
+
+typedef struct checkpoint {
+	uint64_t offset; /* bytes at the start of the file known to be on disk */
+	uint32_t crc; /* CRC32 of those bytes */
+} checkpoint_t;
+
+/**
+ * Reads the checkpoint saved at path.
+ * Returns -1 if there's none or it's invalid, and 0 otherwise.
+ */
+int checkpoint_load(const char *path, checkpoint_t *c);
+
+/**
+ * Replaces the checkpoint saved at path, atomically: after a crash, either
+ * the old one or the new one is found.
+ * Returns -1 on error (with errno set), and 0 otherwise.
+ */
+int checkpoint_save(const char *path, const checkpoint_t *c);
+
+
+#endif  /* __CHECKPOINT_H_ */
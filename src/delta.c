@@ -0,0 +1,331 @@
+#include <endian.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "delta.h"
+
+/*
+ * The weak checksum is the one of rsync: a is the sum of the bytes, and b the
+ * sum of the bytes weighted by their distance to the end of the block, both
+ * modulo 2^16, in the low and high halves.
+ */
+
+uint32_t delta_weak(const char *buf, size_t len) {
+	const unsigned char *p = (const unsigned char *) buf;
+	uint32_t a = 0;
+	uint32_t b = 0;
+	size_t i = 0;
+
+#ifdef __SSE2__
+	/* 16 bytes at a time: every byte already summed gains 16 times its
+	 * value in b, and those of the vector their distance to its end.
+	 * Overflows are harmless, we only keep 16 bits. */
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i w_lo = _mm_setr_epi16(16, 15, 14, 13, 12, 11, 10, 9);
+	const __m128i w_hi = _mm_setr_epi16(8, 7, 6, 5, 4, 3, 2, 1);
+	__m128i va = zero;
+	__m128i vb = zero;
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (p + i));
+		vb = _mm_add_epi32(vb, _mm_slli_epi32(va, 4));
+		va = _mm_add_epi32(va, _mm_sad_epu8(v, zero));
+		vb = _mm_add_epi32(vb, _mm_madd_epi16(_mm_unpacklo_epi8(v, zero), w_lo));
+		vb = _mm_add_epi32(vb, _mm_madd_epi16(_mm_unpackhi_epi8(v, zero), w_hi));
+	}
+
+	uint32_t lanes[4];
+	_mm_storeu_si128((__m128i *) lanes, va);
+	a = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+	_mm_storeu_si128((__m128i *) lanes, vb);
+	b = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+	/* Those are the sums for a block ending at i */
+	b += (len - i) * a;
+#endif
+
+	for (; i < len; i++) {
+		a += p[i];
+		b += (len - i) * p[i];
+	}
+	return (a & 0xffff) | (b << 16);
+}
+
+uint32_t delta_roll(uint32_t weak, size_t len, unsigned char out, unsigned char in) {
+	uint32_t a = (weak & 0xffff) - out + in;
+	uint32_t b = (weak >> 16) - len * out + a;
+	return (a & 0xffff) | (b << 16);
+}
+
+uint64_t delta_strong(const char *buf, size_t len) {
+	/* 64-bit multiplicative hash of the words, with a final avalanche */
+	const uint64_t p1 = 0xff51afd7ed558ccdULL;
+	const uint64_t p2 = 0xc4ceb9fe1a85ec53ULL;
+	uint64_t h = 0x9e3779b97f4a7c15ULL ^ len;
+	size_t i = 0;
+
+	while (i < len) {
+		uint64_t v = 0;
+		size_t n = len - i < sizeof (v) ? len - i : sizeof (v);
+		memcpy(&v, buf + i, n);
+		h ^= le64toh(v) * p1;
+		h = ((h << 31) | (h >> 33)) * p2;
+		i += n;
+	}
+
+	h ^= h >> 33;
+	h *= p1;
+	h ^= h >> 33;
+	h *= p2;
+	h ^= h >> 33;
+	return h;
+}
+
+typedef struct sig_job {
+	pthread_t thread;
+	const char *basis;
+	delta_sig_t *sigs;
+	size_t first;
+	size_t count;
+} sig_job_t;
+
+static void *sign_blocks(void *arg) {
+	sig_job_t *job = arg;
+	for (size_t i = job->first; i < job->first + job->count; i++) {
+		const char *block = job->basis + i * DELTA_BLOCK_SIZE;
+		job->sigs[i].weak = delta_weak(block, DELTA_BLOCK_SIZE);
+		job->sigs[i].strong = delta_strong(block, DELTA_BLOCK_SIZE);
+	}
+	return NULL;
+}
+
+int delta_signature(const char *basis, size_t len, delta_sig_t *sigs, unsigned threads) {
+	size_t count = len / DELTA_BLOCK_SIZE;
+	if (threads < 1) {
+		threads = 1;
+	}
+	if (threads > count) {
+		threads = count > 0 ? count : 1;
+	}
+
+	sig_job_t *jobs = calloc(threads, sizeof (sig_job_t));
+	if (jobs == NULL) {
+		return -1;
+	}
+
+	/* The calling thread takes the first share */
+	size_t share = (count + threads - 1) / threads;
+	unsigned started = 0;
+	int ret = 0;
+	for (unsigned t = 0; t < threads; t++) {
+		jobs[t].basis = basis;
+		jobs[t].sigs = sigs;
+		jobs[t].first = t * share < count ? t * share : count;
+		jobs[t].count = count - jobs[t].first < share ? count - jobs[t].first : share;
+		if (t > 0) {
+			if (pthread_create(&jobs[t].thread, NULL, sign_blocks, &jobs[t]) != 0) {
+				ret = -1;
+				break;
+			}
+			started++;
+		}
+	}
+	if (ret == 0) {
+		sign_blocks(&jobs[0]);
+	}
+
+	for (unsigned t = 1; t <= started; t++) {
+		pthread_join(jobs[t].thread, NULL);
+	}
+	free(jobs);
+	return ret;
+}
+
+/*
+ * Layout of a batch (big-endian): batch number (32 bits), then for each
+ * signature, weak (32 bits) and strong (64 bits).
+ */
+size_t delta_batch_encode(const delta_sig_t *sigs, size_t count, uint32_t batch, char *buf) {
+	size_t first = (size_t) batch * SIGS_PER_BATCH;
+	size_t n = first < count ? count - first : 0;
+	if (n > SIGS_PER_BATCH) {
+		n = SIGS_PER_BATCH;
+	}
+
+	uint32_t batch_be = htobe32(batch);
+	memcpy(buf, &batch_be, sizeof (batch_be));
+	char *p = buf + sizeof (batch_be);
+	for (size_t i = first; i < first + n; i++) {
+		uint32_t weak = htobe32(sigs[i].weak);
+		uint64_t strong = htobe64(sigs[i].strong);
+		memcpy(p, &weak, sizeof (weak));
+		memcpy(p + sizeof (weak), &strong, sizeof (strong));
+		p += SIG_SIZE;
+	}
+	return p - buf;
+}
+
+int delta_batch_decode(const char *buf, size_t len, delta_sig_t *sigs, size_t count,
+		uint32_t *batch) {
+	uint32_t batch_be;
+	if (len < sizeof (batch_be)) {
+		return -1;
+	}
+	memcpy(&batch_be, buf, sizeof (batch_be));
+	*batch = be32toh(batch_be);
+
+	size_t first = (size_t) *batch * SIGS_PER_BATCH;
+	if (first >= count) {
+		return -1;
+	}
+	size_t n = count - first < SIGS_PER_BATCH ? count - first : SIGS_PER_BATCH;
+	if (len != sizeof (batch_be) + n * SIG_SIZE) {
+		return -1;
+	}
+
+	const char *p = buf + sizeof (batch_be);
+	for (size_t i = first; i < first + n; i++) {
+		uint32_t weak;
+		uint64_t strong;
+		memcpy(&weak, p, sizeof (weak));
+		memcpy(&strong, p + sizeof (weak), sizeof (strong));
+		sigs[i].weak = be32toh(weak);
+		sigs[i].strong = be64toh(strong);
+		p += SIG_SIZE;
+	}
+	return 0;
+}
+
+/**
+ * Appends a piece to ops, merging it with the last one if they're contiguous.
+ * Returns -1 on error, and 0 otherwise.
+ */
+static int add_op(delta_op_t **ops, size_t *nops, size_t *cap, bool copy,
+		uint64_t offset, uint64_t len) {
+	if (len == 0) {
+		return 0;
+	}
+
+	if (*nops > 0) {
+		delta_op_t *last = &(*ops)[*nops - 1];
+		if (last->copy == copy && last->offset + last->len == offset) {
+			last->len += len;
+			return 0;
+		}
+	}
+
+	if (*nops == *cap) {
+		size_t new_cap = *cap > 0 ? 2 * *cap : 64;
+		delta_op_t *new_ops = realloc(*ops, new_cap * sizeof (delta_op_t));
+		if (new_ops == NULL) {
+			return -1;
+		}
+		*ops = new_ops;
+		*cap = new_cap;
+	}
+
+	(*ops)[(*nops)++] = (delta_op_t) {.copy = copy, .offset = offset, .len = len};
+	return 0;
+}
+
+delta_op_t *delta_compute(const char *data, size_t len, const delta_sig_t *sigs,
+		size_t count, size_t *nops) {
+	const size_t B = DELTA_BLOCK_SIZE;
+	delta_op_t *ops = NULL;
+	size_t cap = 0;
+	*nops = 0;
+
+	/* Chain the blocks by weak checksum */
+	size_t buckets = 1;
+	while (buckets < 2 * count) {
+		buckets *= 2;
+	}
+	size_t *head = malloc(buckets * sizeof (size_t));
+	size_t *chain = malloc((count > 0 ? count : 1) * sizeof (size_t));
+	if (head == NULL || chain == NULL) {
+		goto fail;
+	}
+	for (size_t h = 0; h < buckets; h++) {
+		head[h] = SIZE_MAX;
+	}
+	/* From the last one, so that chains list equal blocks in order */
+	for (size_t i = count; i-- > 0;) {
+		size_t h = sigs[i].weak & (buckets - 1);
+		chain[i] = head[h];
+		head[h] = i;
+	}
+
+	size_t pos = 0;
+	size_t literal = 0; /* start of the literal data not added yet */
+	size_t expected = SIZE_MAX; /* block following the last one matched */
+	uint32_t weak = len >= B ? delta_weak(data, B) : 0;
+
+	while (count > 0 && pos + B <= len) {
+		size_t match = SIZE_MAX;
+		bool have_strong = false;
+		uint64_t strong = 0;
+
+		/* Try the block following the last one matched first, which
+		 * keeps copies in one piece when the basis has duplicate blocks */
+		size_t candidate = expected < count ? expected : SIZE_MAX;
+		size_t next = head[weak & (buckets - 1)];
+		while (candidate != SIZE_MAX || next != SIZE_MAX) {
+			if (candidate == SIZE_MAX) {
+				candidate = next;
+				next = chain[next];
+			}
+			if (sigs[candidate].weak == weak) {
+				if (!have_strong) {
+					strong = delta_strong(data + pos, B);
+					have_strong = true;
+				}
+				if (sigs[candidate].strong == strong) {
+					match = candidate;
+					break;
+				}
+			}
+			candidate = SIZE_MAX;
+		}
+
+		if (match != SIZE_MAX) {
+			if (add_op(&ops, nops, &cap, false, literal, pos - literal) == -1 ||
+			    add_op(&ops, nops, &cap, true, (uint64_t) match * B, B) == -1) {
+				goto fail;
+			}
+			pos += B;
+			literal = pos;
+			expected = match + 1;
+			if (pos + B <= len) {
+				weak = delta_weak(data + pos, B);
+			}
+		} else {
+			if (pos + B < len) {
+				weak = delta_roll(weak, B, data[pos], data[pos + B]);
+			}
+			pos++;
+		}
+	}
+
+	if (add_op(&ops, nops, &cap, false, literal, len - literal) == -1) {
+		goto fail;
+	}
+	if (ops == NULL) {
+		/* Empty input, still return something to free */
+		ops = malloc(sizeof (delta_op_t));
+		if (ops == NULL) {
+			goto fail;
+		}
+	}
+
+	free(head);
+	free(chain);
+	return ops;
+
+fail:
+	free(head);
+	free(chain);
+	free(ops);
+	return NULL;
+}
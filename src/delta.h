@@ -0,0 +1,87 @@
+#ifndef __DELTA_H_
+#define __DELTA_H_
+
+
+/**
+ * Delta transfers, in the manner of rsync. The receiver cuts the file it
+ * already has (the basis) into blocks and computes the signature of each of
+ * them: a weak checksum that can be rolled along the data one byte at a
+ * time, and a strong one. The sender looks for those blocks at every offset
+ * of its input, and sends the rest as literal data.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "packet_interface.h"
+
+#define DELTA_BLOCK_SIZE 4096
+#define SIG_SIZE 12 /* encoded size of a signature */
+/* Signatures per batch, each sent in a payload after the batch number */
+#define SIGS_PER_BATCH ((MAX_PAYLOAD_SIZE - 4) / SIG_SIZE)
+
+typedef struct delta_sig {
+	uint32_t weak;
+	uint64_t strong;
+} delta_sig_t;
+
+/**
+ * Piece of the new data: either literal data of the input, or a copy of
+ * data of the basis.
+ */
+typedef struct delta_op {
+	bool copy;
+	uint64_t offset; /* in the basis for copies, in the input otherwise */
+	uint64_t len;
+} delta_op_t;
+
+/**
+ * Returns the weak checksum of the len bytes at buf.
+ */
+uint32_t delta_weak(const char *buf, size_t len);
+
+/**
+ * Returns the weak checksum of a window of len bytes moved by one byte, given
+ * its checksum before, the byte that left it and the one that entered it.
+ */
+uint32_t delta_roll(uint32_t weak, size_t len, unsigned char out, unsigned char in);
+
+/**
+ * Returns the strong checksum of the len bytes at buf.
+ */
+uint64_t delta_strong(const char *buf, size_t len);
+
+/**
+ * Computes the signatures of the len / DELTA_BLOCK_SIZE whole blocks at basis
+ * into sigs, split among the given number of threads.
+ * Returns -1 on error, and 0 otherwise.
+ */
+int delta_signature(const char *basis, size_t len, delta_sig_t *sigs, unsigned threads);
+
+/**
+ * Encodes the batch-th batch of the count signatures in buf, which must be at
+ * least MAX_PAYLOAD_SIZE bytes long.
+ * Returns the encoded length.
+ */
+size_t delta_batch_encode(const delta_sig_t *sigs, size_t count, uint32_t batch, char *buf);
+
+/**
+ * Decodes the batch of signatures in the len bytes at buf into its place in
+ * sigs, which holds count of them, and its number into batch.
+ * Returns -1 if it isn't a valid batch, and 0 otherwise.
+ */
+int delta_batch_decode(const char *buf, size_t len, delta_sig_t *sigs, size_t count,
+	uint32_t *batch);
+
+/**
+ * Computes how to make the len bytes at data out of the blocks of the basis
+ * with the count signatures and literal data.
+ * Returns the pieces in order (to be freed), their number in nops, or NULL on
+ * error.
+ */
+delta_op_t *delta_compute(const char *data, size_t len, const delta_sig_t *sigs,
+	size_t count, size_t *nops);
+
+
+#endif  /* __DELTA_H_ */
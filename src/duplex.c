@@ -0,0 +1,71 @@
+#include <endian.h>
+#include <string.h>
+
+#include "duplex.h"
+#include "setup.h"
+
+pkt_t *piggyback_wrap(const pkt_t *pkt, const pkt_t *ack, bool fresh) {
+	if (pkt_get_length(pkt) > DUPLEX_PAYLOAD_SIZE) {
+		return NULL;
+	}
+
+	char payload[MAX_PAYLOAD_SIZE];
+	payload[0] = pkt_get_seqnum(ack);
+	payload[1] = pkt_get_window(ack);
+	payload[2] = fresh ? PIGGYBACK_FRESH : 0;
+	payload[3] = 0;
+	uint32_t ts = htobe32(pkt_get_timestamp(ack));
+	memcpy(payload + 4, &ts, sizeof (ts));
+	uint32_t ce = 0;
+	if (pkt_get_length(ack) == ECN_ECHO_SIZE) {
+		memcpy(&ce, pkt_get_payload(ack), sizeof (ce));
+	}
+	memcpy(payload + 8, &ce, sizeof (ce));
+	if (pkt_get_length(pkt) > 0) {
+		memcpy(payload + PIGGYBACK_SIZE, pkt_get_payload(pkt), pkt_get_length(pkt));
+	}
+
+	pkt_t *out = pkt_new();
+	if (out == NULL) {
+		return NULL;
+	}
+	pkt_status_code err = PKT_OK;
+	err = err || pkt_set_type(out, pkt_get_type(pkt));
+	err = err || pkt_set_window(out, pkt_get_window(pkt));
+	err = err || pkt_set_seqnum(out, pkt_get_seqnum(pkt));
+	err = err || pkt_set_timestamp(out, pkt_get_timestamp(pkt));
+	err = err || pkt_set_payload(out, payload, PIGGYBACK_SIZE + pkt_get_length(pkt));
+	if (err != PKT_OK) {
+		pkt_del(out);
+		return NULL;
+	}
+	return out;
+}
+
+int piggyback_take(pkt_t *pkt, pkt_t *ack) {
+	size_t len = pkt_get_length(pkt);
+	if (len < PIGGYBACK_SIZE) {
+		return -1;
+	}
+
+	const char *payload = pkt_get_payload(pkt);
+	uint32_t ts;
+	memcpy(&ts, payload + 4, sizeof (ts));
+	bool fresh = payload[2] & PIGGYBACK_FRESH;
+
+	pkt_status_code err = PKT_OK;
+	err = err || pkt_set_type(ack, PTYPE_ACK);
+	err = err || pkt_set_seqnum(ack, payload[0]);
+	err = err || pkt_set_window(ack, payload[1]);
+	err = err || pkt_set_timestamp(ack, be32toh(ts));
+	err = err || pkt_set_payload(ack, payload + 8, ECN_ECHO_SIZE);
+
+	/* The rest moves to the front, through a copy as it overlaps */
+	char rest[MAX_PAYLOAD_SIZE];
+	memcpy(rest, payload + PIGGYBACK_SIZE, len - PIGGYBACK_SIZE);
+	err = err || pkt_set_payload(pkt, rest, len - PIGGYBACK_SIZE);
+	if (err != PKT_OK) {
+		return -1;
+	}
+	return fresh;
+}
@@ -0,0 +1,49 @@
+#ifndef __DUPLEX_H_
+#define __DUPLEX_H_
+
+
+/**
+ * Acknowledgments piggybacked on data, when both ends send some in the same
+ * session (SETUP_EXT_DUPLEX): the receiver sends a file back to the sender,
+ * with its own sequence numbers. The payload of every DATA packet in the
+ * sequence then starts with the fields of the ACK its sender would have sent
+ * otherwise, for the data going the other way, so that a standalone ACK is
+ * only needed when there is no data to carry it:
+ * - the sequence number of the next packet expected (1 byte),
+ * - the window (1 byte),
+ * - flags (1 byte, see PIGGYBACK_FRESH), then a zero byte,
+ * - the timestamp echoed (big-endian u32),
+ * - the count of packets received marked CE (big-endian u32, see
+ *   ECN_ECHO_SIZE).
+ * Packets outside of the sequence (SETUP_KIND and SIG_KIND) and truncated
+ * ones carry none.
+ */
+
+#include "packet_interface.h"
+
+#define PIGGYBACK_SIZE 12
+#define DUPLEX_PAYLOAD_SIZE (MAX_PAYLOAD_SIZE - PIGGYBACK_SIZE) /* longest data */
+
+/* The timestamp is echoed for the first time, so it measures an RTT. Later
+ * packets repeat it until there's a newer one, as retransmissions do. */
+#define PIGGYBACK_FRESH 1
+
+/**
+ * Returns a copy of the DATA packet pkt with the fields of the ACK packet
+ * ack in front of its payload, which must be at most DUPLEX_PAYLOAD_SIZE
+ * long. The CE count is the payload of ack if it's an ECN echo, 0 otherwise.
+ * Returns NULL on error.
+ */
+pkt_t *piggyback_wrap(const pkt_t *pkt, const pkt_t *ack, bool fresh);
+
+/**
+ * Takes the fields in front of the payload of the DATA packet pkt, which is
+ * left with the rest, and makes ack (a new packet) the ACK they stand for,
+ * with an ECN echo as its payload.
+ * Returns -1 if the payload is too short for them, 1 if the timestamp is
+ * fresh, and 0 otherwise.
+ */
+int piggyback_take(pkt_t *pkt, pkt_t *ack);
+
+
+#endif  /* __DUPLEX_H_ */
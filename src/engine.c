@@ -0,0 +1,977 @@
+#define _GNU_SOURCE /* sendmmsg, recvmmsg */
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "engine.h"
+#include "packet_interface.h"
+#include "uring.h"
+#include "util.h"
+
+#define URING_ENTRIES 256
+#define SEND_SLOTS 64 /* packets that can be queued before we have to wait */
+#define RECV_SLOTS 32 /* receptions armed on the socket at any time, a
+                       * whole window of datagrams */
+#define WRITE_SLOTS 64 /* payloads that can be queued for the file */
+#define READ_AREA (MAX_WINDOW_SIZE * MAX_PAYLOAD_SIZE) /* largest file read */
+#define GSO_MAX_SEGMENTS 64 /* limit on segments per send (UDP_MAX_SEGMENTS) */
+#define GRO_SLOTS 8 /* trains of datagrams received at once with UDP GRO */
+#define GRO_TRAIN_SIZE 65536 /* largest train the kernel coalesces */
+#define RECV_CTRL 64 /* room for the ancillary data of a received datagram */
+
+/* Layout of the registered buffer */
+#define SEND_OFF 0
+#define RECV_OFF (SEND_OFF + SEND_SLOTS * MAX_PACKET_SIZE)
+#define WRITE_OFF (RECV_OFF + RECV_SLOTS * MAX_PACKET_SIZE)
+#define READ_OFF (WRITE_OFF + WRITE_SLOTS * MAX_PAYLOAD_SIZE)
+#define AREA_SIZE (READ_OFF + READ_AREA)
+
+/* Indices of the registered files */
+#define FIXED_SOCK 0
+#define FIXED_FILE 1
+
+/* Kind of operation, stored in the upper half of user_data */
+enum {
+	OP_SEND = 1,
+	OP_RECV,
+	OP_WRITE,
+	OP_READ,
+	OP_WATCH,
+};
+
+#define USER_DATA(op, slot) (((uint64_t) (op) << 32) | (uint32_t) (slot))
+#define USER_OP(data) ((data) >> 32)
+#define USER_SLOT(data) ((uint32_t) (data))
+
+struct engine {
+	engine_type_t type;
+	int sockfd;
+	FILE *file;
+	bool wrote; // whether engine_write has been called
+	int watch_fd; // see engine_watch, -1 if none
+
+	// posix only: datagrams queued for a single sendmmsg, and datagrams
+	// obtained with a single recvmmsg but not consumed yet. Queued datagrams
+	// are described by consecutive iovecs pointing either to their encoding
+	// in sendq, or to payloads referenced by the packets (see
+	// pkt_set_payload_ref).
+	bool gso; // whether trains of datagrams are segmented by the kernel
+	bool gro; // whether the kernel coalesces received datagrams in trains
+	char *sendq;
+	size_t sendq_used; // bytes
+	struct iovec sendq_iov[SEND_SLOTS * 3];
+	size_t sendq_iovcnt;
+	size_t sendq_first_iov[SEND_SLOTS];
+	size_t sendq_niov[SEND_SLOTS];
+	size_t sendq_len[SEND_SLOTS];
+	size_t sendq_count;
+	char *recvq; // slots of recvq_slot_size bytes, each holding a train
+	size_t recvq_slots;
+	size_t recvq_slot_size;
+	size_t recvq_len[RECV_SLOTS]; // of the train
+	size_t recvq_seg[RECV_SLOTS]; // of its datagrams, the last may be shorter
+	uint8_t recvq_ecn[RECV_SLOTS];
+	size_t recvq_head;
+	size_t recvq_off; // of the next datagram in the train at recvq_head
+	size_t recvq_count; // trains
+	uint8_t last_ecn; // of the datagram engine_recv returned last
+
+	// io_uring only
+	uring_t *ring;
+	char *area; // registered buffer
+	size_t area_size;
+	int err; // first error reported by a completion (errno value)
+
+	struct iovec send_iov[SEND_SLOTS][3]; // for sends with a payload reference
+	size_t sends_used; // send slots used since all sends last completed
+	size_t sends_inflight;
+	size_t writes_used;
+	size_t writes_inflight;
+	size_t writes_pending; // writes not submitted yet
+	struct io_uring_sqe *last_write; // last write queued, if not submitted
+	bool seekable;
+	off_t file_off; // offset of the next read or write
+
+	// Receptions go through msghdrs to get the traffic class along
+	struct msghdr recv_msg[RECV_SLOTS];
+	struct iovec recv_iov[RECV_SLOTS];
+	char recv_ctrl[RECV_SLOTS][RECV_CTRL];
+
+	// Datagrams received but not consumed yet, in order of completion
+	size_t recv_len[RECV_SLOTS];
+	size_t ready[RECV_SLOTS];
+	size_t ready_head;
+	size_t ready_count;
+
+	bool read_done;
+	ssize_t read_res;
+
+	bool watch_armed; // whether a poll of watch_fd is in flight
+	bool watch_ready; // whether that poll completed
+};
+
+int engine_parse(const char *name, engine_type_t *type) {
+	if (strcmp(name, "posix") == 0) {
+		*type = ENGINE_POSIX;
+	} else if (strcmp(name, "gso") == 0) {
+		*type = ENGINE_GSO;
+	} else if (strcmp(name, "uring") == 0) {
+		*type = ENGINE_URING;
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
+const char *engine_name(engine_type_t type) {
+	switch (type) {
+		case ENGINE_POSIX: return "posix";
+		case ENGINE_GSO:   return "gso";
+		case ENGINE_URING: return "uring";
+		default:           return "unknown";
+	}
+}
+
+/**
+ * Returns the time elapsed since an arbitrary point in time (in microseconds).
+ */
+static int64_t now_us(void) {
+	struct timespec tp;
+	if (clock_gettime(CLOCK_MONOTONIC, &tp) == -1) {
+		abort();
+	}
+	return (int64_t) tp.tv_sec * 1000000 + tp.tv_nsec / 1000;
+}
+
+/**
+ * Returns the number of queued datagrams, starting at index i, that can be
+ * sent as a single GSO train: all of the same size, except for the last one
+ * which may be smaller.
+ */
+static size_t gso_train_length(engine_t *e, size_t i) {
+	size_t segs = 1;
+	while (i + segs < e->sendq_count && segs < GSO_MAX_SEGMENTS &&
+	       e->sendq_len[i + segs - 1] == e->sendq_len[i] &&
+	       e->sendq_len[i + segs] <= e->sendq_len[i]) {
+		segs++;
+	}
+	return segs;
+}
+
+/**
+ * Sends all the queued datagrams, with as few calls to sendmmsg as possible.
+ * With GSO, consecutive datagrams of the same size are passed as one buffer
+ * for the kernel to segment; if that fails, GSO is turned off for good and
+ * they are sent again one by one.
+ * Returns -1 on error (with errno set), and 0 otherwise.
+ */
+static int posix_send_queued(engine_t *e) {
+	struct mmsghdr msgs[SEND_SLOTS];
+	char ctrl[SEND_SLOTS][CMSG_SPACE(sizeof (uint16_t))];
+	size_t first[SEND_SLOTS]; // first datagram of each message
+
+	size_t i = 0;
+	while (i < e->sendq_count) {
+		memset(msgs, 0, sizeof (msgs));
+
+		size_t nmsgs = 0;
+		for (size_t j = i; j < e->sendq_count; nmsgs++) {
+			size_t segs = e->gso ? gso_train_length(e, j) : 1;
+			size_t last = j + segs - 1;
+
+			/* The iovecs of the datagrams are consecutive, the
+			 * kernel concatenates them before segmenting */
+			size_t first_iov = e->sendq_first_iov[j];
+			msgs[nmsgs].msg_hdr.msg_iov = &e->sendq_iov[first_iov];
+			msgs[nmsgs].msg_hdr.msg_iovlen = e->sendq_first_iov[last]
+				+ e->sendq_niov[last] - first_iov;
+
+			if (segs > 1) {
+				struct msghdr *hdr = &msgs[nmsgs].msg_hdr;
+				hdr->msg_control = ctrl[nmsgs];
+				hdr->msg_controllen = sizeof (ctrl[nmsgs]);
+
+				struct cmsghdr *cm = CMSG_FIRSTHDR(hdr);
+				cm->cmsg_level = IPPROTO_UDP;
+				cm->cmsg_type = UDP_SEGMENT;
+				cm->cmsg_len = CMSG_LEN(sizeof (uint16_t));
+				uint16_t gso_size = e->sendq_len[j];
+				memcpy(CMSG_DATA(cm), &gso_size, sizeof (gso_size));
+			}
+
+			first[nmsgs] = j;
+			j += segs;
+		}
+
+		int n = sendmmsg(e->sockfd, msgs, nmsgs, 0);
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (e->gso && (errno == EIO || errno == EINVAL ||
+			               errno == EOPNOTSUPP || errno == ENOPROTOOPT)) {
+				log_msg("GSO send failed (%s), falling back\n", strerror(errno));
+				e->gso = false;
+				continue;
+			}
+			e->sendq_count = 0;
+			e->sendq_iovcnt = 0;
+			e->sendq_used = 0;
+			return -1;
+		}
+
+		i = (size_t) n < nmsgs ? first[n] : e->sendq_count;
+	}
+
+	e->sendq_count = 0;
+	e->sendq_iovcnt = 0;
+	e->sendq_used = 0;
+	return 0;
+}
+
+/**
+ * Returns the ECN field of a received datagram, from its ancillary data
+ * (only there if the socket reports it, see report_ecn).
+ */
+static uint8_t ecn_of(struct msghdr *msg) {
+	for (struct cmsghdr *cm = CMSG_FIRSTHDR(msg); cm != NULL; cm = CMSG_NXTHDR(msg, cm)) {
+		if (cm->cmsg_level == IPPROTO_IPV6 && cm->cmsg_type == IPV6_TCLASS) {
+			int tclass;
+			memcpy(&tclass, CMSG_DATA(cm), sizeof (tclass));
+			return tclass & ECN_MASK;
+		}
+		/* From IPv4-mapped addresses */
+		if (cm->cmsg_level == IPPROTO_IP && cm->cmsg_type == IP_TOS) {
+			return *CMSG_DATA(cm) & ECN_MASK;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Returns the size of the datagrams coalesced in a train of len bytes, from
+ * its ancillary data (only there with UDP GRO), len if it's a single one.
+ */
+static size_t segment_of(struct msghdr *msg, size_t len) {
+	for (struct cmsghdr *cm = CMSG_FIRSTHDR(msg); cm != NULL; cm = CMSG_NXTHDR(msg, cm)) {
+		if (cm->cmsg_level == IPPROTO_UDP && cm->cmsg_type == UDP_GRO) {
+			int size;
+			memcpy(&size, CMSG_DATA(cm), sizeof (size));
+			return size > 0 ? (size_t) size : len;
+		}
+	}
+	return len;
+}
+
+/**
+ * Receives as many datagrams as available (at least one, blocking until
+ * then) with a single call to recvmmsg, in trains if the kernel coalesces
+ * them. Returns -1 on error, 0 otherwise.
+ */
+static int posix_recv_batch(engine_t *e) {
+	struct mmsghdr msgs[RECV_SLOTS];
+	struct iovec iovs[RECV_SLOTS];
+	char ctrl[RECV_SLOTS][RECV_CTRL];
+	memset(msgs, 0, sizeof (msgs));
+
+	for (size_t i = 0; i < e->recvq_slots; i++) {
+		iovs[i].iov_base = e->recvq + i * e->recvq_slot_size;
+		iovs[i].iov_len = e->recvq_slot_size;
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_control = ctrl[i];
+		msgs[i].msg_hdr.msg_controllen = RECV_CTRL;
+	}
+
+	int n;
+	do {
+		n = recvmmsg(e->sockfd, msgs, e->recvq_slots, MSG_WAITFORONE, NULL);
+	} while (n == -1 && errno == EINTR);
+	if (n == -1) {
+		return -1;
+	}
+
+	for (int i = 0; i < n; i++) {
+		e->recvq_len[i] = msgs[i].msg_len;
+		e->recvq_seg[i] = segment_of(&msgs[i].msg_hdr, msgs[i].msg_len);
+		e->recvq_ecn[i] = ecn_of(&msgs[i].msg_hdr);
+	}
+	e->recvq_head = 0;
+	e->recvq_off = 0;
+	e->recvq_count = n;
+	return 0;
+}
+
+/**
+ * Returns a free submission entry, submitting the pending ones if the
+ * submission queue is full. Returns NULL on error.
+ */
+static struct io_uring_sqe *get_sqe(engine_t *e) {
+	struct io_uring_sqe *sqe = uring_get_sqe(e->ring);
+	if (sqe == NULL) {
+		if (uring_submit(e->ring, 0, -1) == -1) {
+			return NULL;
+		}
+		e->writes_pending = 0;
+		e->last_write = NULL;
+		sqe = uring_get_sqe(e->ring);
+	}
+	return sqe;
+}
+
+static void prep_rw(struct io_uring_sqe *sqe, int op, int fixed_fd,
+                    char *addr, size_t len, off_t off, uint64_t user_data) {
+	sqe->opcode = op;
+	sqe->fd = fixed_fd;
+	sqe->flags = IOSQE_FIXED_FILE;
+	sqe->addr = (uint64_t) (uintptr_t) addr;
+	sqe->len = len;
+	sqe->off = off;
+	sqe->buf_index = 0;
+	sqe->user_data = user_data;
+}
+
+static int arm_recv(engine_t *e, size_t slot) {
+	struct io_uring_sqe *sqe = get_sqe(e);
+	if (sqe == NULL) {
+		return -1;
+	}
+	struct msghdr *msg = &e->recv_msg[slot];
+	memset(msg, 0, sizeof (*msg));
+	e->recv_iov[slot].iov_base = e->area + RECV_OFF + slot * MAX_PACKET_SIZE;
+	e->recv_iov[slot].iov_len = MAX_PACKET_SIZE;
+	msg->msg_iov = &e->recv_iov[slot];
+	msg->msg_iovlen = 1;
+	msg->msg_control = e->recv_ctrl[slot];
+	msg->msg_controllen = RECV_CTRL;
+
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = FIXED_SOCK;
+	sqe->flags = IOSQE_FIXED_FILE;
+	sqe->addr = (uint64_t) (uintptr_t) msg;
+	sqe->len = 1;
+	sqe->user_data = USER_DATA(OP_RECV, slot);
+	return 0;
+}
+
+/**
+ * Processes all available completions.
+ */
+static void reap(engine_t *e) {
+	struct io_uring_cqe cqe;
+	while (uring_pop_cqe(e->ring, &cqe) == 0) {
+		size_t slot = USER_SLOT(cqe.user_data);
+		switch (USER_OP(cqe.user_data)) {
+		case OP_SEND:
+			e->sends_inflight--;
+			break;
+		case OP_RECV:
+			if (cqe.res >= 0) {
+				size_t tail = (e->ready_head + e->ready_count) % RECV_SLOTS;
+				e->ready[tail] = slot;
+				e->recv_len[slot] = cqe.res;
+				e->ready_count++;
+			}
+			break;
+		case OP_WRITE:
+			e->writes_inflight--;
+			break;
+		case OP_READ:
+			e->read_done = true;
+			e->read_res = cqe.res;
+			continue; // reported by engine_read
+		case OP_WATCH:
+			/* Even on error, so that the caller has a look */
+			e->watch_armed = false;
+			e->watch_ready = true;
+			continue;
+		}
+
+		if (cqe.res < 0 && e->err == 0) {
+			e->err = -cqe.res;
+		}
+	}
+
+	/* Slots can be reused once everything using them has completed */
+	if (e->sends_inflight == 0) {
+		e->sends_used = 0;
+	}
+	if (e->writes_inflight == 0) {
+		e->writes_used = 0;
+	}
+}
+
+/**
+ * Submits the pending entries, waits for at least wait_nr completions (at
+ * most timeout_us microseconds if >= 0) and processes them.
+ * Returns -1 on error (with errno set), and 0 otherwise.
+ */
+static int submit(engine_t *e, unsigned wait_nr, int64_t timeout_us) {
+	/* Writes to unseekable files are linked so that they complete in
+	 * order, and the chain ends with this submission */
+	if (e->last_write != NULL) {
+		e->last_write->flags &= ~IOSQE_IO_LINK;
+	}
+	e->writes_pending = 0;
+	e->last_write = NULL;
+
+	if (uring_submit(e->ring, wait_nr, timeout_us) == -1) {
+		return -1;
+	}
+	reap(e);
+
+	if (e->err != 0) {
+		errno = e->err;
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Starts reading and writing at the current position of the file, if it has
+ * one.
+ */
+static void uring_track_file(engine_t *e) {
+	e->file_off = e->file != NULL ? lseek(fileno(e->file), 0, SEEK_CUR) : -1;
+	e->seekable = e->file_off != -1;
+	if (!e->seekable) {
+		e->file_off = 0;
+	}
+}
+
+/**
+ * Sets up io_uring for the engine. Returns -1 on error, and 0 otherwise.
+ */
+static int uring_setup(engine_t *e) {
+	e->ring = uring_create(URING_ENTRIES);
+	if (e->ring == NULL) {
+		return -1;
+	}
+
+	/* Registered buffers are pinned, keep them page-aligned */
+	e->area_size = (AREA_SIZE + 4095) & ~((size_t) 4095);
+	void *area;
+	int err = posix_memalign(&area, 4096, e->area_size);
+	if (err != 0) {
+		/* It returns the error rather than setting errno */
+		errno = err;
+		return -1;
+	}
+	e->area = area;
+	memset(e->area, 0, e->area_size);
+
+	struct iovec iov = {e->area, e->area_size};
+	if (uring_register_buffers(e->ring, &iov, 1) == -1) {
+		return -1;
+	}
+
+	int fds[] = {e->sockfd, e->file != NULL ? fileno(e->file) : -1};
+	if (uring_register_files(e->ring, fds, 2) == -1) {
+		return -1;
+	}
+	uring_track_file(e);
+
+	for (size_t i = 0; i < RECV_SLOTS; i++) {
+		if (arm_recv(e, i) == -1) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void uring_teardown(engine_t *e) {
+	if (e->ring != NULL) {
+		uring_free(e->ring);
+		e->ring = NULL;
+	}
+	free(e->area);
+	e->area = NULL;
+}
+
+engine_t *engine_create(engine_type_t type, int sockfd, FILE *file) {
+	engine_t *e = calloc(1, sizeof (engine_t));
+	if (e == NULL) {
+		return NULL;
+	}
+
+	e->type = type;
+	e->sockfd = sockfd;
+	e->file = file;
+	e->watch_fd = -1;
+
+	if (type == ENGINE_GSO) {
+		/* GSO and GRO only change how the posix engine sends and
+		 * receives its batches */
+		e->type = ENGINE_POSIX;
+		e->gso = udp_gso_supported(sockfd);
+		if (!e->gso) {
+			log_msg("UDP GSO unavailable, falling back to posix\n");
+		}
+		e->gro = udp_gro_enable(sockfd);
+		if (!e->gro) {
+			log_msg("UDP GRO unavailable, receiving datagrams one by one\n");
+		}
+	}
+
+	/* A train takes a whole slot, but a few of them carry more datagrams
+	 * than many single ones */
+	e->recvq_slots = e->gro ? GRO_SLOTS : RECV_SLOTS;
+	e->recvq_slot_size = e->gro ? GRO_TRAIN_SIZE : MAX_PACKET_SIZE;
+	e->sendq = malloc(SEND_SLOTS * MAX_PACKET_SIZE);
+	e->recvq = malloc(e->recvq_slots * e->recvq_slot_size);
+	if (e->sendq == NULL || e->recvq == NULL) {
+		free(e->sendq);
+		free(e->recvq);
+		free(e);
+		return NULL;
+	}
+
+	if (type == ENGINE_URING && uring_setup(e) == -1) {
+		log_msg("io_uring unavailable (%s), falling back to posix\n",
+			strerror(errno));
+		uring_teardown(e);
+		e->type = ENGINE_POSIX;
+	}
+
+	return e;
+}
+
+void engine_free(engine_t *e) {
+	engine_flush(e);
+	if (e->type == ENGINE_URING) {
+		/* Leave the file position where a stdio user would expect it */
+		if (e->file != NULL && e->seekable) {
+			lseek(fileno(e->file), e->file_off, SEEK_SET);
+		}
+		uring_teardown(e);
+	}
+	free(e->sendq);
+	free(e->recvq);
+	free(e);
+}
+
+engine_type_t engine_get_type(engine_t *e) {
+	if (e->gso) {
+		return ENGINE_GSO;
+	}
+	return e->type;
+}
+
+int engine_set_file(engine_t *e, FILE *file) {
+	if (engine_flush(e) == -1) {
+		return -1;
+	}
+
+	if (e->type == ENGINE_URING) {
+		/* Leave the position in the previous file like engine_free */
+		if (e->file != NULL && e->seekable) {
+			lseek(fileno(e->file), e->file_off, SEEK_SET);
+		}
+		if (uring_update_file(e->ring, 1, file != NULL ? fileno(file) : -1) == -1) {
+			return -1;
+		}
+	}
+
+	e->file = file;
+	e->wrote = false;
+	if (e->type == ENGINE_URING) {
+		uring_track_file(e);
+	}
+	return 0;
+}
+
+int engine_send(engine_t *e, const pkt_t *pkt) {
+	if (e->type == ENGINE_POSIX) {
+		if (e->sendq_count == SEND_SLOTS && posix_send_queued(e) == -1) {
+			return -1;
+		}
+
+		struct iovec *iov = &e->sendq_iov[e->sendq_iovcnt];
+		char *buf = e->sendq + e->sendq_used;
+		size_t niov;
+
+		if (pkt_has_payload_ref(pkt)) {
+			/* Send the payload from where it is, without copying */
+			char *crc2 = buf + HEADER_SIZE;
+			if (pkt_encode_header(pkt, buf, crc2) != PKT_OK) {
+				errno = EINVAL;
+				return -1;
+			}
+			iov[0].iov_base = buf;
+			iov[0].iov_len = HEADER_SIZE;
+			iov[1].iov_base = (char *) pkt_get_payload(pkt);
+			iov[1].iov_len = pkt_get_length(pkt);
+			iov[2].iov_base = crc2;
+			iov[2].iov_len = sizeof (uint32_t);
+			niov = 3;
+			e->sendq_used += HEADER_SIZE + sizeof (uint32_t);
+		} else {
+			size_t len = MAX_PACKET_SIZE;
+			if (pkt_encode(pkt, buf, &len) != PKT_OK) {
+				errno = EINVAL;
+				return -1;
+			}
+			iov[0].iov_base = buf;
+			iov[0].iov_len = len;
+			niov = 1;
+			e->sendq_used += len;
+		}
+
+		size_t len = 0;
+		for (size_t i = 0; i < niov; i++) {
+			len += iov[i].iov_len;
+		}
+
+		e->sendq_first_iov[e->sendq_count] = e->sendq_iovcnt;
+		e->sendq_niov[e->sendq_count] = niov;
+		e->sendq_len[e->sendq_count] = len;
+		e->sendq_count++;
+		e->sendq_iovcnt += niov;
+		return 0;
+	}
+
+	/* Wait for the previous sends to complete to get back their slots */
+	while (e->sends_used == SEND_SLOTS) {
+		if (submit(e, 1, -1) == -1) {
+			return -1;
+		}
+	}
+
+	size_t slot = e->sends_used;
+	char *buf = e->area + SEND_OFF + slot * MAX_PACKET_SIZE;
+
+	struct io_uring_sqe *sqe = get_sqe(e);
+	if (sqe == NULL) {
+		return -1;
+	}
+
+	if (pkt_has_payload_ref(pkt)) {
+		/* Gather the payload from where it is, the slot only holds the
+		 * header and the CRC */
+		char *crc2 = buf + HEADER_SIZE;
+		if (pkt_encode_header(pkt, buf, crc2) != PKT_OK) {
+			errno = EINVAL;
+			return -1;
+		}
+		struct iovec *iov = e->send_iov[slot];
+		iov[0].iov_base = buf;
+		iov[0].iov_len = HEADER_SIZE;
+		iov[1].iov_base = (char *) pkt_get_payload(pkt);
+		iov[1].iov_len = pkt_get_length(pkt);
+		iov[2].iov_base = crc2;
+		iov[2].iov_len = sizeof (uint32_t);
+
+		prep_rw(sqe, IORING_OP_WRITEV, FIXED_SOCK, (char *) iov, 3, -1,
+			USER_DATA(OP_SEND, slot));
+	} else {
+		size_t len = MAX_PACKET_SIZE;
+		if (pkt_encode(pkt, buf, &len) != PKT_OK) {
+			errno = EINVAL;
+			return -1;
+		}
+		prep_rw(sqe, IORING_OP_WRITE_FIXED, FIXED_SOCK, buf, len, -1,
+			USER_DATA(OP_SEND, slot));
+	}
+
+	e->sends_used++;
+	e->sends_inflight++;
+	return 0;
+}
+
+int engine_write(engine_t *e, const char *buf, size_t len) {
+	e->wrote = true;
+
+	if (e->type == ENGINE_POSIX) {
+		if (fwrite(buf, sizeof (*buf), len, e->file) < len) {
+			return -1;
+		}
+		return fflush(e->file) == 0 ? 0 : -1;
+	}
+
+	while (len > 0) {
+		size_t chunk = len < MAX_PAYLOAD_SIZE ? len : MAX_PAYLOAD_SIZE;
+
+		/* Wait for slots to be freed, and with an unseekable file, for
+		 * the writes of previous submissions to keep them in order */
+		while (e->writes_used == WRITE_SLOTS ||
+		       (!e->seekable && e->writes_inflight > e->writes_pending)) {
+			if (submit(e, 1, -1) == -1) {
+				return -1;
+			}
+		}
+
+		char *slot = e->area + WRITE_OFF + e->writes_used * MAX_PAYLOAD_SIZE;
+		memcpy(slot, buf, chunk);
+
+		struct io_uring_sqe *sqe = get_sqe(e);
+		if (sqe == NULL) {
+			return -1;
+		}
+		prep_rw(sqe, IORING_OP_WRITE_FIXED, FIXED_FILE, slot, chunk,
+			e->seekable ? e->file_off : -1,
+			USER_DATA(OP_WRITE, e->writes_used));
+		if (!e->seekable) {
+			sqe->flags |= IOSQE_IO_LINK;
+			e->last_write = sqe;
+		}
+
+		e->file_off += chunk;
+		e->writes_used++;
+		e->writes_inflight++;
+		e->writes_pending++;
+		buf += chunk;
+		len -= chunk;
+	}
+	return 0;
+}
+
+int engine_seek(engine_t *e, off_t offset) {
+	if (engine_flush(e) == -1) {
+		return -1;
+	}
+
+	if (e->type == ENGINE_POSIX) {
+		return fseeko(e->file, offset, SEEK_SET);
+	}
+
+	if (!e->seekable) {
+		errno = ESPIPE;
+		return -1;
+	}
+	e->file_off = offset;
+	return 0;
+}
+
+off_t engine_tell(engine_t *e) {
+	if (e->type == ENGINE_POSIX) {
+		return ftello(e->file);
+	}
+
+	if (!e->seekable) {
+		errno = ESPIPE;
+		return -1;
+	}
+	return e->file_off;
+}
+
+ssize_t engine_read(engine_t *e, char *buf, size_t len) {
+	if (e->type == ENGINE_POSIX) {
+		/* Don't hold back queued packets while the read blocks */
+		if (posix_send_queued(e) == -1) {
+			return -1;
+		}
+
+		/* stdio remembers EOF, but the file may have grown since */
+		clearerr(e->file);
+		size_t n = fread(buf, sizeof (*buf), len, e->file);
+		if (n < len && ferror(e->file)) {
+			return -1;
+		}
+		return n;
+	}
+
+	if (len > READ_AREA) {
+		len = READ_AREA;
+	}
+
+	struct io_uring_sqe *sqe = get_sqe(e);
+	if (sqe == NULL) {
+		return -1;
+	}
+	prep_rw(sqe, IORING_OP_READ_FIXED, FIXED_FILE, e->area + READ_OFF, len,
+		e->seekable ? e->file_off : -1, USER_DATA(OP_READ, 0));
+
+	e->read_done = false;
+	while (!e->read_done) {
+		if (submit(e, 1, -1) == -1) {
+			return -1;
+		}
+	}
+
+	if (e->read_res < 0) {
+		errno = -e->read_res;
+		return -1;
+	}
+
+	memcpy(buf, e->area + READ_OFF, e->read_res);
+	e->file_off += e->read_res;
+	return e->read_res;
+}
+
+void engine_watch(engine_t *e, int fd) {
+	e->watch_fd = fd;
+	e->watch_ready = false;
+}
+
+int engine_wait(engine_t *e, int64_t timeout_us) {
+	if (e->type == ENGINE_POSIX) {
+		if (posix_send_queued(e) == -1) {
+			return -1;
+		}
+		if (e->recvq_count > 0) {
+			return 1;
+		}
+
+		fd_set read_fds;
+		FD_ZERO(&read_fds);
+		FD_SET(e->sockfd, &read_fds);
+		int nfds = e->sockfd + 1;
+		if (e->watch_fd != -1) {
+			FD_SET(e->watch_fd, &read_fds);
+			if (e->watch_fd >= nfds) {
+				nfds = e->watch_fd + 1;
+			}
+		}
+
+		struct timeval tv = micro_to_timeval(timeout_us);
+		int n = select(nfds, &read_fds, NULL, NULL,
+			timeout_us < 0 ? NULL : &tv);
+		if (n == -1) {
+			return -1;
+		}
+		return FD_ISSET(e->sockfd, &read_fds) ? 1 : 0;
+	}
+
+	int64_t deadline = now_us() + timeout_us;
+
+	/* The watched descriptor isn't registered, and its poll is one-shot:
+	 * arm it again once it has completed */
+	if (e->watch_fd != -1 && !e->watch_armed) {
+		struct io_uring_sqe *sqe = get_sqe(e);
+		if (sqe == NULL) {
+			return -1;
+		}
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = e->watch_fd;
+		sqe->poll32_events = POLLIN;
+		sqe->user_data = USER_DATA(OP_WATCH, 0);
+		e->watch_armed = true;
+	}
+
+	/* Always submit at least once so that queued operations go out */
+	if (submit(e, 0, -1) == -1) {
+		return -1;
+	}
+
+	while (e->ready_count == 0) {
+		if (e->watch_ready) {
+			e->watch_ready = false;
+			return 0;
+		}
+
+		int64_t left = -1;
+		if (timeout_us >= 0) {
+			left = deadline - now_us();
+			if (left <= 0) {
+				return 0;
+			}
+		}
+		/* Completions of sends and writes wake us up as well */
+		if (submit(e, 1, left) == -1) {
+			return -1;
+		}
+	}
+	return 1;
+}
+
+ssize_t engine_recv(engine_t *e, char *buf, size_t len) {
+	if (e->type == ENGINE_POSIX) {
+		if (e->recvq_count == 0) {
+			/* We're about to block, send what's queued first */
+			if (posix_send_queued(e) == -1 || posix_recv_batch(e) == -1) {
+				return -1;
+			}
+		}
+
+		/* Split the next datagram off the train at the head */
+		size_t slot = e->recvq_head;
+		size_t off = e->recvq_off;
+		size_t dgram = e->recvq_len[slot] - off;
+		if (dgram > e->recvq_seg[slot]) {
+			dgram = e->recvq_seg[slot];
+		}
+		e->recvq_off += dgram;
+		if (e->recvq_off == e->recvq_len[slot]) {
+			e->recvq_head++;
+			e->recvq_off = 0;
+			e->recvq_count--;
+		}
+
+		size_t n = dgram;
+		if (n > len) {
+			n = len;
+		}
+		memcpy(buf, e->recvq + slot * e->recvq_slot_size + off, n);
+		e->last_ecn = e->recvq_ecn[slot];
+		return n;
+	}
+
+	if (engine_wait(e, -1) == -1) {
+		return -1;
+	}
+
+	size_t slot = e->ready[e->ready_head];
+	e->ready_head = (e->ready_head + 1) % RECV_SLOTS;
+	e->ready_count--;
+
+	size_t n = e->recv_len[slot];
+	if (n > len) {
+		n = len;
+	}
+	memcpy(buf, e->area + RECV_OFF + slot * MAX_PACKET_SIZE, n);
+	e->last_ecn = ecn_of(&e->recv_msg[slot]);
+
+	/* Hand the slot back to the kernel with the next submission */
+	if (arm_recv(e, slot) == -1) {
+		return -1;
+	}
+	return n;
+}
+
+uint8_t engine_recv_ecn(engine_t *e) {
+	return e->last_ecn;
+}
+
+size_t engine_pending(engine_t *e) {
+	if (e->type == ENGINE_POSIX) {
+		size_t pending = 0;
+		for (size_t i = 0; i < e->recvq_count; i++) {
+			size_t slot = e->recvq_head + i;
+			size_t left = e->recvq_len[slot] - (i == 0 ? e->recvq_off : 0);
+			size_t seg = e->recvq_seg[slot];
+			pending += seg > 0 ? (left + seg - 1) / seg : 1;
+		}
+		return pending;
+	}
+	return e->ready_count;
+}
+
+int engine_flush(engine_t *e) {
+	if (e->type == ENGINE_POSIX) {
+		if (posix_send_queued(e) == -1) {
+			return -1;
+		}
+		if (e->wrote && fflush(e->file) != 0) {
+			return -1;
+		}
+		return 0;
+	}
+
+	if (submit(e, 0, -1) == -1) {
+		return -1;
+	}
+	while (e->sends_inflight > 0 || e->writes_inflight > 0) {
+		if (submit(e, 1, -1) == -1) {
+			return -1;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,138 @@
+#ifndef __ENGINE_H_
+#define __ENGINE_H_
+
+
+/**
+ * I/O engine through which the sender and receiver access their socket and
+ * file. Operations that don't return data (sends and file writes) may be
+ * queued and only handed over to the kernel on the next call that waits, so
+ * that one system call can carry many of them.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "packet_interface.h"
+
+typedef enum {
+	ENGINE_POSIX = 0, /* sendmmsg/recvmmsg batches, blocking file I/O */
+	ENGINE_GSO,       /* posix, with batches segmented by the kernel */
+	ENGINE_URING,     /* batched submissions through io_uring */
+} engine_type_t;
+
+typedef struct engine engine_t;
+
+/**
+ * Parses the name of an engine ("posix", "gso" or "uring").
+ * Returns -1 if the name is unknown, and 0 otherwise.
+ */
+int engine_parse(const char *name, engine_type_t *type);
+
+/**
+ * Returns the name of the engine type.
+ */
+const char *engine_name(engine_type_t type);
+
+/**
+ * Creates an engine operating on the connected socket and the file (which
+ * may be NULL until engine_set_file).
+ * If io_uring or UDP GSO is requested but isn't available, falls back to
+ * ENGINE_POSIX.
+ * The socket must not be read from by other means afterwards.
+ * Returns NULL on error.
+ */
+engine_t *engine_create(engine_type_t type, int sockfd, FILE *file);
+
+/**
+ * Flushes the engine and releases its resources (NOT the socket or file).
+ */
+void engine_free(engine_t *e);
+
+/**
+ * Returns the type of engine actually in use.
+ */
+engine_type_t engine_get_type(engine_t *e);
+
+/**
+ * Waits for the queued writes to complete, then makes the engine operate on
+ * another file (NOT closing the previous one), from its current position.
+ * Returns -1 on error (with errno set), and 0 otherwise.
+ */
+int engine_set_file(engine_t *e, FILE *file);
+
+/**
+ * Encodes and queues the packet to be sent on the socket.
+ * Returns -1 on error (with errno set), and 0 otherwise.
+ */
+int engine_send(engine_t *e, const pkt_t *pkt);
+
+/**
+ * Queues len bytes to be appended to the file.
+ * Returns -1 on error (with errno set), and 0 otherwise.
+ */
+int engine_write(engine_t *e, const char *buf, size_t len);
+
+/**
+ * Waits for the queued writes to complete, then moves the position of the
+ * next read or write to offset, which requires a seekable file.
+ * Returns -1 on error (with errno set), and 0 otherwise.
+ */
+int engine_seek(engine_t *e, off_t offset);
+
+/**
+ * Returns the position of the next read or write, which requires a seekable
+ * file, or -1 on error (with errno set).
+ */
+off_t engine_tell(engine_t *e);
+
+/**
+ * Reads at most len bytes from the file. After EOF, reading again returns
+ * what was appended to the file since.
+ * Returns the number of bytes read, 0 on EOF, or -1 on error.
+ */
+ssize_t engine_read(engine_t *e, char *buf, size_t len);
+
+/**
+ * Makes engine_wait also return when fd becomes readable (-1 to stop).
+ * The engine never reads from it.
+ */
+void engine_watch(engine_t *e, int fd);
+
+/**
+ * Submits the queued operations and waits until either a datagram can be
+ * received, the watched file descriptor is readable or timeout_us
+ * microseconds have elapsed (indefinitely if timeout_us < 0).
+ * Returns 1 if a datagram is ready, 0 on timeout or if only the watched file
+ * descriptor is readable, and -1 on error.
+ */
+int engine_wait(engine_t *e, int64_t timeout_us);
+
+/**
+ * Submits the queued operations and receives one datagram, blocking
+ * until there is one.
+ * Returns its length, or -1 on error.
+ */
+ssize_t engine_recv(engine_t *e, char *buf, size_t len);
+
+/**
+ * Returns the ECN field of the datagram engine_recv returned last, which is
+ * only known if the socket reports it (see report_ecn), 0 otherwise.
+ */
+uint8_t engine_recv_ecn(engine_t *e);
+
+/**
+ * Returns the number of datagrams already received by the engine, which
+ * engine_recv hands out without any system call.
+ */
+size_t engine_pending(engine_t *e);
+
+/**
+ * Submits the queued operations and waits for all of them to complete.
+ * Returns -1 on error (with errno set), and 0 otherwise.
+ */
+int engine_flush(engine_t *e);
+
+
+#endif  /* __ENGINE_H_ */
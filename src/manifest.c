@@ -0,0 +1,170 @@
+#include <dirent.h>
+#include <endian.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "manifest.h"
+
+/**
+ * Appends an entry for path, whose name starts at name_off, to m.
+ * Returns -1 on error, and 0 otherwise.
+ */
+static int add_entry(manifest_t *m, size_t *cap, const char *path, size_t name_off,
+		uint32_t mode) {
+	if (m->count == *cap) {
+		size_t new_cap = *cap > 0 ? 2 * *cap : 64;
+		manifest_entry_t *entries = realloc(m->entries, new_cap * sizeof (manifest_entry_t));
+		if (entries == NULL) {
+			return -1;
+		}
+		m->entries = entries;
+		*cap = new_cap;
+	}
+
+	char *copy = strdup(path);
+	if (copy == NULL) {
+		return -1;
+	}
+	m->entries[m->count++] = (manifest_entry_t) {
+		.path = copy,
+		.name = copy + name_off,
+		.mode = mode,
+	};
+	return 0;
+}
+
+/**
+ * Adds what the directory at path contains to m, recursively.
+ * Returns -1 on error, and 0 otherwise.
+ */
+static int scan_dir(manifest_t *m, size_t *cap, const char *path, size_t name_off) {
+	DIR *dir = opendir(path);
+	if (dir == NULL) {
+		return -1;
+	}
+
+	int ret = 0;
+	struct dirent *de;
+	while (ret == 0 && (errno = 0, de = readdir(dir)) != NULL) {
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+			continue;
+		}
+
+		size_t len = strlen(path) + 1 + strlen(de->d_name) + 1;
+		char *child = malloc(len);
+		if (child == NULL) {
+			ret = -1;
+			break;
+		}
+		snprintf(child, len, "%s/%s", path, de->d_name);
+
+		struct stat st;
+		if (lstat(child, &st) == -1) {
+			ret = -1;
+		} else if ((!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode)) ||
+		           strlen(child + name_off) > FILE_NAME_MAX) {
+			m->skipped++;
+		} else if (add_entry(m, cap, child, name_off, st.st_mode) == -1) {
+			ret = -1;
+		} else if (S_ISDIR(st.st_mode)) {
+			ret = scan_dir(m, cap, child, name_off);
+		}
+		free(child);
+	}
+	if (de == NULL && errno != 0) {
+		ret = -1;
+	}
+
+	int saved = errno;
+	closedir(dir);
+	errno = saved;
+	return ret;
+}
+
+manifest_t *manifest_scan(const char *dir) {
+	manifest_t *m = calloc(1, sizeof (manifest_t));
+	if (m == NULL) {
+		return NULL;
+	}
+
+	/* Names start after the directory and its slash */
+	size_t cap = 0;
+	if (scan_dir(m, &cap, dir, strlen(dir) + 1) == -1) {
+		int saved = errno;
+		manifest_free(m);
+		errno = saved;
+		return NULL;
+	}
+	return m;
+}
+
+void manifest_free(manifest_t *m) {
+	for (size_t i = 0; i < m->count; i++) {
+		free(m->entries[i].path);
+	}
+	free(m->entries);
+	free(m);
+}
+
+/*
+ * Layout (big-endian): 0: size (64 bits), 8: mode (32 bits), 12: name (up to
+ * the end of the payload, without a NUL).
+ */
+size_t file_hdr_encode(const file_hdr_t *h, char *buf) {
+	uint64_t size = htobe64(h->size);
+	uint32_t mode = htobe32(h->mode);
+	size_t name_len = strlen(h->name);
+
+	memcpy(buf, &size, sizeof (size));
+	memcpy(buf + 8, &mode, sizeof (mode));
+	memcpy(buf + FILE_HDR_MIN, h->name, name_len);
+	return FILE_HDR_MIN + name_len;
+}
+
+/**
+ * Returns whether the name is a relative path without empty, "." or ".."
+ * components, which can't lead out of the directory.
+ */
+static bool name_valid(const char *name) {
+	const char *c = name;
+	while (true) {
+		const char *end = strchr(c, '/');
+		size_t len = end != NULL ? (size_t) (end - c) : strlen(c);
+		if (len == 0 || (len == 1 && c[0] == '.') ||
+		    (len == 2 && c[0] == '.' && c[1] == '.')) {
+			return false;
+		}
+		if (end == NULL) {
+			return true;
+		}
+		c = end + 1;
+	}
+}
+
+int file_hdr_decode(const char *buf, size_t len, file_hdr_t *h) {
+	if (len <= FILE_HDR_MIN || len > FILE_HDR_MIN + FILE_NAME_MAX) {
+		return -1;
+	}
+
+	uint64_t size;
+	uint32_t mode;
+	memcpy(&size, buf, sizeof (size));
+	memcpy(&mode, buf + 8, sizeof (mode));
+	h->size = be64toh(size);
+	h->mode = be32toh(mode);
+
+	size_t name_len = len - FILE_HDR_MIN;
+	memcpy(h->name, buf + FILE_HDR_MIN, name_len);
+	h->name[name_len] = '\0';
+
+	if (strlen(h->name) != name_len || !name_valid(h->name)) {
+		return -1;
+	}
+	if (!S_ISREG(h->mode) && !S_ISDIR(h->mode)) {
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,67 @@
+#ifndef __MANIFEST_H_
+#define __MANIFEST_H_
+
+
+/**
+ * Transfers of whole directories. The files of the directory are sent one
+ * after the other in the same session, each after a FILE_KIND packet with
+ * its header: its name relative to the directory, size and mode. Directories
+ * get a header as well, so that empty ones are created too.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "packet_interface.h"
+
+#define FILE_HDR_MIN 12 /* encoded size of a header before the name */
+#define FILE_NAME_MAX (MAX_PAYLOAD_SIZE - FILE_HDR_MIN) /* longest name */
+
+typedef struct file_hdr {
+	uint64_t size; /* 0 for directories */
+	uint32_t mode; /* st_mode, with the file type */
+	char name[FILE_NAME_MAX + 1]; /* relative path, NUL-terminated */
+} file_hdr_t;
+
+typedef struct manifest_entry {
+	char *path; /* path to open */
+	const char *name; /* part of path relative to the directory */
+	uint32_t mode;
+} manifest_entry_t;
+
+typedef struct manifest {
+	manifest_entry_t *entries; /* each directory before what it contains */
+	size_t count;
+	size_t skipped; /* entries neither regular files nor directories, or
+	                   whose name is too long */
+} manifest_t;
+
+/**
+ * Lists the regular files and directories under dir, recursively (without
+ * following symbolic links).
+ * Returns NULL on error, with errno set.
+ */
+manifest_t *manifest_scan(const char *dir);
+
+/**
+ * Releases the manifest.
+ */
+void manifest_free(manifest_t *m);
+
+/**
+ * Encodes the header in buf, which must be at least MAX_PAYLOAD_SIZE bytes
+ * long.
+ * Returns the encoded length.
+ */
+size_t file_hdr_encode(const file_hdr_t *h, char *buf);
+
+/**
+ * Decodes the header in the len bytes at buf.
+ * Returns -1 if it's invalid, including if its name isn't a relative path
+ * staying inside the directory, and 0 otherwise.
+ */
+int file_hdr_decode(const char *buf, size_t len, file_hdr_t *h);
+
+
+#endif  /* __MANIFEST_H_ */
@@ -0,0 +1,50 @@
+#include "message.h"
+
+/**
+ * Returns the length of the message whose header is at buf.
+ */
+static size_t message_len(const char *buf) {
+	return ((unsigned char) buf[0] << 8) | (unsigned char) buf[1];
+}
+
+ssize_t message_pack(const char *buf, size_t len, size_t size, bool *full) {
+	size_t used = 0;
+	*full = false;
+	while (used + MSG_HDR_SIZE <= len) {
+		size_t msg_len = message_len(buf + used);
+		if (msg_len == 0 || msg_len > MSG_MAX_SIZE) {
+			return -1;
+		}
+		if (used + MSG_HDR_SIZE + msg_len > size) {
+			*full = true;
+			break;
+		}
+		if (used + MSG_HDR_SIZE + msg_len > len) {
+			/* Not all there yet */
+			break;
+		}
+		used += MSG_HDR_SIZE + msg_len;
+	}
+	/* No room for even the shortest message */
+	if (used + MSG_HDR_SIZE + 1 > size) {
+		*full = true;
+	}
+	return used;
+}
+
+ssize_t message_count(const char *payload, size_t len) {
+	size_t used = 0;
+	ssize_t count = 0;
+	while (used < len) {
+		if (used + MSG_HDR_SIZE > len) {
+			return -1;
+		}
+		size_t msg_len = message_len(payload + used);
+		if (msg_len == 0 || used + MSG_HDR_SIZE + msg_len > len) {
+			return -1;
+		}
+		used += MSG_HDR_SIZE + msg_len;
+		count++;
+	}
+	return count;
+}
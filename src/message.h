@@ -0,0 +1,38 @@
+#ifndef __MESSAGE_H_
+#define __MESSAGE_H_
+
+
+/**
+ * Messages carried in message mode. The application writes records to the
+ * sender each preceded by their length (big-endian u16), and the receiver
+ * writes them out the same way. Payloads are made of whole messages, as many
+ * as fit, so that records are never split and the receiver delivers them
+ * whole.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "packet_interface.h"
+
+#define MSG_HDR_SIZE 2 /* length preceding each message */
+#define MSG_MAX_SIZE (MAX_PAYLOAD_SIZE - MSG_HDR_SIZE) /* longest message */
+
+/**
+ * Finds the whole messages at the start of the len bytes at buf that fit in
+ * a payload of size bytes. Sets *full if the payload couldn't take the next
+ * message as well, as far as we can tell from its length.
+ * Returns their length (with their headers), or -1 if a message has an
+ * invalid length (0 or more than MSG_MAX_SIZE).
+ */
+ssize_t message_pack(const char *buf, size_t len, size_t size, bool *full);
+
+/**
+ * Returns the number of messages in a payload, or -1 if it isn't made of
+ * whole messages.
+ */
+ssize_t message_count(const char *payload, size_t len);
+
+
+#endif  /* __MESSAGE_H_ */
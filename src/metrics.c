@@ -0,0 +1,197 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "metrics.h"
+
+#define MAGIC "PMC1"
+#define SLOTS 1024 /* entries in the table */
+#define PROBES 8 /* slots where an address may be, from the one it hashes to */
+
+/* The file is only ever used on this host, in native byte order */
+typedef struct entry {
+	struct in6_addr addr;
+	int64_t updated; /* time of the last update, 0 if the slot is free */
+	path_metrics_t m;
+} entry_t;
+
+typedef struct header {
+	char magic[4];
+	uint32_t slots;
+	uint32_t entry_size; /* catches changes of layout */
+	uint32_t reserved;
+} header_t;
+
+struct metrics_cache {
+	int fd;
+	header_t *hdr;
+	entry_t *entries; /* right after the header */
+	size_t len;
+};
+
+/**
+ * Returns whether the header is the one of a valid cache.
+ */
+static bool valid_header(const header_t *hdr) {
+	return memcmp(hdr->magic, MAGIC, 4) == 0 && hdr->slots == SLOTS &&
+		hdr->entry_size == sizeof (entry_t);
+}
+
+metrics_cache_t *metrics_open(const char *path) {
+	metrics_cache_t *c = calloc(1, sizeof (metrics_cache_t));
+	if (c == NULL) {
+		return NULL;
+	}
+	c->len = sizeof (header_t) + SLOTS * sizeof (entry_t);
+
+	c->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (c->fd == -1) {
+		free(c);
+		return NULL;
+	}
+	if (flock(c->fd, LOCK_EX) == -1) {
+		goto fail_fd;
+	}
+
+	struct stat st;
+	if (fstat(c->fd, &st) == -1) {
+		goto fail_fd;
+	}
+	header_t hdr;
+	bool valid = st.st_size == (off_t) c->len &&
+		pread(c->fd, &hdr, sizeof (hdr), 0) == sizeof (hdr) && valid_header(&hdr);
+	if (!valid) {
+		/* Start over with an empty table, which truncating zeroes */
+		memset(&hdr, 0, sizeof (hdr));
+		memcpy(hdr.magic, MAGIC, 4);
+		hdr.slots = SLOTS;
+		hdr.entry_size = sizeof (entry_t);
+		if (ftruncate(c->fd, 0) == -1 || ftruncate(c->fd, c->len) == -1 ||
+		    pwrite(c->fd, &hdr, sizeof (hdr), 0) != sizeof (hdr)) {
+			goto fail_fd;
+		}
+	}
+
+	void *addr = mmap(NULL, c->len, PROT_READ | PROT_WRITE, MAP_SHARED, c->fd, 0);
+	if (addr == MAP_FAILED) {
+		goto fail_fd;
+	}
+	flock(c->fd, LOCK_UN);
+
+	c->hdr = addr;
+	c->entries = (entry_t *) (c->hdr + 1);
+	return c;
+
+fail_fd:;
+	int err = errno;
+	close(c->fd);
+	free(c);
+	errno = err;
+	return NULL;
+}
+
+void metrics_close(metrics_cache_t *c) {
+	munmap(c->hdr, c->len);
+	close(c->fd);
+	free(c);
+}
+
+/**
+ * Returns the slot an address hashes to (FNV-1a).
+ */
+static size_t slot_of(const struct in6_addr *addr) {
+	uint32_t h = 2166136261u;
+	for (size_t i = 0; i < sizeof (addr->s6_addr); i++) {
+		h = (h ^ addr->s6_addr[i]) * 16777619u;
+	}
+	return h % SLOTS;
+}
+
+/**
+ * Returns the entry of addr, or NULL if it has none. Must hold the lock.
+ */
+static entry_t *find_entry(metrics_cache_t *c, const struct in6_addr *addr) {
+	size_t slot = slot_of(addr);
+	for (size_t i = 0; i < PROBES; i++) {
+		entry_t *e = &c->entries[(slot + i) % SLOTS];
+		if (e->updated == 0) {
+			/* Slots are never freed, so it would be here */
+			return NULL;
+		}
+		if (memcmp(&e->addr, addr, sizeof (*addr)) == 0) {
+			return e;
+		}
+	}
+	return NULL;
+}
+
+int metrics_lookup(metrics_cache_t *c, const struct in6_addr *addr, time_t now,
+		path_metrics_t *m) {
+	if (flock(c->fd, LOCK_SH) == -1) {
+		return -1;
+	}
+	entry_t *e = find_entry(c, addr);
+	bool fresh = e != NULL && now - e->updated <= METRICS_MAX_AGE;
+	if (fresh) {
+		*m = e->m;
+	}
+	flock(c->fd, LOCK_UN);
+	return fresh ? 0 : -1;
+}
+
+/**
+ * Returns the average of the old and new values of a metric, or the one that
+ * is known.
+ */
+static uint64_t merge(uint64_t old, uint64_t new) {
+	if (old == 0 || new == 0) {
+		return old + new;
+	}
+	return (old + new) / 2;
+}
+
+int metrics_update(metrics_cache_t *c, const struct in6_addr *addr, time_t now,
+		const path_metrics_t *m) {
+	if (flock(c->fd, LOCK_EX) == -1) {
+		return -1;
+	}
+
+	entry_t *e = find_entry(c, addr);
+	if (e == NULL) {
+		/* A free slot, or else the one updated the longest ago */
+		size_t slot = slot_of(addr);
+		for (size_t i = 0; i < PROBES; i++) {
+			entry_t *cur = &c->entries[(slot + i) % SLOTS];
+			if (e == NULL || cur->updated < e->updated) {
+				e = cur;
+			}
+			if (cur->updated == 0) {
+				break;
+			}
+		}
+		memset(e, 0, sizeof (*e));
+		e->addr = *addr;
+	} else if (now - e->updated > METRICS_MAX_AGE) {
+		memset(&e->m, 0, sizeof (e->m));
+	}
+
+	e->m.srtt = merge(e->m.srtt, m->srtt);
+	e->m.rttvar = merge(e->m.rttvar, m->rttvar);
+	e->m.rate = merge(e->m.rate, m->rate);
+	if (m->payload_size != 0) {
+		e->m.payload_size = m->payload_size;
+	}
+	if (m->window != 0) {
+		e->m.window = m->window;
+	}
+	e->updated = now;
+
+	flock(c->fd, LOCK_UN);
+	return 0;
+}
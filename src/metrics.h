@@ -0,0 +1,61 @@
+#ifndef __METRICS_H_
+#define __METRICS_H_
+
+
+/**
+ * Cache of what previous transfers learnt about the path to each receiver,
+ * so that new ones don't start from scratch. It is a fixed-size hash table
+ * keyed by address, in a file mapped in memory by all the senders using it,
+ * which lock it while they read or update it. Entries that weren't updated
+ * for METRICS_MAX_AGE are ignored, then replaced.
+ */
+
+#include <netinet/in.h>
+#include <stdint.h>
+#include <time.h>
+
+#define METRICS_MAX_AGE 3600 /* in seconds */
+
+/**
+ * Metrics of a path, where 0 means unknown.
+ */
+typedef struct path_metrics {
+	uint32_t srtt; /* smoothed RTT, in microseconds */
+	uint32_t rttvar; /* its variation, in microseconds */
+	uint64_t rate; /* rate achieved, in bytes per second */
+	uint16_t payload_size; /* negotiated with the receiver */
+	uint16_t window; /* last advertised by the receiver */
+} path_metrics_t;
+
+typedef struct metrics_cache metrics_cache_t;
+
+/**
+ * Opens the cache in the file at path, creating it if needed. A file that
+ * isn't a valid cache is emptied.
+ * Returns NULL on error (with errno set).
+ */
+metrics_cache_t *metrics_open(const char *path);
+
+/**
+ * Closes the cache.
+ */
+void metrics_close(metrics_cache_t *c);
+
+/**
+ * Looks up the metrics of the path to addr into m, as of now.
+ * Returns -1 if there are none, or they're too old, and 0 otherwise.
+ */
+int metrics_lookup(metrics_cache_t *c, const struct in6_addr *addr, time_t now,
+	path_metrics_t *m);
+
+/**
+ * Merges the metrics measured on the path to addr into its entry, as of now.
+ * Those known in both are averaged, so that a single transfer doesn't sway
+ * them too much.
+ * Returns -1 on error (with errno set), and 0 otherwise.
+ */
+int metrics_update(metrics_cache_t *c, const struct in6_addr *addr, time_t now,
+	const path_metrics_t *m);
+
+
+#endif  /* __METRICS_H_ */
@@ -16,6 +16,12 @@ struct __attribute__((__packed__)) pkt {
 	uint32_t crc1;
 	char payload[MAX_PAYLOAD_SIZE];
 	uint32_t crc2;
+	/* Not part of the wire format: payload that isn't copied in the
+	 * packet, see pkt_set_payload_ref. */
+	const char *payload_ref;
+	/* Not part of the wire format: whether crc2 was given for the current
+	 * payload and doesn't need to be computed, see pkt_set_crc2. */
+	bool crc2_set;
 };
 
 pkt_t* pkt_new() {
@@ -40,7 +46,8 @@ uint32_t pkt_compute_crc1(const pkt_t *pkt) {
  * Computes the CRC32 of the payload. len is the size of the payload.
  */
 uint32_t pkt_compute_crc2(const pkt_t *pkt, size_t len) {
-	return crc32(0, (unsigned char *) pkt->payload, len);
+	const char *payload = pkt->payload_ref != NULL ? pkt->payload_ref : pkt->payload;
+	return crc32(0, (unsigned char *) payload, len);
 }
 
 /**
@@ -62,6 +69,8 @@ pkt_status_code pkt_decode(const char *data, const size_t len, pkt_t *pkt) {
 
 	size_t read = 0;
 
+	pkt->payload_ref = NULL;
+	pkt->crc2_set = false;
 	memcpy(pkt, data + read, HEADER_SIZE);
 	read += HEADER_SIZE;
 
@@ -118,11 +127,18 @@ pkt_status_code pkt_encode(const pkt_t *pkt, char *buf, size_t *len) {
 
 	size_t payload_size = pkt_get_length(&p) * sizeof (*p.payload);
 	pkt_set_crc1(&p, pkt_compute_crc1(&p));
-	pkt_set_crc2(&p, pkt_compute_crc2(&p, payload_size));
+	if (!p.crc2_set) {
+		pkt_set_crc2(&p, pkt_compute_crc2(&p, payload_size));
+	}
 
 	size_t written = 0;
-	memcpy(buf + written, &p, HEADER_SIZE + payload_size);
-	written += HEADER_SIZE + payload_size;
+	memcpy(buf + written, &p, HEADER_SIZE);
+	written += HEADER_SIZE;
+
+	if (payload_size > 0) {
+		memcpy(buf + written, pkt_get_payload(&p), payload_size);
+		written += payload_size;
+	}
 
 	if (payload_size > 0) {
 		memcpy(buf + written, &p.crc2, sizeof (p.crc2));
@@ -133,6 +149,27 @@ pkt_status_code pkt_encode(const pkt_t *pkt, char *buf, size_t *len) {
 	return PKT_OK;
 }
 
+pkt_status_code pkt_encode_header(const pkt_t *pkt, char *hdr, char *crc2) {
+	pkt_t p = *pkt;
+
+	if (pkt_get_type(&p) == 0) {
+		return E_TYPE;
+	}
+
+	size_t payload_size = pkt_get_length(&p) * sizeof (*p.payload);
+	pkt_set_crc1(&p, pkt_compute_crc1(&p));
+	memcpy(hdr, &p, HEADER_SIZE);
+
+	if (payload_size > 0) {
+		if (!p.crc2_set) {
+			pkt_set_crc2(&p, pkt_compute_crc2(&p, payload_size));
+		}
+		memcpy(crc2, &p.crc2, sizeof (p.crc2));
+	}
+
+	return PKT_OK;
+}
+
 char *pkt_code_to_str(pkt_status_code code) {
 	switch (code) {
 		case PKT_OK:         return "PKT_OK";
@@ -193,9 +230,16 @@ const char* pkt_get_payload(const pkt_t* pkt) {
 	if (pkt_get_length(pkt) == 0) {
 		return NULL;
 	}
+	if (pkt->payload_ref != NULL) {
+		return pkt->payload_ref;
+	}
 	return pkt->payload;
 }
 
+bool pkt_has_payload_ref(const pkt_t* pkt) {
+	return pkt->payload_ref != NULL && pkt_get_length(pkt) > 0;
+}
+
 
 /*
  * Setters
@@ -255,6 +299,7 @@ pkt_status_code pkt_set_crc1(pkt_t *pkt, const uint32_t crc1) {
 
 pkt_status_code pkt_set_crc2(pkt_t *pkt, const uint32_t crc2) {
 	pkt->crc2 = htonl(crc2);
+	pkt->crc2_set = true;
 	return PKT_OK;
 }
 
@@ -269,6 +314,24 @@ pkt_status_code pkt_set_payload(pkt_t *pkt, const char *data, const uint16_t len
 		return code;
 	}
 
+	pkt->payload_ref = NULL;
+	pkt->crc2_set = false;
 	memcpy(pkt->payload, data, actual);
 	return PKT_OK;
 }
+
+pkt_status_code pkt_set_payload_ref(pkt_t *pkt, const char *data, const uint16_t length) {
+	uint16_t actual = length;
+	if (data == NULL) {
+		actual = 0;
+	}
+
+	pkt_status_code code = pkt_set_length(pkt, actual);
+	if (code != PKT_OK) {
+		return code;
+	}
+
+	pkt->payload_ref = data;
+	pkt->crc2_set = false;
+	return PKT_OK;
+}
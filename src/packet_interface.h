@@ -2,11 +2,12 @@
 #define __PACKET_INTERFACE_H_
 
 
+#include <stdbool.h> /* bool */
 #include <stddef.h> /* size_t */
 #include <stdint.h> /* uintx_t */
 
-#define HEADER_SIZE 1 + 1 + 2 + 4 + 4
-#define MAX_PACKET_SIZE HEADER_SIZE + MAX_PAYLOAD_SIZE + 4
+#define HEADER_SIZE (1 + 1 + 2 + 4 + 4)
+#define MAX_PACKET_SIZE (HEADER_SIZE + MAX_PAYLOAD_SIZE + 4)
 
 /* Raccourci pour struct pkt */
 typedef struct pkt pkt_t;
@@ -83,6 +84,19 @@ pkt_status_code pkt_decode(const char *data, const size_t len, pkt_t *pkt);
  */
 pkt_status_code pkt_encode(const pkt_t*, char *buf, size_t *len);
 
+/*
+ * Encode le header d'une struct pkt (avec son CRC32) et, si celui-ci est
+ * non nul, le CRC32 du payload, sans copier le payload lui-meme. Permet
+ * d'envoyer le paquet en scatter-gather: header, pkt_get_payload, CRC2.
+ *
+ * @pkt: La structure a encoder
+ * @hdr: Le buffer (d'au moins HEADER_SIZE octets) recevant le header
+ * @crc2: Le buffer (d'au moins 4 octets) recevant le CRC2, inchange si le
+ *        paquet n'a pas de payload
+ * @return: Un code indiquant si l'operation a reussi.
+ */
+pkt_status_code pkt_encode_header(const pkt_t*, char *hdr, char *crc2);
+
 char *pkt_code_to_str(pkt_status_code code);
 
 /* Accesseurs pour les champs toujours presents du paquet.
@@ -102,6 +116,11 @@ uint32_t pkt_get_crc1     (const pkt_t*);
  */
 const char* pkt_get_payload(const pkt_t*);
 
+/* Indique si le payload du paquet est une reference definie par
+ * pkt_set_payload_ref plutot qu'une copie.
+ */
+bool pkt_has_payload_ref(const pkt_t*);
+
 /* Renvoie le CRC2 dans l'endianness native de la machine. Si
  * ce field n'est pas present, retourne 0.
  */
@@ -128,8 +147,20 @@ pkt_status_code pkt_set_payload(pkt_t*,
                                 const char *data,
                                 const uint16_t length);
 
+/* Comme pkt_set_payload, mais le payload n'est pas copie: le paquet
+ * garde un pointeur vers data, qui doit rester valide aussi longtemps
+ * que le paquet est utilise.
+ * @POST: pkt_get_length(pkt) == length, pkt_get_payload(pkt) == data */
+pkt_status_code pkt_set_payload_ref(pkt_t*,
+                                    const char *data,
+                                    const uint16_t length);
+
 /* Setter pour CRC2. Les valeurs fournies sont dans l'endianness
  * native de la machine!
+ * S'il est appele apres pkt_set_payload ou pkt_set_payload_ref, pkt_encode
+ * et pkt_encode_header utilisent ce CRC2 au lieu de le recalculer (utile s'il
+ * a deja ete calcule ailleurs, par exemple dans un autre thread). Changer le
+ * payload annule cet effet.
  */
 pkt_status_code pkt_set_crc2(pkt_t*, const uint32_t crc2);
 
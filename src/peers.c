@@ -0,0 +1,127 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "peers.h"
+
+typedef enum {
+	SLOT_FREE = 0,
+	SLOT_USED,
+	SLOT_REMOVED, /* probes go on past it, additions may take it */
+} slot_state_t;
+
+typedef struct slot {
+	slot_state_t state;
+	struct in6_addr addr;
+	in_port_t port;
+	pid_t pid;
+} slot_t;
+
+struct peers {
+	slot_t *slots;
+	size_t nslots;
+	size_t count;
+	size_t capacity;
+};
+
+peers_t *peers_create(size_t capacity) {
+	peers_t *p = calloc(1, sizeof (peers_t));
+	if (p == NULL) {
+		return NULL;
+	}
+	p->nslots = 2 * capacity;
+	p->capacity = capacity;
+	p->slots = calloc(p->nslots, sizeof (slot_t));
+	if (p->slots == NULL) {
+		free(p);
+		return NULL;
+	}
+	return p;
+}
+
+void peers_free(peers_t *p) {
+	free(p->slots);
+	free(p);
+}
+
+size_t peers_count(peers_t *p) {
+	return p->count;
+}
+
+/**
+ * Returns the slot the address hashes to (FNV-1a).
+ */
+static size_t slot_of(peers_t *p, const struct sockaddr_in6 *addr) {
+	uint32_t h = 2166136261u;
+	for (size_t i = 0; i < sizeof (addr->sin6_addr.s6_addr); i++) {
+		h = (h ^ addr->sin6_addr.s6_addr[i]) * 16777619u;
+	}
+	const unsigned char *port = (const unsigned char *) &addr->sin6_port;
+	for (size_t i = 0; i < sizeof (addr->sin6_port); i++) {
+		h = (h ^ port[i]) * 16777619u;
+	}
+	return h % p->nslots;
+}
+
+/**
+ * Returns whether the slot holds the sender at addr.
+ */
+static bool matches(const slot_t *s, const struct sockaddr_in6 *addr) {
+	return s->state == SLOT_USED && s->port == addr->sin6_port &&
+		memcmp(&s->addr, &addr->sin6_addr, sizeof (s->addr)) == 0;
+}
+
+pid_t peers_find(peers_t *p, const struct sockaddr_in6 *addr) {
+	size_t slot = slot_of(p, addr);
+	for (size_t i = 0; i < p->nslots; i++) {
+		slot_t *s = &p->slots[(slot + i) % p->nslots];
+		if (s->state == SLOT_FREE) {
+			break;
+		}
+		if (matches(s, addr)) {
+			return s->pid;
+		}
+	}
+	return -1;
+}
+
+int peers_add(peers_t *p, const struct sockaddr_in6 *addr, pid_t pid) {
+	if (p->count == p->capacity) {
+		return -1;
+	}
+	/* Half the slots at least are free or removed, so there is one */
+	size_t slot = slot_of(p, addr);
+	slot_t *s = &p->slots[slot];
+	for (size_t i = 1; s->state == SLOT_USED; i++) {
+		s = &p->slots[(slot + i) % p->nslots];
+	}
+	s->state = SLOT_USED;
+	s->addr = addr->sin6_addr;
+	s->port = addr->sin6_port;
+	s->pid = pid;
+	p->count++;
+	return 0;
+}
+
+bool peers_remove(peers_t *p, pid_t pid) {
+	/* Workers exit far less often than datagrams arrive, a scan will do */
+	for (size_t i = 0; i < p->nslots; i++) {
+		slot_t *s = &p->slots[i];
+		if (s->state == SLOT_USED && s->pid == pid) {
+			s->state = SLOT_REMOVED;
+			p->count--;
+
+			/* Removed slots only matter before used ones: free those
+			 * ending a chain, so that probes don't get ever longer */
+			size_t j = i;
+			for (size_t n = 0; n < p->nslots &&
+			     p->slots[j].state == SLOT_REMOVED &&
+			     p->slots[(j + 1) % p->nslots].state == SLOT_FREE; n++) {
+				p->slots[j].state = SLOT_FREE;
+				j = (j + p->nslots - 1) % p->nslots;
+			}
+			return true;
+		}
+	}
+	return false;
+}
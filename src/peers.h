@@ -0,0 +1,54 @@
+#ifndef __PEERS_H_
+#define __PEERS_H_
+
+
+/**
+ * Table of the senders a receiver serves at once, each by a worker process,
+ * keyed by their address and port. It is an open-addressing hash table
+ * twice as large as the number of senders it takes, so that probes stay
+ * short however many there are.
+ */
+
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+typedef struct peers peers_t;
+
+/**
+ * Creates an empty table taking up to capacity senders.
+ * Returns NULL on error.
+ */
+peers_t *peers_create(size_t capacity);
+
+/**
+ * Frees the table.
+ */
+void peers_free(peers_t *p);
+
+/**
+ * Returns the number of senders in the table.
+ */
+size_t peers_count(peers_t *p);
+
+/**
+ * Returns the worker serving the sender at addr, or -1 if there is none.
+ */
+pid_t peers_find(peers_t *p, const struct sockaddr_in6 *addr);
+
+/**
+ * Records that the worker pid serves the sender at addr, which mustn't be
+ * in the table already.
+ * Returns -1 if the table is full, and 0 otherwise.
+ */
+int peers_add(peers_t *p, const struct sockaddr_in6 *addr, pid_t pid);
+
+/**
+ * Removes the sender served by the worker pid.
+ * Returns whether there was one.
+ */
+bool peers_remove(peers_t *p, pid_t pid);
+
+
+#endif  /* __PEERS_H_ */
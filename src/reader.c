@@ -0,0 +1,193 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "reader.h"
+#include "ring.h"
+#include "zero.h"
+
+#define READER_SLOTS 256 /* chunks read ahead of the sender */
+
+struct reader {
+	pthread_t thread;
+	ring_t *ring;
+	int fd;
+	const char *map;
+	size_t start;
+	size_t end;
+	bool zero_runs; // whether to look for runs of zeros
+
+	// Each side announces when it's about to sleep, waiting for the other
+	// one through an eventfd, which is only written to in that case.
+	int data_fd; // signalled by the reader thread, non-blocking
+	int space_fd; // signalled by the consumer
+	bool consumer_waiting;
+	bool reader_waiting;
+};
+
+/**
+ * Signals the eventfd if the flag was set, clearing it.
+ */
+static void wake_if_waiting(bool *waiting, int fd) {
+	/* Order our last ring operation before checking the flag, the other
+	 * side sets it before checking the ring */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(waiting, __ATOMIC_RELAXED) &&
+	    __atomic_exchange_n(waiting, false, __ATOMIC_SEQ_CST)) {
+		eventfd_write(fd, 1);
+	}
+}
+
+/**
+ * Fills the chunk with the next payload of the input.
+ */
+static void read_chunk(reader_t *rd, chunk_t *c, size_t *pos) {
+	const char *payload;
+	bool zero_runs = __atomic_load_n(&rd->zero_runs, __ATOMIC_RELAXED);
+
+	c->zeros = 0;
+	if (rd->map != NULL) {
+		size_t run = zero_runs ?
+			zero_run(rd->fd, rd->map, *pos, rd->end, MAX_PAYLOAD_SIZE) : *pos;
+		if (run > *pos) {
+			c->zeros = run - *pos;
+			c->len = 0;
+			*pos = run;
+			return;
+		}
+
+		size_t left = rd->end - *pos;
+		c->len = left < MAX_PAYLOAD_SIZE ? left : MAX_PAYLOAD_SIZE;
+		c->ref = rd->map + *pos;
+		payload = c->ref;
+	} else {
+		/* Send whatever is available rather than waiting for a full
+		 * payload, a slow input (e.g. a pipe) then still flows */
+		do {
+			c->len = read(rd->fd, c->data, MAX_PAYLOAD_SIZE);
+		} while (c->len == -1 && errno == EINTR);
+		c->err = errno;
+		c->ref = NULL;
+		payload = c->data;
+
+		if (zero_runs && c->len > 0 && is_zero(payload, c->len)) {
+			c->zeros = c->len;
+			c->len = 0;
+			return;
+		}
+	}
+
+	if (c->len > 0) {
+		*pos += c->len;
+		c->crc2 = crc32(0, (const unsigned char *) payload, c->len);
+	}
+}
+
+static void *reader_run(void *arg) {
+	reader_t *rd = arg;
+	size_t pos = rd->start;
+	bool done = false;
+
+	while (!done) {
+		chunk_t *c = ring_produce_slot(rd->ring);
+		if (c == NULL) {
+			/* Full, sleep until the consumer releases a chunk */
+			__atomic_store_n(&rd->reader_waiting, true, __ATOMIC_SEQ_CST);
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+			if (ring_produce_slot(rd->ring) == NULL) {
+				eventfd_t value;
+				eventfd_read(rd->space_fd, &value);
+			}
+			__atomic_store_n(&rd->reader_waiting, false, __ATOMIC_SEQ_CST);
+			continue;
+		}
+
+		read_chunk(rd, c, &pos);
+		done = c->len <= 0 && c->zeros == 0;
+
+		ring_publish(rd->ring);
+		wake_if_waiting(&rd->consumer_waiting, rd->data_fd);
+	}
+	return NULL;
+}
+
+reader_t *reader_start(int fd, const char *map, size_t start, size_t end) {
+	reader_t *rd = calloc(1, sizeof (reader_t));
+	if (rd == NULL) {
+		return NULL;
+	}
+
+	rd->fd = fd;
+	rd->map = map;
+	rd->start = start;
+	rd->end = end;
+	rd->data_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	rd->space_fd = eventfd(0, EFD_CLOEXEC);
+	rd->ring = ring_create(READER_SLOTS, sizeof (chunk_t));
+	if (rd->data_fd == -1 || rd->space_fd == -1 || rd->ring == NULL) {
+		goto fail;
+	}
+
+	if (pthread_create(&rd->thread, NULL, reader_run, rd) != 0) {
+		goto fail;
+	}
+	return rd;
+
+fail:
+	if (rd->ring != NULL) {
+		ring_free(rd->ring);
+	}
+	if (rd->data_fd != -1) {
+		close(rd->data_fd);
+	}
+	if (rd->space_fd != -1) {
+		close(rd->space_fd);
+	}
+	free(rd);
+	return NULL;
+}
+
+void reader_stop(reader_t *rd) {
+	pthread_join(rd->thread, NULL);
+	ring_free(rd->ring);
+	close(rd->data_fd);
+	close(rd->space_fd);
+	free(rd);
+}
+
+void reader_detect_zeros(reader_t *rd) {
+	__atomic_store_n(&rd->zero_runs, true, __ATOMIC_RELAXED);
+}
+
+int reader_fd(reader_t *rd) {
+	return rd->data_fd;
+}
+
+const chunk_t *reader_peek(reader_t *rd) {
+	const chunk_t *c = ring_consume_slot(rd->ring);
+	if (c != NULL) {
+		return c;
+	}
+
+	/* Consume an earlier wakeup, then ask for one and check again in case
+	 * a chunk was published in between */
+	eventfd_t value;
+	eventfd_read(rd->data_fd, &value);
+	__atomic_store_n(&rd->consumer_waiting, true, __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	c = ring_consume_slot(rd->ring);
+	if (c != NULL) {
+		__atomic_store_n(&rd->consumer_waiting, false, __ATOMIC_SEQ_CST);
+	}
+	return c;
+}
+
+void reader_release(reader_t *rd) {
+	ring_release(rd->ring);
+	wake_if_waiting(&rd->reader_waiting, rd->space_fd);
+}
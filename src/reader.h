@@ -0,0 +1,68 @@
+#ifndef __READER_H_
+#define __READER_H_
+
+
+/**
+ * Input reader running in its own thread. It reads the input ahead of the
+ * sender, cuts it into payloads and computes their CRC2, and hands them over
+ * through a lock-free ring, so that a slow input never holds up the thread
+ * handling the network.
+ */
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "packet_interface.h"
+
+/**
+ * Payload ready to be sent.
+ */
+typedef struct chunk {
+	ssize_t len; /* length of the payload, 0 on EOF and -1 on error */
+	int err; /* errno value if len == -1 */
+	uint32_t crc2; /* CRC32 of the payload */
+	uint64_t zeros; /* if not 0, a run of that many zeros instead (len is 0) */
+	const char *ref; /* payload in the input mapping, NULL if in data */
+	char data[MAX_PAYLOAD_SIZE];
+} chunk_t;
+
+typedef struct reader reader_t;
+
+/**
+ * Starts a thread reading from fd until EOF or an error. If map isn't NULL,
+ * it's the mapping of fd and the input is instead its bytes from start to
+ * end, which chunks reference rather than copy.
+ * Returns NULL on error.
+ */
+reader_t *reader_start(int fd, const char *map, size_t start, size_t end);
+
+/**
+ * Makes the reader hand out the runs of zeros it finds from now on as such.
+ */
+void reader_detect_zeros(reader_t *rd);
+
+/**
+ * Waits for the thread to terminate, after it has read EOF or an error, and
+ * releases the resources of the reader (NOT fd or map).
+ */
+void reader_stop(reader_t *rd);
+
+/**
+ * Returns a file descriptor that becomes readable when a chunk is ready after
+ * reader_peek returned NULL. It must not be read from.
+ */
+int reader_fd(reader_t *rd);
+
+/**
+ * Returns the next chunk, or NULL if none is ready yet (reader_fd will then
+ * become readable as soon as one is). The chunk is valid until reader_release.
+ */
+const chunk_t *reader_peek(reader_t *rd);
+
+/**
+ * Hands the chunk returned by reader_peek back to the reader thread.
+ */
+void reader_release(reader_t *rd);
+
+
+#endif  /* __READER_H_ */
@@ -1,61 +1,1089 @@
+#define _GNU_SOURCE /* fallocate */
+
+#include <arpa/inet.h>
 #include <assert.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "checkpoint.h"
+#include "delta.h"
+#include "duplex.h"
+#include "engine.h"
+#include "manifest.h"
+#include "message.h"
+#include "packet_interface.h"
+#include "peers.h"
+#include "setup.h"
+#include "util.h"
+#include "window.h"
+#include "writer.h"
+#include "zero.h"
+
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+#define MAX(x, y) ((x) > (y) ? (x) : (y))
+
+char *hostname; /* host we bind to */
+uint16_t port; /* port we receive on */
+char *filename; /* file on which we write out data */
+options_t opts; /* optional settings */
+
+int sockfd = -1; /* socket we're listening on */
+FILE *outfile; /* file we're writing out the data to */
+engine_t *eng; /* I/O engine for the socket and outfile */
+writer_t *wr; /* with -p, thread outfile is written from instead, NULL if none */
+window_t *w; /* receiving window, buffer contains out-of-sequence packets */
+
+const uint64_t CHECKPOINT_INTERVAL = 8 << 20; /* bytes written between checkpoints */
+
+/* With -n, each stripe is received by its own process, and with -r, the
+ * sender may resume after the data we already have. The data then starts
+ * with a payload holding its offset in the file (big-endian). */
+bool offset_hdr_pending; /* whether we're still waiting for it */
+bool data_started; /* whether an in-sequence data packet was received */
+
+/* With -r, how much of outfile is on disk is recorded in a checkpoint next
+ * to it, so that the sender can resume from there. */
+char *ckpt_path;
+checkpoint_t ckpt; /* last checkpoint saved */
+uint64_t written; /* end of the data written */
+uint32_t written_crc; /* CRC32 of the file up to there */
+
+/* Runs of zeros are skipped over in the output, which leaves holes. If the
+ * data ends with one, the file has to be extended to its end. */
+bool zeros_at_end;
+
+/* If the sender tells what file it sends (SETUP_EXT_METADATA), a regular
+ * output is checked to have room for it, preallocated, so that the file
+ * system can lay it out in one piece, and gets its mode and modification
+ * time at the end. */
+bool file_meta; /* whether the sender told, and the output is regular */
+uint64_t file_size;
+uint32_t file_mode;
+struct timespec file_mtime;
+
+/* With -d, the file we already have is the basis of a delta: the sender only
+ * sends what changed, and copies of the basis blocks for the rest. The new
+ * version is written next to it, and replaces it at the end. */
+const char *basis; /* mapping of the basis, NULL if there is none */
+size_t basis_len;
+delta_sig_t *sigs; /* signatures of its blocks */
+size_t sig_count;
+char *tmp_path; /* where the new version is written, NULL once renamed */
+
+/* If the output is a directory, the sender sends the files of a directory
+ * to be created in it (see manifest.h), the current one being outfile. */
+char *target_dir;
+char *entry_path; /* path of the current file */
+uint64_t entry_size; /* its size, according to its header */
+
+/* If the socket tells us the ECN field of what we receive, the sender may
+ * send ECN-capable DATA, and our ACKs then echo how many packets routers
+ * marked CE along the way, for it to slow down. */
+bool ecn_capable; /* whether the socket reports the field */
+bool ecn_echo; /* whether the sender agreed */
+uint32_t ce_count; /* packets received marked CE */
+size_t packets_received; /* datagrams, to report the CPU spent on each */
+
+/* If the sender sends messages (see message.h), each payload must hold whole
+ * ones, and they're written out as soon as they're in sequence rather than
+ * when the output buffers fill up. */
+bool messages;
+
+/* If the sender cuts the data into full payloads (SETUP_EXT_PLACED), where
+ * a packet received out of order goes follows from how far ahead of the next
+ * one expected it is: it's written there at once rather than held in the
+ * buffer, only its length and CRC32 being kept until the data before it is
+ * in. */
+bool placing; /* whether the sender agreed, and the output is seekable */
+uint16_t placed_len[256]; /* by sequence number, 0 if not placed */
+uint32_t placed_crc[256];
+size_t placed_count; /* packets placed, which still take a slot of the window */
+
+/* If the sender gives up data that expired, it sends SKIP_KIND packets in
+ * its place, which we skip over. */
+uint64_t bytes_skipped;
+
+/* With -i, the file is sent back to the sender in the same session if it
+ * agrees (see duplex.h). Our ACKs then ride in front of that data, and the
+ * sender's ACKs of it in front of its own data. */
+const uint32_t BACK_RTO_INITIAL = 1000000; /* retransmission timer until an
+                                            * RTT is measured */
+const uint32_t BACK_RTO_MIN = 200000;
+const uint32_t BACK_RTO_MAX = 60000000;
+int back_fd = -1; /* file sent back */
+bool duplex; /* whether the sender agreed */
+window_t *back_w; /* sending window of that data, buffer contains in-flight
+                   * packets */
+size_t back_next; /* sequence number of its next packet */
+bool back_eof; /* whether its EOF packet was sent */
+uint32_t back_rto = BACK_RTO_INITIAL; /* retransmission timer */
+uint32_t ack_echo; /* timestamp of the last packet received, to echo */
+bool ack_fresh; /* whether no ACK echoed it yet */
+
+/* Datagrams received together (see engine_pending) are handled as a batch,
+ * data delivered in order being acknowledged once at its end */
+bool ack_owed; /* whether the batch being handled owes an ACK */
+uint32_t owed_echo; /* the timestamp it echoes */
+
+/* With -s, each sender is served by its own worker process, which exits once
+ * the transfer is over, or the sender went silent, rather than staying on
+ * like a receiver serving a single one. */
+const uint32_t LINGER = 10000000; /* silence after the EOF before exiting,
+                                   * for retransmissions of it to be answered */
+const uint32_t IDLE_TIMEOUT = 60000000; /* silence after which the sender is
+                                         * given up */
+bool serving; /* whether we're such a worker */
+bool finished; /* whether the EOF packet was received */
+uint32_t last_heard; /* when the last datagram was received */
+char accepted_setup[SETUP_MAX_SIZE]; /* payload of the setup we answered, */
+size_t accepted_len; /* only retransmissions of which are answered again */
+
+/**
+ * Blocks until we receive the first packet and then establishes the
+ * connection to the sender. Does not consume the message (ie. a subsequent call
+ * to recv will see the same data). On error, prints on stderr and returns -1;
+ * otherwise, returns 0. Assumes the socket isn't connected.
+ */
+int wait_for_client(void) {
+	char buf[MAX_PACKET_SIZE];
+	struct sockaddr_in6 addr;
+	socklen_t addrlen = sizeof (addr);
+
+	/* Wait for a packet from anyone */
+	if (recvfrom(sockfd, buf, MAX_PACKET_SIZE, MSG_PEEK, (struct sockaddr *) &addr, &addrlen) == -1) {
+		log_perror("recvfrom");
+		return -1;
+	}
+
+	/* For UDP, connecting merely implies setting the address to which data
+	 * is sent by default, and the only address from which data is received. */
+	if (connect(sockfd, (struct sockaddr *) &addr, addrlen) == -1) {
+		log_perror("connect");
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Starts the thread the output is written from with -p. Exits on error.
+ */
+void start_writer(void) {
+	if (target_dir != NULL) {
+		exit_msg("A directory can't be written by another thread\n");
+	}
+	wr = writer_start(fileno(outfile), opts.direct, opts.sync_interval);
+	if (wr == NULL) {
+		exit_perror("Could not start writer thread");
+	}
+}
+
+/* The output goes through the engine, or the writer thread if there's one.
+ * These hand the operations on it to either, with the same semantics as
+ * engine_write, engine_seek and engine_tell. */
+
+int output_write(const char *buf, size_t len) {
+	return wr != NULL ? writer_write(wr, buf, len) : engine_write(eng, buf, len);
+}
+
+int output_seek(off_t offset) {
+	return wr != NULL ? writer_seek(wr, offset) : engine_seek(eng, offset);
+}
+
+off_t output_tell(void) {
+	return wr != NULL ? writer_tell(wr) : engine_tell(eng);
+}
+
+/**
+ * Makes what was written so far reach the file, waiting for it if wait, and
+ * the disk as well if sync (which implies wait).
+ * Returns -1 on error (with errno set), and 0 otherwise.
+ */
+int output_flush(bool wait, bool sync) {
+	if (wr != NULL) {
+		return writer_flush(wr, wait || sync, sync);
+	}
+	if (engine_flush(eng) == -1) {
+		return -1;
+	}
+	return sync ? fdatasync(fileno(outfile)) : 0;
+}
+
+/**
+ * Returns the window we advertise: the free slots of the buffer, less those
+ * of the packets placed, bounded by the payloads the writer thread can take,
+ * so that the sender slows down rather than the disk holding up our ACKs.
+ */
+size_t advertised_window(void) {
+	size_t available = window_available(w);
+	available = available > placed_count ? available - placed_count : 0;
+	if (wr != NULL) {
+		available = MIN(available, writer_space(wr));
+	}
+	return available;
+}
+
+/**
+ * Makes sure that the data written so far is on disk, and records it in a
+ * new checkpoint. Exits on error.
+ */
+void save_checkpoint(void) {
+	if (output_flush(true, true) == -1) {
+		exit_perror("Could not flush output");
+	}
+
+	ckpt.offset = written;
+	ckpt.crc = written_crc;
+	if (checkpoint_save(ckpt_path, &ckpt) == -1) {
+		exit_perror("Could not save checkpoint");
+	}
+	log_msg("Checkpoint at offset %llu\n", (unsigned long long) ckpt.offset);
+}
+
+/**
+ * Allocates the blocks of the whole file the sender described, which the
+ * output is then as long as. Exits on error.
+ */
+void preallocate(void) {
+	if (!file_meta || file_size == 0) {
+		return;
+	}
+	if (fallocate(fileno(outfile), 0, 0, file_size) == -1 && errno != EOPNOTSUPP) {
+		exit_perror("fallocate");
+	}
+}
+
+/**
+ * Takes note of the file the sender described in its setup s, preallocating
+ * the output if it's a regular file.
+ * Returns false if the file system doesn't have room for it. Exits on error.
+ */
+bool accept_file(const setup_t *s) {
+	log_msg("Receiving %s (%llu bytes)\n", s->file_name[0] != '\0' ? s->file_name
+		: "standard input", (unsigned long long) s->file_size);
+
+	struct stat st;
+	if (fstat(fileno(outfile), &st) == -1) {
+		exit_perror("fstat");
+	}
+	if (!S_ISREG(st.st_mode)) {
+		return true;
+	}
+
+	/* What the output takes already is reused */
+	struct statvfs vfs;
+	if (fstatvfs(fileno(outfile), &vfs) == -1) {
+		exit_perror("fstatvfs");
+	}
+	uint64_t taken = (uint64_t) st.st_blocks * 512;
+	uint64_t needed = s->file_size > taken ? s->file_size - taken : 0;
+	uint64_t available = (uint64_t) vfs.f_bavail * vfs.f_frsize;
+	if (needed > available) {
+		log_msg("Only %llu bytes free, %llu needed\n",
+			(unsigned long long) available, (unsigned long long) needed);
+		return false;
+	}
+
+	file_meta = true;
+	file_size = s->file_size;
+	file_mode = s->file_mode & 07777;
+	file_mtime.tv_sec = s->file_mtime / 1000000000;
+	file_mtime.tv_nsec = s->file_mtime % 1000000000;
+	if (file_mtime.tv_nsec < 0) {
+		file_mtime.tv_sec--;
+		file_mtime.tv_nsec += 1000000000;
+	}
+	preallocate();
+	return true;
+}
+
+/**
+ * Moves to the offset given by the offset header, dropping what follows it
+ * when resuming. Exits on error.
+ */
+void handle_offset_header(const char *payload, size_t len) {
+	uint64_t offset;
+	if (len != sizeof (offset)) {
+		exit_msg("Invalid offset header\n");
+	}
+	memcpy(&offset, payload, sizeof (offset));
+	offset = be64toh(offset);
+
+	if (opts.resume && offset != 0 && offset != ckpt.offset) {
+		exit_msg("Sender resumes at %llu, we only have %llu bytes\n",
+			(unsigned long long) offset, (unsigned long long) ckpt.offset);
+	}
+
+	if (output_seek(offset) == -1) {
+		exit_perror("seek");
+	}
+	if (opts.resume) {
+		if (output_flush(true, false) == -1 || ftruncate(fileno(outfile), offset) == -1) {
+			exit_perror("ftruncate");
+		}
+		written = offset;
+		written_crc = offset > 0 ? ckpt.crc : 0;
+		preallocate();
+	}
+
+	log_msg("Receiving data at offset %llu\n", (unsigned long long) offset);
+	offset_hdr_pending = false;
+}
+
+/**
+ * Appends len zeros to the output by writing them out. Exits on error.
+ */
+void write_zeros(uint64_t len) {
+	static const char zeros[MAX_PAYLOAD_SIZE];
+	while (len > 0) {
+		size_t n = len < sizeof (zeros) ? len : sizeof (zeros);
+		if (output_write(zeros, n) == -1) {
+			exit_msg("Error writing to file\n");
+		}
+		len -= n;
+	}
+}
+
+/**
+ * Appends the run of zeros whose length is the payload of a ZERO_KIND packet
+ * to the output, as a hole if the output is seekable.
+ * Returns the length of the run. Exits on error.
+ */
+uint64_t handle_zero_run(const char *payload, size_t len) {
+	uint64_t zeros;
+	if (len != sizeof (zeros)) {
+		exit_msg("Invalid run of zeros\n");
+	}
+	memcpy(&zeros, payload, sizeof (zeros));
+	zeros = be64toh(zeros);
+
+	off_t pos = output_tell();
+	if (pos == -1) {
+		write_zeros(zeros);
+		return zeros;
+	}
+	if (output_seek(pos + zeros) == -1) {
+		exit_perror("seek");
+	}
+
+	/* Past the end of the file, skipping is enough. Before it, the range
+	 * may hold data (e.g. written by another stripe's worker around it),
+	 * so make sure it reads as zeros. */
+	struct stat st;
+	if (fstat(fileno(outfile), &st) == -1) {
+		exit_perror("fstat");
+	}
+	if (st.st_size > pos && fallocate(fileno(outfile),
+			FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, pos, zeros) == -1) {
+		if (errno != EOPNOTSUPP) {
+			exit_perror("fallocate");
+		}
+		if (output_seek(pos) == -1) {
+			exit_perror("seek");
+		}
+		write_zeros(zeros);
+		return zeros;
+	}
+
+	zeros_at_end = true;
+	return zeros;
+}
+
+/**
+ * Appends the data of the basis given by the payload of a COPY_KIND packet to
+ * the output. Exits on error.
+ */
+void handle_copy(const char *payload, size_t len) {
+	uint64_t range[2];
+	if (len != sizeof (range)) {
+		exit_msg("Invalid copy\n");
+	}
+	memcpy(range, payload, sizeof (range));
+	uint64_t offset = be64toh(range[0]);
+	uint64_t copy_len = be64toh(range[1]);
+
+	if (offset > basis_len || copy_len > basis_len - offset) {
+		exit_msg("Copy of %llu bytes at %llu, out of the basis\n",
+			(unsigned long long) copy_len, (unsigned long long) offset);
+	}
+	if (output_write(basis + offset, copy_len) == -1) {
+		exit_msg("Error writing to file\n");
+	}
+	zeros_at_end = false;
+}
+
+/**
+ * Completes the output once all the data is written: makes sure it ends
+ * where the data does, as skipping a run of zeros at the end doesn't extend
+ * it, that it's all in the file before we acknowledge the end (on disk with
+ * -y), that it has the sender's metadata, and moves a delta's new version in
+ * place. Exits on error.
+ */
+void finish_output(void) {
+	if (zeros_at_end) {
+		/* Write the last zero rather than truncating, as this never
+		 * shrinks the file (other stripes may end after us) */
+		off_t end = output_tell();
+		if (output_flush(true, false) == -1 || pwrite(fileno(outfile), "", 1, end - 1) == -1) {
+			exit_perror("Could not extend output");
+		}
+	}
+
+	if (output_flush(true, opts.sync || tmp_path != NULL) == -1) {
+		exit_perror("Could not flush output");
+	}
+	if (file_meta) {
+		struct timespec times[2] = {{.tv_nsec = UTIME_OMIT}, file_mtime};
+		if (fchmod(fileno(outfile), file_mode) == -1 ||
+		    futimens(fileno(outfile), times) == -1) {
+			exit_perror("Could not set metadata of output");
+		}
+	}
+	if (tmp_path != NULL) {
+		if (rename(tmp_path, filename) == -1) {
+			exit_perror("rename");
+		}
+		log_msg("Replaced %s with the new version\n", filename);
+		free(tmp_path);
+		tmp_path = NULL;
+	}
+}
+
+/**
+ * Completes the current file of a directory, and checks it got all of its
+ * data. Exits on error.
+ */
+void close_entry(void) {
+	if (outfile == NULL) {
+		return;
+	}
+
+	finish_output();
+	off_t size = engine_tell(eng);
+	if (engine_set_file(eng, NULL) == -1) {
+		exit_perror("Could not flush output");
+	}
+	if (size != (off_t) entry_size) {
+		exit_msg("%s: got %lld bytes instead of %llu\n", entry_path,
+			(long long) size, (unsigned long long) entry_size);
+	}
+
+	fclose(outfile);
+	outfile = NULL;
+	free(entry_path);
+	entry_path = NULL;
+	zeros_at_end = false;
+}
+
+/**
+ * Completes the current file of a directory and creates the next one, whose
+ * header is the payload of a FILE_KIND packet. Exits on error.
+ */
+void handle_file_header(const char *payload, size_t len) {
+	file_hdr_t hdr;
+	if (target_dir == NULL) {
+		exit_msg("Got a file header, but the output isn't a directory\n");
+	}
+	if (file_hdr_decode(payload, len, &hdr) == -1) {
+		exit_msg("Invalid file header\n");
+	}
+
+	close_entry();
+
+	size_t path_len = strlen(target_dir) + 1 + strlen(hdr.name) + 1;
+	entry_path = malloc(path_len);
+	if (entry_path == NULL) {
+		exit_msg("Could not allocate path\n");
+	}
+	snprintf(entry_path, path_len, "%s/%s", target_dir, hdr.name);
+
+	if (S_ISDIR(hdr.mode)) {
+		/* Directories come before what they contain, which we have to
+		 * be able to create whatever their mode */
+		if (mkdir(entry_path, (hdr.mode & 07777) | 0700) == -1 && errno != EEXIST) {
+			exit_perror("mkdir");
+		}
+		log_msg("Created directory %s\n", entry_path);
+		free(entry_path);
+		entry_path = NULL;
+		return;
+	}
+
+	outfile = fopen(entry_path, "wb+");
+	if (outfile == NULL) {
+		exit_perror("fopen");
+	}
+	if (fchmod(fileno(outfile), hdr.mode & 07777) == -1) {
+		exit_perror("fchmod");
+	}
+	if (engine_set_file(eng, outfile) == -1) {
+		exit_perror("Could not switch output");
+	}
+	entry_size = hdr.size;
+	log_msg("Receiving %s (%llu bytes)\n", entry_path, (unsigned long long) hdr.size);
+}
+
+/**
+ * When resuming, accounts for len more bytes of data, whose CRC32 is crc,
+ * and saves a checkpoint when due, which is also at the end of the data
+ * (len is 0). Exits on error.
+ */
+void account_written(uint32_t crc, uint64_t len) {
+	if (!opts.resume) {
+		return;
+	}
+
+	if (len > 0) {
+		written_crc = crc32_combine(written_crc, crc, len);
+		written += len;
+	}
+	if (len == 0 || written - ckpt.offset >= CHECKPOINT_INTERVAL) {
+		save_checkpoint();
+	}
+}
+
+/**
+ * Opens the output file for the transfer to resume after what's recorded in
+ * its checkpoint, if the file still has that. Exits on error.
+ */
+void open_resumable(void) {
+	if (filename == NULL) {
+		exit_msg("Resuming needs an output file\n");
+	}
+
+	outfile = fopen(filename, "rb+");
+	if (outfile == NULL && errno == ENOENT) {
+		outfile = fopen(filename, "wb+");
+	}
+	if (outfile == NULL) {
+		exit_perror("fopen");
+	}
+
+	size_t len = strlen(filename) + sizeof (".ckpt");
+	ckpt_path = malloc(len);
+	if (ckpt_path == NULL) {
+		exit_msg("Could not allocate checkpoint path\n");
+	}
+	snprintf(ckpt_path, len, "%s.ckpt", filename);
+
+	struct stat st;
+	if (fstat(fileno(outfile), &st) == -1) {
+		exit_perror("fstat");
+	}
+	if (checkpoint_load(ckpt_path, &ckpt) == -1 || (uint64_t) st.st_size < ckpt.offset) {
+		ckpt.offset = 0;
+		ckpt.crc = 0;
+	}
+	log_msg("Can resume at offset %llu\n", (unsigned long long) ckpt.offset);
+}
+
+/**
+ * Maps the current version of the output file as the basis of a delta,
+ * computes its signatures, and opens the file the new version is written to.
+ * Exits on error.
+ */
+void open_delta(void) {
+	if (filename == NULL) {
+		exit_msg("Delta transfers need an output file\n");
+	}
+
+	int fd = open(filename, O_RDONLY);
+	if (fd == -1 && errno != ENOENT) {
+		exit_perror("open");
+	}
+	if (fd != -1) {
+		struct stat st;
+		if (fstat(fd, &st) == -1) {
+			exit_perror("fstat");
+		}
+		if (st.st_size > 0) {
+			void *addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (addr == MAP_FAILED) {
+				exit_perror("mmap");
+			}
+			basis = addr;
+			basis_len = st.st_size;
+		}
+		close(fd);
+	}
+
+	/* Using all the CPUs, as large files take a while */
+	sig_count = basis_len / DELTA_BLOCK_SIZE;
+	sigs = malloc((sig_count > 0 ? sig_count : 1) * sizeof (delta_sig_t));
+	if (sigs == NULL) {
+		exit_msg("Could not allocate signatures\n");
+	}
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (delta_signature(basis, basis_len, sigs, cpus > 0 ? cpus : 1) == -1) {
+		exit_msg("Could not compute signatures\n");
+	}
+	log_msg("Basis of %zu bytes, %zu blocks\n", basis_len, sig_count);
+
+	size_t len = strlen(filename) + sizeof (".tmp");
+	tmp_path = malloc(len);
+	if (tmp_path == NULL) {
+		exit_msg("Could not allocate temporary path\n");
+	}
+	snprintf(tmp_path, len, "%s.tmp", filename);
+
+	outfile = fopen(tmp_path, "wb+");
+	if (outfile == NULL) {
+		exit_perror("fopen");
+	}
+}
+
+/**
+ * Answers a request for a batch of the signatures of the basis.
+ * Exits on error.
+ */
+void answer_signatures(pkt_t *pkt) {
+	uint32_t batch;
+	if (pkt_get_length(pkt) != sizeof (batch)) {
+		log_msg("Invalid signature request, ignoring\n");
+		return;
+	}
+	memcpy(&batch, pkt_get_payload(pkt), sizeof (batch));
+	batch = be32toh(batch);
+	if ((size_t) batch * SIGS_PER_BATCH >= sig_count) {
+		log_msg("No signature batch %u, ignoring\n", batch);
+		return;
+	}
+
+	char payload[MAX_PAYLOAD_SIZE];
+	size_t len = delta_batch_encode(sigs, sig_count, batch, payload);
+
+	pkt_t *reply = pkt_new();
+	if (reply == NULL) {
+		exit_msg("Could not allocate reply packet\n");
+	}
+
+	pkt_status_code err = PKT_OK;
+	err = err || pkt_set_type(reply, PTYPE_DATA);
+	err = err || pkt_set_window(reply, SIG_KIND);
+	err = err || pkt_set_timestamp(reply, pkt_get_timestamp(pkt));
+	err = err || pkt_set_payload(reply, payload, len);
+	if (err != PKT_OK) {
+		exit_msg("Could not create packet: %s\n", pkt_code_to_str(err));
+	}
+
+	if (engine_send(eng, reply) == -1) {
+		exit_perror("Could not send signatures: send:");
+	}
+
+	log_msg("> SIG %s\n", pkt_repr(reply));
+	pkt_del(reply);
+}
+
+/**
+ * Answers the setup proposed by the sender with the settings we agree on.
+ * Exits on error.
+ */
+void answer_setup(pkt_t *pkt) {
+	setup_t remote, local, agreed;
+	if (setup_decode(pkt_get_payload(pkt), pkt_get_length(pkt), &remote) == -1) {
+		log_msg("Invalid setup, ignoring\n");
+		return;
+	}
+
+	setup_init(&local, window_get_size(w));
+	if (opts.resume) {
+		local.extensions |= SETUP_EXT_RESUME;
+		local.resume_offset = ckpt.offset;
+		local.resume_crc = ckpt.crc;
+	}
+	if (opts.delta) {
+		local.extensions |= SETUP_EXT_DELTA;
+		local.basis_size = basis_len;
+	}
+	if (target_dir != NULL) {
+		local.extensions |= SETUP_EXT_MANIFEST;
+	}
+	if (ecn_capable) {
+		local.extensions |= SETUP_EXT_ECN;
+	}
+	if (back_fd != -1) {
+		local.extensions |= SETUP_EXT_DUPLEX;
+	}
+	if (target_dir == NULL && output_tell() != -1) {
+		local.extensions |= SETUP_EXT_PLACED;
+	}
+	if (target_dir == NULL) {
+		local.extensions |= SETUP_EXT_METADATA;
+	}
+	local.extensions |= SETUP_EXT_MESSAGES | SETUP_EXT_SKIP;
+	if (setup_negotiate(&local, &remote, &agreed) == -1) {
+		/* The sender gives up when it sees our settings */
+		log_msg("Sender speaks version %d with checksum mode %d\n",
+			remote.version, remote.checksum);
+		agreed = local;
+	}
+
+	ecn_echo = agreed.extensions & SETUP_EXT_ECN;
+	messages = agreed.extensions & SETUP_EXT_MESSAGES;
+	duplex = agreed.extensions & SETUP_EXT_DUPLEX;
+	placing = agreed.extensions & SETUP_EXT_PLACED;
+
+	/* Settle where the data goes, unless this is a retransmission */
+	if (!data_started && (agreed.extensions & SETUP_EXT_RESUME)) {
+		offset_hdr_pending = true;
+	} else if (!data_started && opts.resume) {
+		/* The sender starts over */
+		if (output_seek(0) == -1 || output_flush(true, false) == -1 ||
+		    ftruncate(fileno(outfile), 0) == -1) {
+			exit_perror("Could not truncate output");
+		}
+		written = 0;
+		written_crc = 0;
+	}
+	if (!data_started && (agreed.extensions & SETUP_EXT_METADATA) && !accept_file(&agreed)) {
+		agreed.refusal = SETUP_REFUSE_SPACE;
+	}
+
+	char payload[SETUP_MAX_SIZE];
+	size_t len = setup_encode(&agreed, payload);
+
+	pkt_t *reply = pkt_new();
+	if (reply == NULL) {
+		exit_msg("Could not allocate reply packet\n");
+	}
+
+	pkt_status_code err = PKT_OK;
+	err = err || pkt_set_type(reply, PTYPE_ACK);
+	err = err || pkt_set_window(reply, advertised_window());
+	err = err || pkt_set_seqnum(reply, window_start(w));
+	err = err || pkt_set_timestamp(reply, pkt_get_timestamp(pkt));
+	err = err || pkt_set_payload(reply, payload, len);
+	if (err != PKT_OK) {
+		exit_msg("Could not create packet: %s\n", pkt_code_to_str(err));
+	}
+
+	if (engine_send(eng, reply) == -1) {
+		exit_perror("Could not answer setup: send:");
+	}
+
+	log_msg("> SETUP %s\n", pkt_repr(reply));
+	pkt_del(reply);
+	memcpy(accepted_setup, pkt_get_payload(pkt), pkt_get_length(pkt));
+	accepted_len = pkt_get_length(pkt);
+
+	if (agreed.refusal == SETUP_REFUSE_SPACE) {
+		/* The answer may still be queued, the sender must hear why */
+		engine_flush(eng);
+		exit_msg("Not enough free space for the file\n");
+	}
+}
+
+/**
+ * Skips over data the sender gave up. Exits on error.
+ */
+void handle_skip(const char *payload, size_t len) {
+	uint64_t skipped;
+	if (len != sizeof (skipped)) {
+		exit_msg("Invalid skip\n");
+	}
+	memcpy(&skipped, payload, sizeof (skipped));
+	bytes_skipped += be64toh(skipped);
+	log_msg("Skipped %llu bytes that expired (%llu so far)\n",
+		(unsigned long long) be64toh(skipped), (unsigned long long) bytes_skipped);
+}
+
+/**
+ * Writes the payload of pkt, received out of order, where it goes in the
+ * output, if that can be told.
+ * Returns whether it was written. Exits on error.
+ */
+bool place(const pkt_t *pkt) {
+	size_t len = pkt_get_length(pkt);
+	size_t full = duplex ? DUPLEX_PAYLOAD_SIZE : MAX_PAYLOAD_SIZE;
+	size_t ahead = (pkt_get_seqnum(pkt) + 256 - window_start(w)) % 256;
+
+	/* Until some data is delivered in sequence, where it starts isn't
+	 * settled (see the offset header), and the EOF packet must stay in the
+	 * buffer to be delivered last */
+	if (!placing || !data_started || ahead == 0 || len == 0 || len > full ||
+	    pkt_get_window(pkt) != 0) {
+		return false;
+	}
+
+	off_t pos = output_tell();
+	if (pos == -1 || output_seek(pos + ahead * full) == -1 ||
+	    output_write(pkt_get_payload(pkt), len) == -1 || output_seek(pos) == -1) {
+		exit_perror("Could not place data");
+	}
+	placed_len[pkt_get_seqnum(pkt)] = len;
+	placed_crc[pkt_get_seqnum(pkt)] = pkt_get_crc2(pkt);
+	placed_count++;
+	return true;
+}
+
+/**
+ * Slides the window past the packets placed already that are now in
+ * sequence, moving the output after their data. Exits on error.
+ */
+void pass_placed(void) {
+	uint64_t len = 0;
+	while (placed_len[window_start(w)] > 0) {
+		uint8_t seqnum = window_start(w);
+		account_written(placed_crc[seqnum], placed_len[seqnum]);
+		log_msg("Passed packet #%d\n", seqnum);
+		len += placed_len[seqnum];
+		placed_len[seqnum] = 0;
+		placed_count--;
+		window_slide(w);
+	}
+
+	if (len == 0) {
+		return;
+	}
+	off_t pos = output_tell();
+	if (pos == -1 || output_seek(pos + len) == -1) {
+		exit_perror("seek");
+	}
+}
+
+/**
+ * Returns whether the packet with that sequence number is one we delivered
+ * already, that the sender may still have in its window.
+ */
+bool delivered(uint8_t seqnum) {
+	size_t behind = (window_start(w) + 256 - seqnum) % 256;
+	return data_started && behind > 0 && behind <= MAX_WINDOW_SIZE;
+}
+
+/**
+ * Fills reply with a cumulative ACK for what we delivered, echoing the
+ * timestamp of the packet it answers. Exits on error.
+ */
+void make_ack(pkt_t *reply, uint32_t timestamp) {
+	pkt_status_code err = PKT_OK;
+	err = err || pkt_set_type(reply, PTYPE_ACK);
+	err = err || pkt_set_window(reply, advertised_window());
+	err = err || pkt_set_seqnum(reply, window_start(w));
+	err = err || pkt_set_timestamp(reply, timestamp);
+	if (ecn_echo) {
+		uint32_t echo = htobe32(ce_count);
+		err = err || pkt_set_payload(reply, (const char *) &echo, ECN_ECHO_SIZE);
+	}
+
+	if (err != PKT_OK) {
+		exit_msg("Could not create packet: %s\n",
+			pkt_code_to_str(err));
+	}
+}
+
+/**
+ * Sends a standalone cumulative ACK for what we delivered, echoing the
+ * timestamp of the packet it answers. Exits on error.
+ */
+void send_ack(uint32_t timestamp) {
+	pkt_t *reply = pkt_new();
+	if (reply == NULL) {
+		exit_msg("Could not allocate reply packet\n");
+	}
+	make_ack(reply, timestamp);
+
+	if (engine_send(eng, reply) == -1) {
+		exit_perror("Could not send ACK: send:");
+	}
+
+	log_msg("> %s\n", pkt_repr(reply));
+	pkt_del(reply);
+	ack_echo = timestamp;
+	ack_fresh = false;
+}
+
+/**
+ * Sends a packet of the data sent back, with our ACK in front. Exits on
+ * error.
+ */
+void send_back_pkt(pkt_t *pkt) {
+	pkt_t *ack = pkt_new();
+	if (ack == NULL) {
+		exit_msg("Could not allocate reply packet\n");
+	}
+	make_ack(ack, ack_echo);
 
-#include "packet_interface.h"
-#include "util.h"
-#include "window.h"
+	pkt_t *out = piggyback_wrap(pkt, ack, ack_fresh);
+	if (out == NULL) {
+		exit_msg("Could not piggyback ACK\n");
+	}
+	if (engine_send(eng, out) == -1) {
+		exit_perror("Could not send data back: send:");
+	}
+	ack_fresh = false;
 
-char *hostname; /* host we bind to */
-uint16_t port; /* port we receive on */
-char *filename; /* file on which we write out data */
+	pkt_del(ack);
+	pkt_del(out);
+}
 
-int sockfd = -1; /* socket we're listening on */
-FILE *outfile; /* file we're writing out the data to */
-window_t *w; /* receiving window, buffer contains out-of-sequence packets */
+/**
+ * Sends as much of the file sent back as the window takes: the sender's
+ * window counts sequence numbers from the first one not acknowledged
+ * cumulatively, including those popped by their timestamp. Exits on error.
+ */
+void send_back(void) {
+	while (!back_eof &&
+	       (back_next + 256 - window_start(back_w)) % 256 < window_get_size(back_w)) {
+		char buf[DUPLEX_PAYLOAD_SIZE];
+		ssize_t len;
+		do {
+			len = read(back_fd, buf, sizeof (buf));
+		} while (len == -1 && errno == EINTR);
+		if (len == -1) {
+			exit_perror("Could not read the file sent back");
+		}
+
+		pkt_t *pkt = pkt_new();
+		if (pkt == NULL) {
+			exit_msg("Could not allocate packet\n");
+		}
+		pkt_status_code err = PKT_OK;
+		err = err || pkt_set_type(pkt, PTYPE_DATA);
+		err = err || pkt_set_seqnum(pkt, back_next);
+		err = err || pkt_set_timestamp(pkt, get_monotime());
+		err = err || pkt_set_payload(pkt, buf, len);
+		if (err != PKT_OK) {
+			exit_msg("Could not create packet: %s\n", pkt_code_to_str(err));
+		}
+		if (window_push(back_w, pkt) == -1) {
+			exit_msg("Could not add packet to buffer\n");
+		}
+
+		send_back_pkt(pkt);
+		log_msg("> back %s\n", pkt_repr(pkt));
+		back_next = (back_next + 1) % 256;
+		if (len == 0) {
+			log_msg("Sent back EOF packet\n");
+			back_eof = true;
+		}
+	}
+}
 
 /**
- * Blocks until we receive the first packet and then establishes the
- * connection to the sender. Does not consume the message (ie. a subsequent call
- * to recv will see the same data). On error, prints on stderr and returns -1;
- * otherwise, returns 0. Assumes the socket isn't connected.
+ * Resends the packets of the data sent back whose timer expired, backing
+ * the timer off. Exits on error.
  */
-int wait_for_client(void) {
-	char buf[MAX_PACKET_SIZE];
-	struct sockaddr_in6 addr;
-	socklen_t addrlen = sizeof (addr);
+void retransmit_back(void) {
+	uint32_t now = get_monotime();
+	bool resent = false;
+	pkt_t *pkt;
+	while ((pkt = window_peek_min_timestamp(back_w)) != NULL &&
+	       !time_before(now, pkt_get_timestamp(pkt) + back_rto)) {
+		/* Stamps must tell packets apart, see get_monotime */
+		if (window_update_timestamp(back_w, pkt_get_timestamp(pkt), get_monotime()) == -1) {
+			exit_msg("Cannot update timestamp of packet\n");
+		}
+		send_back_pkt(pkt);
+		log_msg("> back RETR %s\n", pkt_repr(pkt));
+		resent = true;
+	}
+	if (resent) {
+		back_rto = MIN(2 * back_rto, BACK_RTO_MAX);
+	}
+}
 
-	/* Wait for a packet from anyone */
-	if (recvfrom(sockfd, buf, MAX_PACKET_SIZE, MSG_PEEK, (struct sockaddr *) &addr, &addrlen) == -1) {
-		log_perror("recvfrom");
-		return -1;
+/**
+ * Removes from the window the packets of the data sent back that the
+ * sender acknowledged, and sizes it to the sender's window.
+ */
+void handle_back_ack(pkt_t *ack, bool fresh) {
+	/* Cumulative like ours, and the timestamp tells the last packet
+	 * received, which may be out of sequence */
+	size_t in_flight = (back_next + 256 - window_start(back_w)) % 256;
+	size_t acked = (pkt_get_seqnum(ack) + 256 - window_start(back_w)) % 256;
+	if (acked <= in_flight) {
+		for (size_t i = 0; i < acked; i++) {
+			pkt_t *pkt = window_find_seqnum(back_w, (window_start(back_w) + i) % 256);
+			if (pkt != NULL) {
+				window_pop_timestamp(back_w, pkt_get_timestamp(pkt));
+				pkt_del(pkt);
+			}
+		}
+		window_slide_to(back_w, pkt_get_seqnum(ack));
 	}
+	pkt_del(window_pop_timestamp(back_w, pkt_get_timestamp(ack)));
 
-	/* For UDP, connecting merely implies setting the address to which data
-	 * is sent by default, and the only address from which data is received. */
-	if (connect(sockfd, (struct sockaddr *) &addr, addrlen) == -1) {
-		log_perror("connect");
-		return -1;
+	if (fresh) {
+		/* Rougher than the sender's estimate, which is enough for what
+		 * is usually the smaller side of a sync */
+		uint32_t rtt = get_monotime() - pkt_get_timestamp(ack);
+		back_rto = MAX(BACK_RTO_MIN, MIN(3 * (uint64_t) rtt, BACK_RTO_MAX));
 	}
 
-	return 0;
+	/* Keep a slot open, the sender makes room as it writes out */
+	window_resize(back_w, MAX(pkt_get_window(ack), 1));
 }
 
 /**
- * Called inside an infinite loop. Exits on error.
+ * Acknowledges what we delivered, echoing the timestamp of the packet just
+ * received: in front of the data we send back if there's some to send,
+ * alone otherwise. Exits on error.
  */
-void main_loop(void) {
-	log_msg("---------- Waiting for a packet...\n");
-	log_msg("Window: [%zu, %zu], buffer: %zu/%zu\n", window_start(w),
-		window_end(w), window_buffer_size(w), window_get_size(w));
+void acknowledge(uint32_t timestamp) {
+	ack_echo = timestamp;
+	ack_fresh = true;
+	if (duplex) {
+		send_back();
+	}
+	if (ack_fresh) {
+		send_ack(timestamp);
+	}
+}
 
-	/* Read the datagram received into a buffer */
-	char buf[MAX_PACKET_SIZE];
-	int len = recv(sockfd, buf, MAX_PACKET_SIZE, 0);
-	if (len == -1) {
-		exit_perror("recv");
+/**
+ * Ends the handling of a batch of datagrams received together: delivers the
+ * messages written out and sends the ACK owed, if any. Exits on error.
+ */
+void end_batch(void) {
+	if (!ack_owed) {
+		return;
+	}
+
+	/* Deliver the messages now, the application waits for them */
+	if (messages && output_flush(false, false) == -1) {
+		exit_perror("Could not flush output");
+	}
+
+	ack_owed = false;
+	acknowledge(owed_echo);
+}
+
+/**
+ * Returns until when a worker serving one of many senders waits for its
+ * next datagram.
+ */
+uint32_t silence_deadline(void) {
+	return last_heard + (finished ? LINGER : IDLE_TIMEOUT);
+}
+
+/**
+ * Ends the session of a worker serving one of many senders. Exits.
+ */
+void end_session(void) {
+	engine_free(eng);
+	if ((wr != NULL && writer_stop(wr) == -1) || fclose(outfile) == EOF) {
+		exit_perror("Could not close output");
 	}
+	exit(finished ? 0 : 1);
+}
 
+/**
+ * Handles a datagram received from the sender, replying to it, or leaving
+ * the reply to end_batch. Exits on error.
+ */
+void handle_datagram(const char *buf, size_t len) {
 	/* Decode the datagram into a packet */
 	pkt_t *pkt = pkt_new();
 	if (pkt == NULL) {
@@ -71,24 +1099,82 @@ void main_loop(void) {
 
 	log_msg("< %s\n", pkt_repr(pkt));
 
-	if (!window_has(w, pkt_get_seqnum(pkt))) {
-		log_msg("Out of window, ignoring\n");
+	/* The setup and signatures are outside of the sequence numbers */
+	if (pkt_get_type(pkt) == PTYPE_DATA && pkt_get_window(pkt) == SETUP_KIND) {
+		if (pkt_get_tr(pkt)) {
+			log_msg("Truncated setup, ignoring\n");
+		} else if (serving && accepted_len > 0 && (finished ||
+		           pkt_get_length(pkt) != accepted_len ||
+		           memcmp(pkt_get_payload(pkt), accepted_setup, accepted_len) != 0)) {
+			/* A new sender reusing the port of ours: leave it to the
+			 * parent, which forks a worker on its next setup */
+			log_msg("Another sender on the same port, ending the session\n");
+			pkt_del(pkt);
+			end_session();
+		} else {
+			answer_setup(pkt);
+		}
+		pkt_del(pkt);
+		return;
+	}
+	if (pkt_get_type(pkt) == PTYPE_DATA && pkt_get_window(pkt) == SIG_KIND) {
+		if (sigs != NULL && !pkt_get_tr(pkt)) {
+			answer_signatures(pkt);
+		}
 		pkt_del(pkt);
 		return;
 	}
 
-	/* We're gonna send a (N)ACK so let's allocate a new packet to reply */
-	pkt_t *reply = pkt_new();
-	if (reply == NULL) {
-		exit_msg("Could not allocate reply packet\n");
+	/* In a duplex session, the sender acknowledges the data we send back
+	 * alone, or in front of its own */
+	if (duplex && pkt_get_type(pkt) != PTYPE_DATA) {
+		if (pkt_get_type(pkt) == PTYPE_ACK) {
+			handle_back_ack(pkt, true);
+		}
+		pkt_del(pkt);
+		return;
+	}
+	if (duplex && !pkt_get_tr(pkt)) {
+		pkt_t *ack = pkt_new();
+		if (ack == NULL) {
+			exit_msg("Could not allocate packet\n");
+		}
+		int fresh = piggyback_take(pkt, ack);
+		if (fresh == -1) {
+			log_msg("Data without an ACK, ignoring\n");
+			pkt_del(ack);
+			pkt_del(pkt);
+			return;
+		}
+		handle_back_ack(ack, fresh);
+		pkt_del(ack);
+	}
+
+	if (!window_has(w, pkt_get_seqnum(pkt))) {
+		if (delivered(pkt_get_seqnum(pkt)) && !pkt_get_tr(pkt)) {
+			/* Its ACK was lost, and maybe all the later ones */
+			log_msg("Already delivered, acknowledging again\n");
+			send_ack(pkt_get_timestamp(pkt));
+		} else {
+			log_msg("Out of window, ignoring\n");
+		}
+		pkt_del(pkt);
+		return;
 	}
 
 	if (pkt_get_tr(pkt)) {
-		/* Send a NACK if we receive a truncated packet */
+		pkt_t *reply = pkt_new();
+		if (reply == NULL) {
+			exit_msg("Could not allocate reply packet\n");
+		}
+
+		/* Send a NACK if we receive a truncated packet. That's also how
+		 * we answer window probes (truncated empty packets) from a
+		 * sender that saw our window close. */
 		pkt_status_code err = PKT_OK;
 		err = err || pkt_set_type(reply, PTYPE_NACK);
 		/* We don't store truncated packets so the window size doesn't change */
-		err = err || pkt_set_window(reply, window_available(w));
+		err = err || pkt_set_window(reply, advertised_window());
 		err = err || pkt_set_seqnum(reply, pkt_get_seqnum(pkt));
 
 		if (err != PKT_OK) {
@@ -96,19 +1182,31 @@ void main_loop(void) {
 				pkt_code_to_str(err));
 		}
 
-		if (send_packet(sockfd, reply) == -1) {
+		if (engine_send(eng, reply) == -1) {
 			exit_perror("Could not send NACK: send:");
 		}
 
 		pkt_del(pkt);
 		log_msg("> %s\n", pkt_repr(reply));
+		pkt_del(reply);
 	} else {
 		/* We're gonna send an ACK, but first we store the received
 		 * packet in the buffer, and then we try to write out packets to
 		 * the file, so that we can reply with an accurate window size. */
 
-		if (window_find_seqnum(w, pkt_get_seqnum(pkt)) != NULL) {
+		/* Save the timestamp and seqnum of the packet we just received
+		 * in case it's immediately removed from the buffer and freed. */
+		uint32_t ack_timestamp = pkt_get_timestamp(pkt);
+		uint8_t seqnum = pkt_get_seqnum(pkt);
+
+		if (window_find_seqnum(w, seqnum) != NULL) {
 			log_msg("Already in buffer\n");
+		} else if (placed_len[seqnum] > 0) {
+			log_msg("Already placed\n");
+			pkt_del(pkt);
+		} else if (place(pkt)) {
+			log_msg("Placed %d\n", seqnum);
+			pkt_del(pkt);
 		} else {
 			if (window_push(w, pkt) == -1) {
 				if (window_full(w)) {
@@ -124,10 +1222,6 @@ void main_loop(void) {
 			}
 		}
 
-		/* Save the timestamp of the packet we just received in case
-		 * it's immediately removed from the buffer and freed. */
-		uint32_t ack_timestamp = pkt_get_timestamp(pkt);
-
 		/* Find the next in-sequence packet. If it's not in the buffer,
 		 * we can't acknowledge any packet. */
 		pkt_t *next_pkt = window_find_seqnum(w, window_start(w));
@@ -138,10 +1232,40 @@ void main_loop(void) {
 			const char *payload = pkt_get_payload(next_pkt);
 			size_t payload_len = pkt_get_length(next_pkt);
 
-			if (fwrite(payload, sizeof (*payload), payload_len, outfile) < payload_len) {
-				exit_msg("Error writing to file\n");
+			if (outfile == NULL && payload_len > 0 &&
+			    pkt_get_window(next_pkt) != FILE_KIND) {
+				exit_msg("Got data outside of a file, the sender must send a directory\n");
 			}
 
+			if (offset_hdr_pending && payload_len > 0) {
+				handle_offset_header(payload, payload_len);
+			} else if (pkt_get_window(next_pkt) == FILE_KIND) {
+				handle_file_header(payload, payload_len);
+			} else if (pkt_get_window(next_pkt) == ZERO_KIND) {
+				uint64_t zeros = handle_zero_run(payload, payload_len);
+				account_written(crc_zeros(zeros), zeros);
+			} else if (pkt_get_window(next_pkt) == COPY_KIND) {
+				handle_copy(payload, payload_len);
+			} else if (pkt_get_window(next_pkt) == SKIP_KIND) {
+				handle_skip(payload, payload_len);
+			} else {
+				if (payload_len == 0 && target_dir != NULL) {
+					close_entry();
+				} else if (payload_len == 0) {
+					finish_output();
+					finished = true;
+					log_cpu_usage(packets_received);
+				} else if (messages && message_count(payload, payload_len) == -1) {
+					exit_msg("Payload with a partial message\n");
+				} else if (output_write(payload, payload_len) == -1) {
+					exit_msg("Error writing to file\n");
+				} else {
+					zeros_at_end = false;
+				}
+				account_written(pkt_get_crc2(next_pkt), payload_len);
+			}
+			data_started = true;
+
 			log_msg("Wrote packet #%d\n", pkt_get_seqnum(next_pkt));
 			assert(window_pop_timestamp(w, pkt_get_timestamp(next_pkt)) == next_pkt);
 
@@ -158,48 +1282,327 @@ void main_loop(void) {
 			}
 
 			pkt_del(next_pkt);
+			pass_placed();
 			next_pkt = window_find_seqnum(w, window_start(w));
 		}
 
-		assert(fflush(outfile) == 0);
+		/* The ACK of data delivered in order waits for the end of the
+		 * batch, as later ones subsume it. Data held or placed out of
+		 * order is acknowledged at once: the sender pops it by the
+		 * timestamp echoed. */
+		ack_owed = true;
+		owed_echo = ack_timestamp;
+		if (window_find_seqnum(w, seqnum) != NULL || placed_len[seqnum] > 0) {
+			end_batch();
+		}
 
-		/* There's no duplication so we can just send an ACK */
+		log_msg("Window: [%zu, %zu], buffer: %zu/%zu\n", window_start(w),
+			window_end(w), window_buffer_size(w), window_get_size(w));
+	}
+}
 
-		pkt_status_code err = PKT_OK;
-		err = err || pkt_set_type(reply, PTYPE_ACK);
-		err = err || pkt_set_window(reply, window_available(w));
-		err = err || pkt_set_seqnum(reply, window_start(w));
-		err = err || pkt_set_timestamp(reply, ack_timestamp);
+/**
+ * Called inside an infinite loop. Exits on error.
+ */
+void main_loop(void) {
+	log_msg("---------- Waiting for a packet...\n");
+	log_msg("Window: [%zu, %zu], buffer: %zu/%zu\n", window_start(w),
+		window_end(w), window_buffer_size(w), window_get_size(w));
 
-		if (err != PKT_OK) {
-			exit_msg("Could not create packet: %s\n",
-				pkt_code_to_str(err));
+	/* The data sent back has timers, and a worker serving one of many
+	 * senders doesn't wait forever */
+	int64_t timeout = -1;
+	uint32_t now = get_monotime();
+	if (duplex && !window_empty(back_w)) {
+		uint32_t timer = pkt_get_timestamp(window_peek_min_timestamp(back_w)) + back_rto;
+		timeout = time_before(now, timer) ? timer - now : 0;
+	}
+	if (serving) {
+		int64_t left = time_before(now, silence_deadline()) ? silence_deadline() - now : 0;
+		timeout = timeout < 0 ? left : MIN(timeout, left);
+	}
+	if (timeout >= 0) {
+		int ready = engine_wait(eng, timeout);
+		if (ready == -1) {
+			exit_perror("select");
 		}
-
-		if (send_packet(sockfd, reply) == -1) {
-			exit_perror("Could not send ACK: send:");
+		if (ready == 0) {
+			if (serving && !time_before(get_monotime(), silence_deadline())) {
+				if (!finished) {
+					log_msg("Sender went silent, giving up\n");
+				}
+				end_session();
+			}
+			if (duplex) {
+				retransmit_back();
+			}
+			return;
 		}
+	}
 
-		log_msg("> %s\n", pkt_repr(reply));
+	/* Read the datagram received into a buffer */
+	char buf[MAX_PACKET_SIZE];
+	int len = engine_recv(eng, buf, MAX_PACKET_SIZE);
+	if (len == -1) {
+		exit_perror("recv");
+	}
+	last_heard = get_monotime();
+	packets_received++;
+	if (engine_recv_ecn(eng) == ECN_CE) {
+		ce_count++;
+		log_msg("Received a datagram marked CE (%u so far)\n", ce_count);
+	}
 
-		log_msg("Window: [%zu, %zu], buffer: %zu/%zu\n", window_start(w),
-			window_end(w), window_buffer_size(w), window_get_size(w));
+	handle_datagram(buf, len);
+	if (engine_pending(eng) == 0) {
+		end_batch();
 	}
 
-	pkt_del(reply);
+	/* Its ACK may have opened the window of the data sent back */
+	if (duplex) {
+		send_back();
+	}
 }
 
-int main(int argc, char **argv) {
-	parse_args(argc, argv, &hostname, &port, &filename);
-
+/**
+ * Receives the first datagram of up to opts.stripes senders on a socket bound
+ * to addr, and forks a worker for each of them. A worker binds its own
+ * socket to addr as well but connects it to its sender, so that the kernel
+ * hands it all the following datagrams of the sender. Never returns in the
+ * parent, exits on error.
+ */
+void serve_stripes(struct sockaddr_in6 *addr) {
 	if (filename == NULL) {
-		outfile = stdout;
-	} else {
-		outfile = fopen(filename, "wb+");
+		exit_msg("Striping needs an output file\n");
+	}
+
+	/* Truncate it once, each worker opens it on its own to have its own
+	 * file position */
+	outfile = fopen(filename, "wb");
+	if (outfile == NULL) {
+		exit_perror("fopen");
+	}
+	fclose(outfile);
+
+	int listener = create_shared_socket(addr, port, NULL, -1);
+	if (listener == -1) {
+		exit(1);
+	}
+
+	struct sockaddr_in6 peers[MAX_STRIPES];
+	unsigned npeers = 0;
+
+	log_msg("Waiting for %u senders...\n", opts.stripes);
+	while (npeers < opts.stripes) {
+		char buf[MAX_PACKET_SIZE];
+		struct sockaddr_in6 peer;
+		socklen_t peerlen = sizeof (peer);
+		ssize_t len = recvfrom(listener, buf, MAX_PACKET_SIZE, 0,
+			(struct sockaddr *) &peer, &peerlen);
+		if (len == -1) {
+			exit_perror("recvfrom");
+		}
+
+		/* Retransmissions that raced with the worker connecting */
+		bool known = false;
+		for (unsigned i = 0; i < npeers; i++) {
+			if (memcmp(&peers[i], &peer, sizeof (peer)) == 0) {
+				known = true;
+			}
+		}
+		if (known) {
+			continue;
+		}
+		peers[npeers++] = peer;
+
+		pid_t pid = fork();
+		if (pid == -1) {
+			exit_perror("fork");
+		}
+		if (pid > 0) {
+			log_msg("Stripe %u: forked worker %d\n", npeers - 1, pid);
+			continue;
+		}
+
+		close(listener);
+		sockfd = create_shared_socket(addr, port, &peer, ntohs(peer.sin6_port));
+		if (sockfd == -1) {
+			exit(1);
+		}
+		ecn_capable = report_ecn(sockfd) == 0;
+
+		outfile = fopen(filename, "rb+");
 		if (outfile == NULL) {
 			exit_perror("fopen");
 		}
+
+		eng = engine_create(opts.engine, sockfd, outfile);
+		if (eng == NULL) {
+			exit_msg("Could not create I/O engine\n");
+		}
+		if (opts.pipeline) {
+			start_writer();
+		}
+		offset_hdr_pending = true;
+
+		/* The first datagram was received by the parent */
+		handle_datagram(buf, len);
+		end_batch();
+		while (true) {
+			main_loop();
+		}
+	}
+
+	close(listener);
+	while (wait(NULL) > 0) {
+		/* Workers never return, like the receiver itself */
+	}
+	exit(0);
+}
+
+/**
+ * Does nothing: SIGCHLD only has to interrupt recvfrom, for exited workers
+ * to be reaped.
+ */
+void on_child(int sig) {
+	(void) sig;
+}
+
+/**
+ * Serves the sender at peer in a worker process, whose first datagram (its
+ * setup) the parent received: binds a socket to addr as well but connects it
+ * to the sender, so that the kernel hands it the sender's datagrams, and
+ * writes the data to a file named after the sender's address and port in
+ * the output directory. Never returns, exits on error or once done.
+ */
+void serve_session(struct sockaddr_in6 *addr, struct sockaddr_in6 *peer,
+		const char *buf, size_t len) {
+	sockfd = create_shared_socket(addr, port, peer, ntohs(peer->sin6_port));
+	if (sockfd == -1) {
+		exit(1);
+	}
+	ecn_capable = report_ecn(sockfd) == 0;
+
+	char host[INET6_ADDRSTRLEN];
+	char path[PATH_MAX];
+	if (inet_ntop(AF_INET6, &peer->sin6_addr, host, sizeof (host)) == NULL) {
+		exit_perror("inet_ntop");
+	}
+	snprintf(path, sizeof (path), "%s/%s.%u", filename, host, ntohs(peer->sin6_port));
+	filename = strdup(path);
+	if (filename == NULL) {
+		exit_msg("Could not allocate path\n");
+	}
+	outfile = fopen(filename, "wb+");
+	if (outfile == NULL) {
+		exit_perror("fopen");
+	}
+
+	eng = engine_create(opts.engine, sockfd, outfile);
+	if (eng == NULL) {
+		exit_msg("Could not create I/O engine\n");
+	}
+	if (opts.pipeline) {
+		start_writer();
+	}
+	serving = true;
+	last_heard = get_monotime();
+
+	handle_datagram(buf, len);
+	end_batch();
+	while (true) {
+		main_loop();
+	}
+}
+
+/**
+ * Serves up to opts.sessions senders at once on a socket bound to addr, each
+ * in a worker forked when its setup arrives (see serve_session). The table
+ * of those being served tells the datagrams that raced with their worker
+ * connecting from the first ones of new senders. Never returns, exits on
+ * error.
+ */
+void serve_senders(struct sockaddr_in6 *addr) {
+	struct stat st;
+	if (filename == NULL || stat(filename, &st) == -1 || !S_ISDIR(st.st_mode)) {
+		exit_msg("Serving many senders needs an output directory\n");
+	}
+
+	peers_t *peers = peers_create(opts.sessions);
+	if (peers == NULL) {
+		exit_msg("Could not create table of senders\n");
+	}
+	int listener = create_shared_socket(addr, port, NULL, -1);
+	if (listener == -1) {
+		exit(1);
+	}
+	struct sigaction sa;
+	memset(&sa, 0, sizeof (sa));
+	sa.sa_handler = on_child; /* without SA_RESTART */
+	if (sigaction(SIGCHLD, &sa, NULL) == -1) {
+		exit_perror("sigaction");
+	}
+
+	log_msg("Serving up to %u senders...\n", opts.sessions);
+	while (true) {
+		pid_t pid;
+		while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+			peers_remove(peers, pid);
+			log_msg("Worker %d done, serving %zu senders\n", pid, peers_count(peers));
+		}
+
+		char buf[MAX_PACKET_SIZE];
+		struct sockaddr_in6 peer;
+		socklen_t peerlen = sizeof (peer);
+		ssize_t len = recvfrom(listener, buf, MAX_PACKET_SIZE, 0,
+			(struct sockaddr *) &peer, &peerlen);
+		if (len == -1 && errno == EINTR) {
+			continue;
+		}
+		if (len == -1) {
+			exit_perror("recvfrom");
+		}
+		if (peers_find(peers, &peer) != -1) {
+			continue;
+		}
+
+		/* Only a setup starts a session, anything else is left over
+		 * from one that ended */
+		pkt_t *pkt = pkt_new();
+		if (pkt == NULL) {
+			exit_msg("Could not allocate packet\n");
+		}
+		bool setup = pkt_decode(buf, len, pkt) == PKT_OK &&
+			pkt_get_type(pkt) == PTYPE_DATA && pkt_get_window(pkt) == SETUP_KIND;
+		pkt_del(pkt);
+		if (!setup) {
+			continue;
+		}
+		if (peers_count(peers) == opts.sessions) {
+			/* It retransmits its setup until one is done */
+			log_msg("Serving too many senders, ignoring a new one\n");
+			continue;
+		}
+
+		pid = fork();
+		if (pid == -1) {
+			exit_perror("fork");
+		}
+		if (pid > 0) {
+			assert(peers_add(peers, &peer, pid) == 0);
+			log_msg("Forked worker %d, serving %zu senders\n", pid, peers_count(peers));
+			continue;
+		}
+
+		peers_free(peers);
+		close(listener);
+		signal(SIGCHLD, SIG_DFL);
+		serve_session(addr, &peer, buf, len);
 	}
+}
+
+int main(int argc, char **argv) {
+	parse_args(argc, argv, &hostname, &port, &filename, &opts);
 
 	w = window_create(MAX_WINDOW_SIZE, MAX_WINDOW_SIZE, 255);
 	if (w == NULL) {
@@ -212,11 +1615,50 @@ int main(int argc, char **argv) {
 		exit_msg("real_address: %s\n", err);
 	}
 
+	if (opts.stripes > 0) {
+		serve_stripes(&addr);
+	}
+	if (opts.sessions > 0) {
+		serve_senders(&addr);
+	}
+
+	struct stat st;
+	if (opts.resume) {
+		open_resumable();
+	} else if (opts.delta) {
+		open_delta();
+	} else if (filename == NULL) {
+		outfile = stdout;
+	} else if (stat(filename, &st) == 0 && S_ISDIR(st.st_mode)) {
+		/* Files are opened as their headers arrive */
+		target_dir = filename;
+	} else {
+		outfile = fopen(filename, "wb+");
+		if (outfile == NULL) {
+			exit_perror("fopen");
+		}
+	}
+	if (opts.pipeline) {
+		start_writer();
+	}
+
+	if (opts.back_input != NULL) {
+		back_fd = open(opts.back_input, O_RDONLY | O_CLOEXEC);
+		if (back_fd == -1) {
+			exit_perror("open");
+		}
+		back_w = window_create(MAX_WINDOW_SIZE, MAX_WINDOW_SIZE, 255);
+		if (back_w == NULL) {
+			exit_msg("Could not create window\n");
+		}
+	}
+
 	/* Bind the socket */
 	sockfd = create_socket(&addr, port, NULL, -1);
 	if (sockfd == -1) {
 		exit(1);
 	}
+	ecn_capable = report_ecn(sockfd) == 0;
 
 	log_msg("Waiting for sender...\n");
 	if (wait_for_client() == -1) {
@@ -225,11 +1667,20 @@ int main(int argc, char **argv) {
 
 	log_msg("Received first packet, connected\n");
 
+	/* Only now that the socket is connected, as the engine may start
+	 * receiving from it right away */
+	eng = engine_create(opts.engine, sockfd, outfile);
+	if (eng == NULL) {
+		exit_msg("Could not create I/O engine\n");
+	}
+	log_msg("Using %s I/O engine\n", engine_name(engine_get_type(eng)));
+
 	while (true) {
 		/* This is probably the line you're looking for */
 		main_loop();
 	}
 
+	engine_free(eng);
 	window_free(w);
 	fclose(outfile);
 
@@ -0,0 +1,99 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "ring.h"
+
+#define CACHE_LINE 64
+
+struct ring {
+	char *slots;
+	size_t elem_size;
+	size_t mask; // capacity - 1, the capacity being a power of two
+
+	// Each side writes its own index only, and keeps it on its own cache
+	// line along with a copy of the other side's index, refreshed only when
+	// the ring looks full (resp. empty), so that they don't keep stealing
+	// the line from each other.
+	struct {
+		size_t tail; // next slot to produce
+		size_t head_cache;
+	} __attribute__((aligned(CACHE_LINE))) prod;
+	struct {
+		size_t head; // next slot to consume
+		size_t tail_cache;
+	} __attribute__((aligned(CACHE_LINE))) cons;
+};
+
+ring_t *ring_create(size_t capacity, size_t elem_size) {
+	if (capacity == 0 || elem_size == 0) {
+		return NULL;
+	}
+
+	size_t size = 1;
+	while (size < capacity) {
+		size <<= 1;
+	}
+
+	void *mem;
+	if (posix_memalign(&mem, CACHE_LINE, sizeof (ring_t)) != 0) {
+		return NULL;
+	}
+	ring_t *r = mem;
+	memset(r, 0, sizeof (ring_t));
+
+	r->slots = calloc(size, elem_size);
+	if (r->slots == NULL) {
+		free(r);
+		return NULL;
+	}
+	r->elem_size = elem_size;
+	r->mask = size - 1;
+	return r;
+}
+
+void ring_free(ring_t *r) {
+	free(r->slots);
+	free(r);
+}
+
+void *ring_produce_slot(ring_t *r) {
+	size_t tail = r->prod.tail;
+	if (tail - r->prod.head_cache > r->mask) {
+		r->prod.head_cache = __atomic_load_n(&r->cons.head, __ATOMIC_ACQUIRE);
+		if (tail - r->prod.head_cache > r->mask) {
+			return NULL;
+		}
+	}
+	return r->slots + (tail & r->mask) * r->elem_size;
+}
+
+void ring_publish(ring_t *r) {
+	/* The release orders the writes to the slot before the new tail */
+	__atomic_store_n(&r->prod.tail, r->prod.tail + 1, __ATOMIC_RELEASE);
+}
+
+void *ring_consume_slot(ring_t *r) {
+	size_t head = r->cons.head;
+	if (head == r->cons.tail_cache) {
+		r->cons.tail_cache = __atomic_load_n(&r->prod.tail, __ATOMIC_ACQUIRE);
+		if (head == r->cons.tail_cache) {
+			return NULL;
+		}
+	}
+	return r->slots + (head & r->mask) * r->elem_size;
+}
+
+void ring_release(ring_t *r) {
+	/* The release orders the reads from the slot before the new head */
+	__atomic_store_n(&r->cons.head, r->cons.head + 1, __ATOMIC_RELEASE);
+}
+
+size_t ring_count(ring_t *r) {
+	size_t tail = __atomic_load_n(&r->prod.tail, __ATOMIC_ACQUIRE);
+	size_t head = __atomic_load_n(&r->cons.head, __ATOMIC_ACQUIRE);
+	return tail - head;
+}
+
+size_t ring_capacity(ring_t *r) {
+	return r->mask + 1;
+}
@@ -0,0 +1,64 @@
+#ifndef __RING_H_
+#define __RING_H_
+
+
+/**
+ * Lock-free ring of fixed-size slots shared by exactly one producer thread
+ * and one consumer thread. Slots are filled and drained in place: the
+ * producer gets a free slot, fills it and publishes it, and the consumer
+ * gets the oldest published slot, uses it and releases it.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct ring ring_t;
+
+/**
+ * Allocates a ring of at least capacity slots of elem_size bytes each.
+ * Returns NULL on error.
+ */
+ring_t *ring_create(size_t capacity, size_t elem_size);
+
+/**
+ * Frees the ring and its slots.
+ */
+void ring_free(ring_t *r);
+
+/**
+ * Producer side: returns the next free slot, or NULL if the ring is full.
+ * The slot isn't visible to the consumer until ring_publish is called.
+ */
+void *ring_produce_slot(ring_t *r);
+
+/**
+ * Producer side: hands the slot returned by ring_produce_slot over to the
+ * consumer.
+ */
+void ring_publish(ring_t *r);
+
+/**
+ * Consumer side: returns the oldest published slot, or NULL if the ring is
+ * empty. The slot stays valid until ring_release is called.
+ */
+void *ring_consume_slot(ring_t *r);
+
+/**
+ * Consumer side: hands the slot returned by ring_consume_slot back to the
+ * producer.
+ */
+void ring_release(ring_t *r);
+
+/**
+ * Returns the number of published slots not released yet. Only exact when
+ * called by either side while the other one is idle.
+ */
+size_t ring_count(ring_t *r);
+
+/**
+ * Returns the number of slots of the ring.
+ */
+size_t ring_capacity(ring_t *r);
+
+
+#endif  /* __RING_H_ */
@@ -1,233 +1,1664 @@
 #include <assert.h>
+#include <endian.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <unistd.h>
+#include <zlib.h>
 
+#include "bucket.h"
+#include "delta.h"
+#include "duplex.h"
+#include "engine.h"
+#include "manifest.h"
+#include "message.h"
+#include "metrics.h"
 #include "packet_interface.h"
+#include "reader.h"
+#include "setup.h"
 #include "util.h"
 #include "window.h"
+#include "zero.h"
 
 #define MIN(x, y) ((x) < (y) ? (x) : (y))
+#define MAX(x, y) ((x) > (y) ? (x) : (y))
+#define HOST_BUCKET "/sender.rate" /* shared memory of the cap of the host */
 
-const uint32_t TIMER = 4500000; /* retransmission timer (in microseconds) */
+const uint32_t TIMER = 4500000; /* retransmission timer until the RTT is known (in microseconds) */
+const uint32_t RTO_MIN = 200000; /* shortest retransmission timer */
+const uint32_t RTO_MAX = 60000000; /* longest retransmission timer */
+const uint32_t PERSIST_MIN = 200000; /* first window probe interval */
+const uint32_t PERSIST_MAX = 60000000; /* largest window probe interval */
+const size_t SIG_INFLIGHT = 31; /* signature batches requested at once */
+const uint32_t KEEPALIVE = 10000000; /* longest silence when following */
+const uint64_t BURST_TIME = 20000; /* sending a rate cap lets go at once */
+const uint32_t RATE_REPORT = 5000000; /* interval between reports when capped */
 
 char *hostname; /* host we connect to */
 uint16_t port; /* port we send to */
 char *filename; /* file we read data from */
+options_t opts; /* optional settings */
 
 int sockfd = -1; /* socket we're operating on */
 FILE *infile; /* file we're reading data from */
+engine_t *eng; /* I/O engine for the socket and infile */
 window_t *w; /* sending window, buffer contains in-flight packets */
 size_t next = 0; /* sequence number of the next packet to be sent */
 bool sent_eof; /* whether we've sent the empty packet that signals EOF */
+size_t packets_sent; /* including retransmissions */
+uint64_t bytes_sent; /* in those packets */
+uint64_t start_time; /* of the transfer, on bucket_clock */
+setup_t local_setup; /* settings we proposed to the receiver */
+pkt_t *setup_pkt; /* setup packet until the receiver answers it, then NULL */
+bool setup_wait; /* whether data waits for the answer */
+uint32_t persist_backoff; /* interval between window probes, 0 if not probing */
+uint32_t persist_deadline; /* when to send the next window probe */
+
+/* Data read from infile but not sent yet. Reading for the whole window at
+ * once lets the engine fetch it in a single operation. */
+char rbuf[MAX_WINDOW_SIZE * MAX_PAYLOAD_SIZE];
+size_t rbuf_len;
+size_t rbuf_pos;
+
+/* When infile is a regular file, it is mapped in memory instead and packets
+ * reference their payload in the mapping rather than holding a copy. */
+const char *map;
+size_t map_len;
+size_t map_pos; /* offset of the next payload */
+size_t map_end; /* offset where the data to send ends */
+
+/* With -n, each stripe is sent by its own process, and with -r, the receiver
+ * may already have the start of the file. The data then starts with a
+ * payload holding its offset in the file (big-endian). */
+uint64_t offset_hdr;
+bool offset_hdr_pending; /* whether it still has to be sent */
+
+/* With -p, the input (mapped or not) is read by another thread instead. */
+reader_t *rd;
+bool input_stalled; /* whether the reader had nothing ready for us */
+
+/* Once the receiver agreed, runs of zeros (holes in particular) are sent as
+ * their length in ZERO_KIND packets rather than as payloads */
+bool zero_runs;
+uint64_t zeros_elided; /* bytes sent that way */
+
+/* With -d, the data is sent as a delta against the receiver's copy of the
+ * file (the basis). We fetch the signatures of its blocks in batches, then
+ * send the data it doesn't have, and COPY_KIND packets for the rest. */
+delta_sig_t *sigs;
+size_t sig_count;
+uint32_t *sig_timers; /* deadline of the request of each batch, 0 once answered */
+size_t sig_batches;
+size_t sig_low; /* first batch not answered yet */
+size_t sig_next; /* first batch not requested yet */
+delta_op_t *ops; /* the delta, once computed */
+size_t nops;
+size_t op_idx; /* piece being sent */
+uint64_t op_pos; /* how much of it is sent */
+uint64_t copied; /* bytes sent as copies */
+
+/* With a directory as input, its files are sent back to back in the same
+ * session (see manifest.h), the current one being infile. */
+manifest_t *manifest;
+size_t entry_idx; /* next entry to send */
+char file_hdr[MAX_PAYLOAD_SIZE];
+size_t file_hdr_len; /* length of the header still to send, 0 if none */
+
+/* With -t, the input is followed like tail -f does: at its end, we wait for
+ * inotify to tell us it was modified instead of sending EOF. A partial
+ * payload is held until it fills up or opts.follow_latency elapses, and
+ * the receiver is probed when there's nothing to send. */
+int inotify_fd = -1;
+bool holding; /* whether a partial payload is held */
+uint32_t hold_deadline; /* when it has to go */
+uint32_t keepalive_deadline; /* when to probe the receiver if nothing is sent */
+
+/* With -m, the input is a stream of messages (see message.h), read without
+ * blocking as the application writes them. Payloads carry as many whole
+ * messages as fit, and one that could take more is held like when following:
+ * until the messages in flight are acknowledged (as Nagle's algorithm does),
+ * for at most opts.message_latency. */
+bool input_eof; /* whether the application closed the input */
+
+/* With -l, data not acknowledged within opts.lifetime of being first sent is
+ * given up: once the receiver agreed, its packet becomes a SKIP_KIND one,
+ * which the receiver skips over instead of waiting for the data, so that
+ * what follows isn't held up any longer. */
+bool skips; /* whether the receiver agreed */
+uint32_t deadlines[256]; /* of the packet with each sequence number */
+uint64_t bytes_skipped;
+
+/* With -b and -B, the rate is capped by token buckets: the one of the
+ * transfer, shared by its stripes, and the one of the host. New packets wait
+ * while either of them is in debt, retransmissions only draw from them. */
+bucket_t *buckets[2];
+size_t nbuckets;
+bool rate_limited; /* whether new packets wait for the buckets */
+uint32_t rate_deadline; /* until when */
+uint64_t report_time; /* of the last report of the rate, on bucket_clock */
+uint64_t report_bytes; /* bytes_sent then */
+uint64_t report_host; /* bytes taken out of the bucket of the host then */
+
+/* Packets are stamped with the time they were sent, which ACKs echo (NACKs
+ * leave it at 0): each of them gives a sample of the RTT, from which the
+ * retransmission timer is computed as in RFC 6298. With -c, the estimates are seeded from the path
+ * metrics cache, and stored there at the end for the next transfers. */
+struct in6_addr dst; /* address of the receiver, the key in the cache */
+uint32_t srtt; /* smoothed RTT (in microseconds) */
+uint32_t rttvar; /* its variation */
+bool rtt_known; /* whether srtt and rttvar hold an estimate */
+size_t rtt_samples; /* taken during this transfer */
+uint32_t rto = TIMER; /* retransmission timer */
+uint16_t payload_size; /* agreed on with the receiver */
+uint16_t last_rwin; /* last window advertised by the receiver */
+
+/* If the receiver echoes ECN, DATA is sent ECN-capable, so that congested
+ * routers mark it CE rather than drop it. The window is then also bounded by
+ * a congestion window, halved when the receiver counts new marks (once per
+ * RTT, as they're likely the same congestion), which grows back by a packet
+ * per window of ACKs. */
+bool ecn_capable; /* whether the socket sends ECT */
+bool ecn; /* whether the receiver agreed to echo */
+uint32_t ce_seen; /* count of CE marks it last echoed */
+size_t cwnd = MAX_WINDOW_SIZE;
+size_t cwnd_acked; /* ACKs since cwnd last grew */
+bool cwr; /* whether we reduced cwnd recently */
+uint32_t cwr_deadline; /* until when new marks don't reduce it again */
+
+/* With -o, the receiver may send data back in the same session (see
+ * duplex.h), written to that file. Its packets come with ACKs for ours in
+ * front, and ours carry ACKs for them, with a standalone one only when we
+ * have nothing to send. */
+bool duplex; /* whether the receiver agreed */
+size_t data_size = MAX_PAYLOAD_SIZE; /* longest payload of data */
+FILE *backfile; /* where the data sent back is written */
+window_t *back_w; /* receiving window of that data, buffer contains
+                   * out-of-sequence packets */
+bool back_eof; /* whether all of it was received */
+uint64_t back_bytes; /* received so far */
+uint32_t back_echo; /* timestamp of the last packet of it, to echo */
+bool back_fresh; /* whether back_echo wasn't echoed yet */
+bool back_ack_pending; /* whether no ACK went out since that packet */
+
+/**
+ * Returns whether the input may not grow for a while without being over:
+ * when following it, or when it carries messages.
+ */
+bool streaming(void) {
+	return (opts.follow || opts.messages) && !sent_eof;
+}
+
+/**
+ * Returns whether the receiver still has data to send back.
+ */
+bool receiving_back(void) {
+	return duplex && !back_eof;
+}
+
+/**
+ * Returns whether no data can be sent until the receiver answers the setup,
+ * or with -d, until it has sent all the signatures.
+ */
+bool waiting_for_setup(void) {
+	return (setup_wait && setup_pkt != NULL) || sig_low < sig_batches;
+}
+
+/**
+ * Returns whether the packet sent at time sent should be resent by now.
+ */
+bool timer_expired(uint32_t sent, uint32_t now) {
+	return !time_before(now, sent + rto);
+}
+
+/**
+ * Updates the RTT estimate with the time elapsed since a response echoing
+ * the timestamp ts was sent, and the retransmission timer with it.
+ */
+void sample_rtt(uint32_t ts) {
+	uint32_t rtt = get_monotime() - ts;
+	if (rtt > RTO_MAX) {
+		/* Not one of our timestamps */
+		return;
+	}
+
+	if (!rtt_known) {
+		srtt = rtt;
+		rttvar = rtt / 2;
+		rtt_known = true;
+	} else {
+		uint32_t delta = srtt > rtt ? srtt - rtt : rtt - srtt;
+		rttvar = (3 * (uint64_t) rttvar + delta) / 4;
+		srtt = (7 * (uint64_t) srtt + rtt) / 8;
+	}
+	rtt_samples++;
+
+	uint64_t timer = srtt + 4 * (uint64_t) rttvar;
+	rto = MIN(MAX(timer, RTO_MIN), RTO_MAX);
+}
+
+/**
+ * Counts the packet as sent, and takes it out of the rate buckets.
+ */
+void account_sent(const pkt_t *pkt) {
+	size_t len = pkt_get_length(pkt);
+	size_t size = HEADER_SIZE + len + (len > 0 ? 4 : 0);
+	packets_sent++;
+	bytes_sent += size;
+
+	uint64_t now = bucket_clock();
+	for (size_t i = 0; i < nbuckets; i++) {
+		bucket_take(buckets[i], size, now);
+	}
+}
+
+/**
+ * Returns how long new packets have to wait for the rate buckets to hold len
+ * bytes (in microseconds), 0 if they already do.
+ */
+uint64_t rate_delay(uint64_t len) {
+	uint64_t now = bucket_clock();
+	uint64_t delay = 0;
+	for (size_t i = 0; i < nbuckets; i++) {
+		delay = MAX(delay, bucket_delay(buckets[i], len, now));
+	}
+	return delay;
+}
+
+/**
+ * Returns whether the data of the packet may be given up: it holds some, and
+ * wasn't given up already.
+ */
+bool skippable(pkt_t *pkt) {
+	uint8_t kind = pkt_get_window(pkt);
+	return (kind == 0 && pkt_get_length(pkt) > 0) || kind == ZERO_KIND;
+}
+
+/**
+ * Returns the first packet in flight whose data may be given up, which
+ * expires first as deadlines follow sequence numbers, or NULL if there is
+ * none.
+ */
+pkt_t *first_expiring(void) {
+	if (!skips) {
+		return NULL;
+	}
+	size_t in_flight = (next + 256 - window_start(w)) % 256;
+	for (size_t i = 0; i < in_flight; i++) {
+		pkt_t *pkt = window_find_seqnum(w, (window_start(w) + i) % 256);
+		if (pkt != NULL && skippable(pkt)) {
+			return pkt;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Lowers timeout (-1 if there is none yet) to the time left until timer.
+ */
+void bound_timeout(int64_t *timeout, uint32_t timer, uint32_t now) {
+	/* select doesn't like negative timeouts */
+	int64_t left = time_before(now, timer) ? timer - now : 0;
+	if (*timeout == -1 || left < *timeout) {
+		*timeout = left;
+	}
+}
 
 /**
  * Returns how long the next call to select should wait (in microseconds).
- * If the buffer is full or EOF has been reached, returns the time until the
- * closest timer expiration (no less than zero). Otherwise, returns zero.
+ * If the buffer is full, EOF has been reached, the reader or the followed
+ * input has nothing ready, the rate is capped or we're waiting for the setup
+ * answer, returns the time until the closest timer expiration (no less than
+ * zero, and -1 if there is no timer).
+ * Otherwise, returns zero.
+ */
+int64_t get_timeout(void) {
+	/* Select waits until either the socket is ready for reading or the
+	 * timeout expires. If the window is full or if we've reached EOF on the
+	 * file, we can't write any more data right now and we should block,
+	 * albeit at *most* until the closest timer in the window expires. The
+	 * same goes while waiting for the reader, which wakes us up. */
+	if ((window_full(w) && !window_empty(w)) || sent_eof || input_stalled ||
+	    rate_limited || waiting_for_setup()) {
+		int64_t timeout = -1;
+		uint32_t now = get_monotime();
+
+		/* The setup packet and signature requests have timers as well */
+		pkt_t *timers[] = {window_peek_min_timestamp(w), setup_pkt};
+		for (size_t i = 0; i < sizeof (timers) / sizeof (*timers); i++) {
+			if (timers[i] != NULL) {
+				bound_timeout(&timeout, pkt_get_timestamp(timers[i]) + rto, now);
+			}
+		}
+		pkt_t *expiring = first_expiring();
+		if (expiring != NULL) {
+			bound_timeout(&timeout, deadlines[pkt_get_seqnum(expiring)], now);
+		}
+		for (size_t b = sig_low; b < sig_next; b++) {
+			if (sig_timers[b] != 0) {
+				bound_timeout(&timeout, sig_timers[b], now);
+			}
+		}
+		if (holding) {
+			bound_timeout(&timeout, hold_deadline, now);
+		}
+		if (rate_limited) {
+			bound_timeout(&timeout, rate_deadline, now);
+		}
+		if (streaming()) {
+			bound_timeout(&timeout, keepalive_deadline, now);
+		}
+		return timeout;
+	}
+	return 0;
+}
+
+void handle_ack(pkt_t *ack) {
+	/* The seqnum field has the next sequence number expected by the receiver.
+	 * The timestamp field corresponds to the last packet received by the receiver. */
+
+	/* Whether the packet with the given timestamp has been popped from the buffer. */
+	bool popped_timestamp = false;
+
+	/* ACKs are cumulative so we can remove from the buffer all packets that
+	 * precede the acknowledged sequence number. As sequence numbers wrap,
+	 * compare their distances from the start of the window: a stale ACK
+	 * (overtaken by a more recent one) lies beyond the packets in flight. */
+	size_t in_flight = (next + 256 - window_start(w)) % 256;
+	size_t acked = (pkt_get_seqnum(ack) + 256 - window_start(w)) % 256;
+
+	if (acked > in_flight) {
+		log_msg("Stale cumulative ACK, ignoring\n");
+	} else {
+		for (size_t i = 0; i < acked; i++) {
+			pkt_t *pkt = window_find_seqnum(w, (window_start(w) + i) % 256);
+			if (pkt == NULL) {
+				/* Already acknowledged through the timestamp field */
+				continue;
+			}
+
+			assert(window_pop_timestamp(w, pkt_get_timestamp(pkt)) == pkt);
+			log_msg("Removed packet #%d from buffer\n", pkt_get_seqnum(pkt));
+
+			if (pkt_get_timestamp(pkt) == pkt_get_timestamp(ack)) {
+				popped_timestamp = true;
+			}
+
+			pkt_del(pkt);
+		}
+
+		window_slide_to(w, pkt_get_seqnum(ack));
+	}
+
+	if (!popped_timestamp) {
+		pkt_t *last = window_pop_timestamp(w, pkt_get_timestamp(ack));
+		if (last == NULL) {
+			log_msg("No packet with matching timestamp in buffer\n");
+		} else {
+			log_msg("Acking packet #%d from timestamp field, removed from buffer\n",
+				pkt_get_seqnum(last));
+		}
+		pkt_del(last);
+	}
+}
+
+/**
+ * Returns crc updated with the len bytes at buf.
+ */
+uint32_t crc_of(uint32_t crc, const char *buf, size_t len) {
+	/* zlib takes 32-bit lengths */
+	while (len > 0) {
+		size_t n = MIN(len, 1 << 30);
+		crc = crc32(crc, (const unsigned char *) buf, n);
+		buf += n;
+		len -= n;
+	}
+	return crc;
+}
+
+/**
+ * Skips the first offset bytes of the input if their CRC32 matches the one of
+ * the data the receiver already has, and tells the receiver where the data
+ * we send starts. Exits on error.
+ */
+void resume_at(uint64_t offset, uint32_t crc) {
+	uint64_t start = 0;
+
+	if (offset > 0 && map != NULL) {
+		if (offset <= map_end && crc_of(0, map, offset) == crc) {
+			start = offset;
+			map_pos = offset;
+		}
+	} else if (offset > 0) {
+		/* Read through the prefix, the input may not be seekable */
+		uint32_t actual = 0;
+		uint64_t left = offset;
+		while (left > 0) {
+			ssize_t n = engine_read(eng, rbuf, MIN(left, sizeof (rbuf)));
+			if (n == -1) {
+				exit_msg("Error reading from file\n");
+			}
+			if (n == 0) {
+				break;
+			}
+			actual = crc_of(actual, rbuf, n);
+			left -= n;
+		}
+
+		if (left == 0 && actual == crc) {
+			start = offset;
+		} else if (engine_seek(eng, 0) == -1) {
+			exit_msg("Input doesn't match the receiver's data and can't be rewound\n");
+		}
+	}
+
+	if (start == offset) {
+		log_msg("Resuming at offset %llu\n", (unsigned long long) start);
+	} else {
+		log_msg("Receiver's data doesn't match, starting over\n");
+	}
+
+	offset_hdr = htobe64(start);
+	offset_hdr_pending = true;
+}
+
+/**
+ * Prepares to fetch the signatures of the receiver's basis of basis_size
+ * bytes, if we have something to compare them with. Exits on error.
+ */
+void fetch_signatures(uint64_t basis_size) {
+	if (map == NULL) {
+		log_msg("Input not mapped, sending it whole\n");
+		return;
+	}
+
+	sig_count = basis_size / DELTA_BLOCK_SIZE;
+	sig_batches = (sig_count + SIGS_PER_BATCH - 1) / SIGS_PER_BATCH;
+	if (sig_count == 0) {
+		return;
+	}
+
+	sigs = malloc(sig_count * sizeof (delta_sig_t));
+	sig_timers = calloc(sig_batches, sizeof (uint32_t));
+	if (sigs == NULL || sig_timers == NULL) {
+		exit_msg("Could not allocate signatures\n");
+	}
+	log_msg("Fetching %zu signatures in %zu batches\n", sig_count, sig_batches);
+}
+
+/**
+ * Requests a batch of signatures. Exits on error.
+ */
+void send_sig_request(size_t batch) {
+	uint32_t batch_be = htobe32(batch);
+
+	pkt_t *req = pkt_new();
+	if (req == NULL) {
+		exit_msg("Error creating packet\n");
+	}
+
+	/* Outside of the sequence numbers, like the setup */
+	pkt_status_code err = PKT_OK;
+	err = err || pkt_set_type(req, PTYPE_DATA);
+	err = err || pkt_set_window(req, SIG_KIND);
+	err = err || pkt_set_seqnum(req, next);
+	err = err || pkt_set_timestamp(req, get_monotime());
+	err = err || pkt_set_payload(req, (const char *) &batch_be, sizeof (batch_be));
+	if (err != PKT_OK) {
+		exit_msg("Could not create packet: %d\n", err);
+	}
+
+	if (engine_send(eng, req) == -1) {
+		exit_perror("send");
+	}
+	account_sent(req);
+	sig_timers[batch] = get_monotime() + rto;
+
+	log_msg("> SIGREQ %s\n", pkt_repr(req));
+	pkt_del(req);
+}
+
+/**
+ * Requests the batches of signatures not requested yet, up to SIG_INFLIGHT
+ * of them at once, and again those whose request timed out. Exits on error.
+ */
+void request_signatures(void) {
+	uint32_t now = get_monotime();
+	for (size_t b = sig_low; b < sig_next; b++) {
+		if (sig_timers[b] != 0 && !time_before(now, sig_timers[b])) {
+			send_sig_request(b);
+		}
+	}
+	while (sig_next < sig_batches && sig_next - sig_low < SIG_INFLIGHT) {
+		send_sig_request(sig_next++);
+	}
+}
+
+/**
+ * Computes the delta of the input against the basis, whose signatures we
+ * have. Exits on error.
+ */
+void compute_delta(void) {
+	ops = delta_compute(map, map_end, sigs, sig_count, &nops);
+	if (ops == NULL) {
+		exit_msg("Could not compute delta\n");
+	}
+
+	uint64_t to_copy = 0;
+	for (size_t i = 0; i < nops; i++) {
+		to_copy += ops[i].copy ? ops[i].len : 0;
+	}
+	log_msg("Delta: %llu of %zu bytes found in the basis, in %zu pieces\n",
+		(unsigned long long) to_copy, map_end, nops);
+
+	free(sigs);
+	free(sig_timers);
+	sigs = NULL;
+	sig_timers = NULL;
+}
+
+/**
+ * Stores a batch of signatures sent by the receiver, and computes the delta
+ * once we have them all.
+ */
+void handle_signatures(pkt_t *pkt) {
+	uint32_t batch;
+	if (sig_low == sig_batches || delta_batch_decode(pkt_get_payload(pkt),
+			pkt_get_length(pkt), sigs, sig_count, &batch) == -1) {
+		log_msg("Unexpected signatures, ignoring\n");
+		return;
+	}
+
+	sig_timers[batch] = 0;
+	while (sig_low < sig_next && sig_timers[sig_low] == 0) {
+		sig_low++;
+	}
+	if (sig_low == sig_batches) {
+		compute_delta();
+	}
+}
+
+/**
+ * Applies the settings agreed on in the receiver's answer to our setup.
+ * Exits if it can't receive from us.
+ */
+void handle_setup_answer(pkt_t *answer) {
+	if (setup_pkt == NULL) {
+		log_msg("Setup already answered, ignoring\n");
+		return;
+	}
+
+	setup_t remote, agreed;
+	if (setup_decode(pkt_get_payload(answer), pkt_get_length(answer), &remote) == -1) {
+		log_msg("Invalid setup answer, ignoring\n");
+		return;
+	}
+	if (remote.refusal == SETUP_REFUSE_SPACE) {
+		exit_msg("Receiver doesn't have room for the %llu bytes of the file\n",
+			(unsigned long long) local_setup.file_size);
+	} else if (remote.refusal != 0) {
+		exit_msg("Receiver refuses the transfer (%d)\n", remote.refusal);
+	}
+	if (setup_negotiate(&local_setup, &remote, &agreed) == -1) {
+		exit_msg("Receiver speaks version %d with checksum mode %d, "
+			"we speak version %d with checksum mode %d\n",
+			remote.version, remote.checksum,
+			local_setup.version, local_setup.checksum);
+	}
+	/* We don't cut the input any finer */
+	if (agreed.payload_size < MAX_PAYLOAD_SIZE) {
+		exit_msg("Receiver only accepts payloads of up to %d bytes\n",
+			agreed.payload_size);
+	}
+
+	log_msg("Setup: version %d, window %d, payload %d, extensions %#x\n",
+		agreed.version, agreed.window, agreed.payload_size, agreed.extensions);
+	payload_size = agreed.payload_size;
+
+	if (agreed.extensions & SETUP_EXT_RESUME) {
+		resume_at(remote.resume_offset, remote.resume_crc);
+	}
+	if (manifest != NULL && !(agreed.extensions & SETUP_EXT_MANIFEST)) {
+		exit_msg("Receiver doesn't take a directory, its -f must be one\n");
+	}
+	if (agreed.extensions & SETUP_EXT_DELTA) {
+		fetch_signatures(remote.basis_size);
+	}
+	if (agreed.extensions & SETUP_EXT_ZEROS) {
+		zero_runs = true;
+		if (rd != NULL) {
+			reader_detect_zeros(rd);
+		}
+	}
+	if (opts.messages && !(agreed.extensions & SETUP_EXT_MESSAGES)) {
+		/* They're written out all the same, only later */
+		log_msg("Receiver doesn't know messages, it may hold them\n");
+	}
+	if (agreed.extensions & SETUP_EXT_SKIP) {
+		skips = opts.lifetime > 0;
+	} else if (opts.lifetime > 0) {
+		log_msg("Receiver can't skip data, it will all be delivered\n");
+	}
+	if (agreed.extensions & SETUP_EXT_DUPLEX) {
+		duplex = true;
+		data_size = DUPLEX_PAYLOAD_SIZE;
+	} else if (opts.back_output != NULL) {
+		log_msg("Receiver sends nothing back\n");
+	}
+	if (agreed.extensions & SETUP_EXT_ECN) {
+		ecn = true;
+	} else if (ecn_capable && set_ecn(sockfd, 0) == -1) {
+		/* Marks would go unnoticed */
+		exit_perror("Could not clear ECN");
+	}
+
+	pkt_del(setup_pkt);
+	setup_pkt = NULL;
+}
+
+/**
+ * Fills ack with the ACK of the data the receiver sent back.
+ * Returns a status code like the setters.
+ */
+pkt_status_code make_back_ack(pkt_t *ack) {
+	pkt_status_code err = PKT_OK;
+	err = err || pkt_set_type(ack, PTYPE_ACK);
+	err = err || pkt_set_window(ack, window_available(back_w));
+	err = err || pkt_set_seqnum(ack, window_start(back_w));
+	err = err || pkt_set_timestamp(ack, back_echo);
+	return err;
+}
+
+/**
+ * Sends a standalone ACK of the data the receiver sent back, when none of
+ * ours carried it. Exits on error.
+ */
+void send_back_ack(void) {
+	pkt_t *ack = pkt_new();
+	if (ack == NULL) {
+		exit_msg("Could not allocate packet\n");
+	}
+	pkt_status_code err = make_back_ack(ack);
+	if (err != PKT_OK) {
+		exit_msg("Could not create packet: %d\n", err);
+	}
+	if (engine_send(eng, ack) == -1) {
+		exit_perror("send");
+	}
+	log_msg("> %s\n", pkt_repr(ack));
+	pkt_del(ack);
+	back_ack_pending = false;
+}
+
+/**
+ * Sends a DATA packet of the window, with the ACK of the data the receiver
+ * sends back in front in a duplex session. Exits on error.
+ */
+void send_data(pkt_t *pkt) {
+	pkt_t *out = pkt;
+	if (duplex) {
+		pkt_t *ack = pkt_new();
+		if (ack == NULL || make_back_ack(ack) != PKT_OK) {
+			exit_msg("Could not create ACK\n");
+		}
+		out = piggyback_wrap(pkt, ack, back_fresh);
+		if (out == NULL) {
+			exit_msg("Could not piggyback ACK\n");
+		}
+		pkt_del(ack);
+		back_fresh = false;
+		back_ack_pending = false;
+	}
+
+	if (engine_send(eng, out) == -1) {
+		exit_perror("send");
+	}
+	account_sent(out);
+	if (out != pkt) {
+		pkt_del(out);
+	}
+}
+
+/**
+ * Takes a packet of the data the receiver sends back, writing out what is
+ * in sequence to backfile. Exits on error.
+ */
+void handle_back_data(pkt_t *pkt) {
+	uint8_t seqnum = pkt_get_seqnum(pkt);
+	uint32_t timestamp = pkt_get_timestamp(pkt);
+	size_t behind = (window_start(back_w) + 256 - seqnum) % 256;
+
+	/* The receiver pops the packet whose timestamp we echo: only echo those
+	 * we hold or delivered already, or it would never resend the others */
+	if (!window_has(back_w, seqnum)) {
+		bool delivered = (back_bytes > 0 || back_eof) && behind > 0 &&
+			behind <= MAX_WINDOW_SIZE;
+		pkt_del(pkt);
+		if (!delivered) {
+			log_msg("Data sent back out of window, ignoring\n");
+			return;
+		}
+		/* Our ACK of it was lost, and maybe all the later ones */
+		log_msg("Data sent back delivered already, acknowledging again\n");
+	} else if (window_find_seqnum(back_w, seqnum) != NULL) {
+		pkt_del(pkt);
+	} else if (window_push(back_w, pkt) == -1) {
+		log_msg("Buffer of the data sent back full, ignoring\n");
+		pkt_del(pkt);
+		return;
+	}
+	back_echo = timestamp;
+	back_fresh = true;
+	back_ack_pending = true;
+
+	pkt_t *next_pkt;
+	while ((next_pkt = window_find_seqnum(back_w, window_start(back_w))) != NULL) {
+		assert(window_pop_timestamp(back_w, pkt_get_timestamp(next_pkt)) == next_pkt);
+		size_t len = pkt_get_length(next_pkt);
+		if (len == 0) {
+			/* Like the receiver, stay on the EOF packet so that its
+			 * retransmissions are acknowledged again */
+			if (!back_eof && fflush(backfile) == EOF) {
+				exit_perror("Could not flush data sent back");
+			}
+			back_eof = true;
+			pkt_del(next_pkt);
+			log_msg("Received all the data sent back\n");
+			break;
+		}
+		if (fwrite(pkt_get_payload(next_pkt), 1, len, backfile) != len) {
+			exit_perror("Could not write data sent back");
+		}
+		back_bytes += len;
+		window_slide(back_w);
+		pkt_del(next_pkt);
+	}
+}
+
+/**
+ * Resends a packet of the window, stamped with the current time, which
+ * restarts its retransmission timer. Exits on error.
+ */
+void resend(pkt_t *pkt) {
+	/* Don't take the time outside! Stamps must tell packets apart. */
+	if (window_update_timestamp(w, pkt_get_timestamp(pkt), get_monotime()) == -1) {
+		exit_msg("Cannot update timestamp of packet\n");
+	}
+
+	send_data(pkt);
+
+	/* The packet was in the buffer already so nothing else to do */
+
+	log_msg("> RETR %s\n", pkt_repr(pkt));
+}
+
+/**
+ * Reduces the congestion window if the receiver counted CE marks we didn't
+ * know about.
+ */
+void handle_ecn_echo(pkt_t *ack) {
+	uint32_t count;
+	memcpy(&count, pkt_get_payload(ack), sizeof (count));
+	count = be32toh(count);
+
+	/* ACKs may be reordered, only a count beyond the last one is news */
+	if ((int32_t) (count - ce_seen) <= 0) {
+		return;
+	}
+	ce_seen = count;
+
+	uint32_t now = get_monotime();
+	if (cwr && time_before(now, cwr_deadline)) {
+		log_msg("CE marks echoed (%u), already reduced\n", count);
+		return;
+	}
+	cwnd = MAX(window_get_size(w) / 2, 1);
+	cwnd_acked = 0;
+	cwr = true;
+	cwr_deadline = now + (rtt_known ? srtt : rto);
+	log_msg("CE marks echoed (%u), congestion window reduced to %zu\n", count, cwnd);
+}
+
+/**
+ * Grows the congestion window by a packet per window of ACKs.
+ */
+void grow_cwnd(void) {
+	if (cwnd < MAX_WINDOW_SIZE && ++cwnd_acked >= cwnd) {
+		cwnd++;
+		cwnd_acked = 0;
+	}
+}
+
+void handle_nack(pkt_t *nack) {
+	if (!window_has(w, pkt_get_seqnum(nack))) {
+		log_msg("Out of window, ignoring\n");
+		return;
+	}
+
+	pkt_t *match = window_find_seqnum(w, pkt_get_seqnum(nack));
+	if (match == NULL) {
+		log_msg("No packet with matching seqnum in buffer\n");
+		return;
+	}
+
+	/* It got there damaged, resend it right away */
+	resend(match);
+}
+
+/**
+ * Gives up the data of the packets that outlived opts.lifetime, sending
+ * SKIP_KIND packets in their place right away. Exits on error.
+ */
+void skip_expired(void) {
+	pkt_t *pkt;
+	while ((pkt = first_expiring()) != NULL &&
+	       !time_before(get_monotime(), deadlines[pkt_get_seqnum(pkt)])) {
+		uint64_t len = pkt_get_length(pkt);
+		if (pkt_get_window(pkt) == ZERO_KIND) {
+			memcpy(&len, pkt_get_payload(pkt), sizeof (len));
+			len = be64toh(len);
+		}
+		bytes_skipped += len;
+
+		uint64_t len_be = htobe64(len);
+		pkt_status_code err = PKT_OK;
+		err = err || pkt_set_window(pkt, SKIP_KIND);
+		err = err || pkt_set_payload(pkt, (const char *) &len_be, sizeof (len_be));
+		if (err != PKT_OK) {
+			exit_msg("Could not create packet: %d\n", err);
+		}
+
+		log_msg("Packet #%d expired, skipping its %llu bytes\n",
+			pkt_get_seqnum(pkt), (unsigned long long) len);
+		resend(pkt);
+	}
+}
+
+/**
+ * Resend each packet for which the retransmission timer has expired, then
+ * back the timer off if there were any. Exits on error.
+ */
+void retransmit_packets(void) {
+	uint32_t loop_now = get_monotime();
+	bool expired = false;
+
+	if (setup_pkt != NULL && timer_expired(pkt_get_timestamp(setup_pkt), loop_now)) {
+		pkt_set_timestamp(setup_pkt, get_monotime());
+		if (engine_send(eng, setup_pkt) == -1) {
+			exit_perror("send");
+		}
+		account_sent(setup_pkt);
+		log_msg("> RETR SETUP %s\n", pkt_repr(setup_pkt));
+		expired = true;
+	}
+
+	pkt_t *pkt = window_peek_min_timestamp(w);
+
+	while (pkt != NULL && timer_expired(pkt_get_timestamp(pkt), loop_now)) {
+		resend(pkt);
+		expired = true;
+		pkt = window_peek_min_timestamp(w);
+	}
+
+	/* The path may have gotten slower, or everything sent was lost: wait
+	 * longer before trying again, until an ACK gives a new estimate */
+	if (expired) {
+		rto = MIN(2 * (uint64_t) rto, RTO_MAX);
+		log_msg("Retransmission timer backed off to %.3fs\n", (double) rto / 1000000);
+	}
+}
+
+/**
+ * Fills the metadata of s with that of the input, if it's a regular file that
+ * won't grow.
+ * Returns whether it is.
+ */
+bool describe_input(setup_t *s) {
+	struct stat st;
+	if (infile == NULL || manifest != NULL || opts.follow || opts.messages ||
+	    fstat(fileno(infile), &st) == -1 || !S_ISREG(st.st_mode)) {
+		return false;
+	}
+
+	s->file_size = st.st_size;
+	s->file_mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+	s->file_mode = st.st_mode & 07777;
+	if (filename != NULL) {
+		const char *slash = strrchr(filename, '/');
+		snprintf(s->file_name, sizeof (s->file_name), "%s",
+			slash != NULL ? slash + 1 : filename);
+	}
+	return true;
+}
+
+/**
+ * Proposes our settings to the receiver. Exits on error.
+ */
+void send_setup(void) {
+	setup_init(&local_setup, window_get_size(w));
+	if (opts.resume) {
+		local_setup.extensions |= SETUP_EXT_RESUME;
+	}
+	if (opts.delta) {
+		local_setup.extensions |= SETUP_EXT_DELTA;
+	}
+	if (manifest != NULL) {
+		local_setup.extensions |= SETUP_EXT_MANIFEST;
+	}
+	if (ecn_capable) {
+		local_setup.extensions |= SETUP_EXT_ECN;
+	}
+	if (opts.messages) {
+		local_setup.extensions |= SETUP_EXT_MESSAGES;
+	}
+	if (opts.lifetime > 0) {
+		local_setup.extensions |= SETUP_EXT_SKIP;
+	}
+	if (opts.back_output != NULL) {
+		local_setup.extensions |= SETUP_EXT_DUPLEX;
+	}
+	if (map != NULL && manifest == NULL && !opts.delta && opts.lifetime == 0 &&
+	    !has_holes(fileno(infile), map_len)) {
+		/* The receiver can then write what it gets out of order in place
+		 * rather than hold it. Runs of zeros would break the count, and
+		 * a file without holes has few. */
+		local_setup.extensions &= ~SETUP_EXT_ZEROS;
+		local_setup.extensions |= SETUP_EXT_PLACED;
+	}
+	if (describe_input(&local_setup)) {
+		/* The receiver may not have room for it */
+		local_setup.extensions |= SETUP_EXT_METADATA;
+		setup_wait = true;
+	}
+	char payload[SETUP_MAX_SIZE];
+	size_t len = setup_encode(&local_setup, payload);
+
+	setup_pkt = pkt_new();
+	if (setup_pkt == NULL) {
+		exit_msg("Error creating packet\n");
+	}
+
+	/* Outside of the sequence numbers, the receiver tells it apart by
+	 * its window field */
+	pkt_status_code err = PKT_OK;
+	err = err || pkt_set_type(setup_pkt, PTYPE_DATA);
+	err = err || pkt_set_window(setup_pkt, SETUP_KIND);
+	err = err || pkt_set_seqnum(setup_pkt, next);
+	err = err || pkt_set_timestamp(setup_pkt, get_monotime());
+	err = err || pkt_set_payload(setup_pkt, payload, len);
+	if (err != PKT_OK) {
+		exit_msg("Could not create packet: %d\n", err);
+	}
+
+	if (engine_send(eng, setup_pkt) == -1) {
+		exit_perror("send");
+	}
+	account_sent(setup_pkt);
+
+	log_msg("> SETUP %s\n", pkt_repr(setup_pkt));
+}
+
+/**
+ * Sends a window probe: a truncated empty DATA packet with the next sequence
+ * number, which the receiver answers with a NACK advertising its window.
+ * Exits on error.
+ */
+void send_window_probe(void) {
+	pkt_t *probe = pkt_new();
+	if (probe == NULL) {
+		exit_msg("Error creating packet\n");
+	}
+
+	pkt_status_code err = PKT_OK;
+	err = err || pkt_set_type(probe, PTYPE_DATA);
+	err = err || pkt_set_tr(probe, 1);
+	err = err || pkt_set_seqnum(probe, next);
+	err = err || pkt_set_window(probe, 0);
+	err = err || pkt_set_timestamp(probe, get_monotime());
+	if (err != PKT_OK) {
+		exit_msg("Could not create packet: %d\n", err);
+	}
+
+	if (engine_send(eng, probe) == -1) {
+		exit_perror("send");
+	}
+	account_sent(probe);
+
+	log_msg("> PROBE %s\n", pkt_repr(probe));
+	pkt_del(probe);
+}
+
+/**
+ * Maps infile in memory if it is a non-empty regular file, otherwise leaves
+ * it to be read through the engine.
+ */
+void map_input(void) {
+	struct stat st;
+	if (fstat(fileno(infile), &st) == -1) {
+		exit_perror("fstat");
+	}
+	if (!S_ISREG(st.st_mode) || st.st_size == 0) {
+		return;
+	}
+
+	void *addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(infile), 0);
+	if (addr == MAP_FAILED) {
+		log_perror("mmap");
+		return;
+	}
+
+	/* We read it once from start to end */
+	if (madvise(addr, st.st_size, MADV_SEQUENTIAL) == -1) {
+		log_perror("madvise");
+	}
+
+	map = addr;
+	map_len = st.st_size;
+	map_end = map_len;
+	log_msg("Mapped %zu bytes of input\n", map_len);
+}
+
+/**
+ * Lists the files of the directory given as input. Exits on error.
+ */
+void scan_input_dir(void) {
+	if (opts.stripes > 0 || opts.resume || opts.delta || opts.follow ||
+	    opts.messages || opts.lifetime > 0 || opts.back_output != NULL) {
+		exit_msg("Directories can't be striped, resumed, followed, sent as "
+			"deltas or as messages, expire or have data sent back\n");
+	}
+
+	manifest = manifest_scan(filename);
+	if (manifest == NULL) {
+		exit_perror("Could not list directory");
+	}
+	log_msg("Sending %zu entries, skipping %zu\n", manifest->count, manifest->skipped);
+}
+
+/**
+ * Moves on to the next entry of the directory: opens and maps it, and
+ * prepares its header to be sent first.
+ * Returns false if there is none left. Exits on error.
+ */
+bool next_entry(void) {
+	if (infile != NULL) {
+		if (map != NULL) {
+			munmap((void *) map, map_len);
+		}
+		fclose(infile);
+		infile = NULL;
+		map = NULL;
+		map_len = map_pos = map_end = 0;
+	}
+	if (entry_idx == manifest->count) {
+		return false;
+	}
+
+	const manifest_entry_t *entry = &manifest->entries[entry_idx++];
+	file_hdr_t hdr = {.size = 0, .mode = entry->mode};
+	strcpy(hdr.name, entry->name);
+
+	if (S_ISREG(entry->mode)) {
+		infile = fopen(entry->path, "rb");
+		if (infile == NULL) {
+			exit_perror("fopen");
+		}
+		map_input();
+
+		/* Files are only sent from their mapping */
+		struct stat st;
+		if (fstat(fileno(infile), &st) == -1) {
+			exit_perror("fstat");
+		}
+		if (map == NULL && st.st_size > 0) {
+			exit_msg("Could not map %s\n", entry->path);
+		}
+		hdr.size = map_len;
+	}
+
+	file_hdr_len = file_hdr_encode(&hdr, file_hdr);
+	log_msg("Sending %s (%llu bytes)\n", hdr.name, (unsigned long long) hdr.size);
+	return true;
+}
+
+/**
+ * Prepares to follow the input, which must be a regular file, and has the
+ * engine wake us up when it's modified. Exits on error.
+ */
+void start_following(void) {
+	struct stat st;
+	if (fstat(fileno(infile), &st) == -1) {
+		exit_perror("fstat");
+	}
+	if (!S_ISREG(st.st_mode)) {
+		exit_msg("Only regular files can be followed\n");
+	}
+
+	/* Watched through its descriptor, which works for stdin as well */
+	char path[32];
+	snprintf(path, sizeof (path), "/proc/self/fd/%d", fileno(infile));
+	inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (inotify_fd == -1) {
+		exit_perror("inotify_init1");
+	}
+	if (inotify_add_watch(inotify_fd, path, IN_MODIFY) == -1) {
+		exit_perror("inotify_add_watch");
+	}
+	engine_watch(eng, inotify_fd);
+
+	keepalive_deadline = get_monotime() + KEEPALIVE;
+	log_msg("Following input, flushing partial payloads after %.3fs\n",
+		(double) opts.follow_latency / 1000000);
+}
+
+/**
+ * Reads at most len bytes of the input through the engine. When following,
+ * takes note of the modifications first, and starts over from the start of
+ * the input if it was truncated (as by log rotation).
+ * Returns the number of bytes read, 0 if there are none (yet). Exits on error.
+ */
+size_t read_input(char *buf, size_t len) {
+	if (opts.follow) {
+		/* Anything appended after the read below will trigger a new
+		 * event, so we can't miss it */
+		char events[4096] __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+		while (read(inotify_fd, events, sizeof (events)) > 0) {
+			/* We only watch for modifications */
+		}
+	}
+
+	ssize_t n = engine_read(eng, buf, len);
+	if (n == -1) {
+		exit_msg("Error reading from file\n");
+	}
+
+	if (n == 0 && opts.follow) {
+		struct stat st;
+		if (fstat(fileno(infile), &st) == -1) {
+			exit_perror("fstat");
+		}
+		if (st.st_size < engine_tell(eng)) {
+			log_msg("Input truncated, following it from its start\n");
+			if (engine_seek(eng, 0) == -1) {
+				exit_perror("Could not rewind input");
+			}
+			n = engine_read(eng, buf, len);
+			if (n == -1) {
+				exit_msg("Error reading from file\n");
+			}
+		}
+	}
+	return n;
+}
+
+/**
+ * When following the input, returns whether the data read but not sent yet
+ * can go: whole payloads right away, and a partial one once it has been held
+ * for opts.follow_latency.
+ */
+bool follow_ready(void) {
+	size_t left = rbuf_len - rbuf_pos;
+	if (left >= MAX_PAYLOAD_SIZE) {
+		holding = false;
+		return true;
+	}
+	if (left == 0) {
+		return false;
+	}
+
+	uint32_t now = get_monotime();
+	if (!holding) {
+		holding = true;
+		hold_deadline = now + opts.follow_latency;
+	}
+	if (time_before(now, hold_deadline)) {
+		return false;
+	}
+	holding = false;
+	return true;
+}
+
+/**
+ * Gets the input ready for messages, which are read as they come.
+ * Exits on error.
  */
-uint32_t get_timeout(void) {
-	/* Select waits until either the socket is ready for reading or the
-	 * timeout expires. If the window is full or if we've reached EOF on the
-	 * file, we can't write any more data right now and we should block,
-	 * albeit at *most* until the closest timer in the window expires. */
-	if ((window_full(w) && !window_empty(w)) || sent_eof) {
-		uint32_t timer = pkt_get_timestamp(window_peek_min_timestamp(w));
-		uint32_t now = get_monotime();
-		/* select doesn't like negative timeouts, and we can't return
-		 * a negative number through an unsigned type anyway */
-		if (timer > now) {
-			return timer - now;
-		}
+void start_messages(void) {
+	int fd = fileno(infile);
+	int flags = fcntl(fd, F_GETFL);
+	if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+		exit_perror("fcntl");
 	}
-	return 0;
+	keepalive_deadline = get_monotime() + KEEPALIVE;
+	log_msg("Sending messages, coalescing them for up to %.3fs\n",
+		(double) opts.message_latency / 1000000);
 }
 
-void handle_ack(pkt_t *ack) {
-	/* The seqnum field has the next sequence number expected by the receiver.
-	 * The timestamp field corresponds to the last packet received by the receiver. */
+/**
+ * Reads the messages the application wrote since the last call, if there is
+ * room for them in rbuf. Exits on error.
+ */
+void read_messages(void) {
+	size_t left = rbuf_len - rbuf_pos;
+	memmove(rbuf, rbuf + rbuf_pos, left);
+	rbuf_len = left;
+	rbuf_pos = 0;
 
-	/* Whether the packet with the given timestamp has been popped from the buffer. */
-	bool popped_timestamp = false;
+	while (rbuf_len < sizeof (rbuf) && !input_eof) {
+		ssize_t n = read(fileno(infile), rbuf + rbuf_len, sizeof (rbuf) - rbuf_len);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		if (n == -1 && errno == EAGAIN) {
+			break;
+		}
+		if (n == -1) {
+			exit_perror("read");
+		}
+		if (n == 0) {
+			input_eof = true;
+		}
+		rbuf_len += n;
+	}
+}
 
-	/* ACKs are cumulative so we can remove from the buffer all packets that
-	 * have a smaller sequence number. */
-	pkt_t *min_seqnum = window_peek_min_seqnum(w);
-	while (min_seqnum != NULL && pkt_get_seqnum(min_seqnum) < pkt_get_seqnum(ack)) {
-		assert(window_pop_min_seqnum(w) == min_seqnum);
-		log_msg("Removed packet #%d from buffer\n", pkt_get_seqnum(min_seqnum));
+/**
+ * Returns whether the messages at the start of rbuf can go, setting *len to
+ * the length of those that fit in a payload: once it can't take more, once
+ * the messages sent before were acknowledged, or once they've been held for
+ * opts.message_latency. At the end of the input, returns true with *len = 0.
+ * Exits if the input isn't made of valid messages.
+ */
+bool messages_ready(size_t *len) {
+	bool full;
+	ssize_t whole = message_pack(rbuf + rbuf_pos, rbuf_len - rbuf_pos,
+		MAX_PAYLOAD_SIZE, &full);
+	if (!full && !input_eof) {
+		read_messages();
+		whole = message_pack(rbuf, rbuf_len, MAX_PAYLOAD_SIZE, &full);
+	}
+	if (whole == -1) {
+		exit_msg("Invalid message length in the input\n");
+	}
+	*len = whole;
 
-		if (pkt_get_timestamp(min_seqnum) == pkt_get_timestamp(ack)) {
-			popped_timestamp = true;
-		}
+	if (input_eof && whole == 0 && rbuf_pos < rbuf_len) {
+		exit_msg("Input ends in the middle of a message\n");
+	}
+	if (full || input_eof || window_empty(w)) {
+		holding = false;
+		return input_eof || whole > 0;
+	}
+	if (whole == 0) {
+		return false;
+	}
 
-		pkt_del(min_seqnum);
-		min_seqnum = window_peek_min_seqnum(w);
+	uint32_t now = get_monotime();
+	if (!holding) {
+		holding = true;
+		hold_deadline = now + opts.message_latency;
 	}
+	if (time_before(now, hold_deadline)) {
+		return false;
+	}
+	holding = false;
+	return true;
+}
 
-	window_slide_to(w, pkt_get_seqnum(ack));
+/**
+ * Returns the burst allowed by a cap of rate bytes per second: what is sent
+ * in BURST_TIME, but no less than a full window.
+ */
+uint64_t burst_of(uint64_t rate) {
+	return MAX(rate * BURST_TIME / 1000000, MAX_WINDOW_SIZE * MAX_PACKET_SIZE);
+}
 
-	if (!popped_timestamp) {
-		pkt_t *last = window_pop_timestamp(w, pkt_get_timestamp(ack));
-		if (last == NULL) {
-			log_msg("No packet with matching timestamp in buffer\n");
-		} else {
-			log_msg("Acking packet #%d from timestamp field, removed from buffer\n",
-				pkt_get_seqnum(last));
+/**
+ * Creates the bucket of the transfer and opens the one of the host, as
+ * requested. Exits on error.
+ */
+void open_buckets(void) {
+	if (opts.rate > 0) {
+		buckets[nbuckets] = bucket_create(opts.rate, burst_of(opts.rate));
+		if (buckets[nbuckets] == NULL) {
+			exit_perror("Could not create rate bucket");
 		}
-		pkt_del(last);
+		nbuckets++;
+	}
+	if (opts.host_rate > 0) {
+		buckets[nbuckets] = bucket_open(HOST_BUCKET, opts.host_rate,
+			burst_of(opts.host_rate));
+		if (buckets[nbuckets] == NULL) {
+			exit_perror("Could not open rate bucket of the host");
+		}
+		report_host = bucket_total(buckets[nbuckets]);
+		nbuckets++;
 	}
 }
 
-void handle_nack(pkt_t *nack) {
-	if (!window_has(w, pkt_get_seqnum(nack))) {
-		log_msg("Out of window, ignoring\n");
-		return;
-	}
+/**
+ * Logs the rate achieved since the last report, and with -B, the rate of all
+ * the capped transfers of the host.
+ */
+void report_rate(void) {
+	uint64_t now = bucket_clock();
+	double secs = (double) (now - report_time) / 1000000;
+	double mbits = (bytes_sent - report_bytes) * 8 / secs / 1000000;
+	log_msg("Rate: %.3f Mbit/s over %.3fs\n", mbits, secs);
+	report_time = now;
+	report_bytes = bytes_sent;
 
-	pkt_t *match = window_find_seqnum(w, pkt_get_seqnum(nack));
-	if (match == NULL) {
-		log_msg("No packet with matching seqnum in buffer\n");
-		return;
+	if (opts.host_rate > 0) {
+		bucket_t *host = buckets[nbuckets - 1];
+		uint64_t total = bucket_total(host);
+		log_msg("Rate of the host: %.3f Mbit/s, capped at %.3f\n",
+			(total - report_host) * 8 / secs / 1000000,
+			(double) bucket_rate(host) * 8 / 1000000);
+		report_host = total;
 	}
-
-	/* Set the timer of the corresponding packet to the current time
-	 * so that it will be resent immediately (retransmit_packets calls
-	 * get_monotime after this). */
-	pkt_set_timestamp(match, get_monotime());
 }
 
 /**
- * Resend each packet for which the retransmission timer has expired.
- * Exits on error.
+ * Splits the input in opts.stripes ranges and forks a process sending each of
+ * them, then waits for them and exits. Returns in the children only, with
+ * the mapping restricted to their range. Exits on error.
  */
-void retransmit_packets(void) {
-	uint32_t loop_now = get_monotime();
-	pkt_t *pkt = window_peek_min_timestamp(w);
+void fork_stripes(void) {
+	struct stat st;
+	if (fstat(fileno(infile), &st) == -1) {
+		exit_perror("fstat");
+	}
+	if (!S_ISREG(st.st_mode) || (map == NULL && st.st_size > 0)) {
+		exit_msg("Striping needs a regular input file that can be mapped\n");
+	}
 
-	while (pkt != NULL && pkt_get_timestamp(pkt) <= loop_now) {
-		/* Don't put this outside the loop! Would defeat its purpose. */
-		uint32_t now = get_monotime();
+	/* Stripes start on payload boundaries */
+	size_t stripe_len = (map_len + opts.stripes - 1) / opts.stripes;
+	stripe_len = (stripe_len + MAX_PAYLOAD_SIZE - 1) / MAX_PAYLOAD_SIZE * MAX_PAYLOAD_SIZE;
 
-		/* Reschedule the retransmission of the packet in case it fails again */
-		if (window_update_timestamp(w, pkt_get_timestamp(pkt), now + TIMER) == -1) {
-			exit_msg("Cannot update timestamp of packet\n");
+	pid_t pids[MAX_STRIPES];
+	for (unsigned i = 0; i < opts.stripes; i++) {
+		size_t start = MIN(i * stripe_len, map_len);
+		size_t end = MIN(start + stripe_len, map_len);
+
+		pids[i] = fork();
+		if (pids[i] == -1) {
+			exit_perror("fork");
+		}
+		if (pids[i] == 0) {
+			map_pos = start;
+			map_end = end;
+			offset_hdr = htobe64(start);
+			offset_hdr_pending = true;
+			log_msg("Stripe %u: %zu bytes at offset %zu\n", i, end - start, start);
+			return;
 		}
+	}
 
-		/* Resend it now */
-		if (send_packet(sockfd, pkt) == -1) {
-			exit_perror("send");
+	int failed = 0;
+	for (unsigned i = 0; i < opts.stripes; i++) {
+		int status;
+		if (waitpid(pids[i], &status, 0) == -1) {
+			exit_perror("waitpid");
 		}
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			log_msg("Stripe %u failed\n", i);
+			failed = 1;
+		}
+	}
+	exit(failed);
+}
+
+/**
+ * Seeds the RTT estimate from the path metrics cache, and returns the
+ * initial window it suggests: the last one the receiver advertised, no more
+ * than the bandwidth-delay product of the path. Returns INITIAL_WINDOW if
+ * the cache has nothing on the path.
+ */
+unsigned load_metrics(void) {
+	metrics_cache_t *c = metrics_open(opts.cache);
+	if (c == NULL) {
+		log_perror("metrics_open");
+		return INITIAL_WINDOW;
+	}
+	path_metrics_t m;
+	int found = metrics_lookup(c, &dst, time(NULL), &m);
+	metrics_close(c);
+	if (found == -1) {
+		log_msg("No metrics of the path cached\n");
+		return INITIAL_WINDOW;
+	}
 
-		/* The packet was in the buffer already so nothing else to do */
+	if (m.srtt != 0) {
+		srtt = m.srtt;
+		rttvar = m.rttvar;
+		rtt_known = true;
+		uint64_t timer = srtt + 4 * (uint64_t) rttvar;
+		rto = MIN(MAX(timer, RTO_MIN), RTO_MAX);
+	}
 
-		log_msg("> RETR %s\n", pkt_repr(pkt));
-		pkt = window_peek_min_timestamp(w);
+	unsigned window = m.window != 0 ? m.window : INITIAL_WINDOW;
+	if (m.rate != 0 && m.srtt != 0) {
+		uint64_t bdp = m.rate * m.srtt / 1000000 / (MAX_PAYLOAD_SIZE + HEADER_SIZE + 4);
+		window = MIN(window, MAX(bdp, 1));
 	}
+	window = MIN(MAX(window, 1), MAX_WINDOW_SIZE);
+
+	log_msg("Cached metrics: RTT %uus (+-%uus), rate %llu bytes/s, payload %u, "
+		"window %u, starting with window %u and timer %uus\n",
+		m.srtt, m.rttvar, (unsigned long long) m.rate, m.payload_size,
+		m.window, window, rto);
+	return window;
 }
 
 /**
- * Called inside a loop that terminates on (!sent_eof || !window_empty(w)).
- * Exits on error.
+ * Stores what this transfer measured on the path in the metrics cache.
  */
-void main_loop(void) {
-	/* Initialize the set inside the loop as it is mutated by select */
-	fd_set read_fds;
-	FD_ZERO(&read_fds);
-	FD_SET(sockfd, &read_fds);
-
-	if (!sent_eof && window_buffer_size(w) == 0 && window_get_size(w) == 0) {
-		log_msg("---------- Waiting indefinitely...\n");
-		log_msg("Window: [%zu, %zu], buffer: %zu/%zu\n", window_start(w),
-			window_end(w), window_buffer_size(w), window_get_size(w));
+void store_metrics(void) {
+	path_metrics_t m = {0};
+	/* Only those measured, not those we were seeded with */
+	if (rtt_samples > 0) {
+		m.srtt = srtt;
+		m.rttvar = rttvar;
+	}
+	/* The rate of a capped, striped or streamed transfer says little about
+	 * the path, nor that of a short one, which never opened its window */
+	uint64_t elapsed = bucket_clock() - start_time;
+	if (nbuckets == 0 && opts.stripes == 0 && !opts.follow && !opts.messages &&
+	    packets_sent >= MAX_WINDOW_SIZE && elapsed > 0) {
+		m.rate = bytes_sent * 1000000 / elapsed;
+	}
+	m.payload_size = payload_size;
+	m.window = last_rwin;
 
-		if (select(sockfd + 1, &read_fds, NULL, NULL, NULL) == -1) {
-			exit_perror("select");
-		}
-	} else {
-		/* Timeout will be zero unless the buffer is full or EOF was sent */
-		uint32_t timeout_us = get_timeout();
-		struct timeval timeout_tv = micro_to_timeval(timeout_us);
+	metrics_cache_t *c = metrics_open(opts.cache);
+	if (c == NULL) {
+		log_perror("metrics_open");
+		return;
+	}
+	if (metrics_update(c, &dst, time(NULL), &m) == -1) {
+		log_perror("metrics_update");
+	}
+	metrics_close(c);
+}
 
-		log_msg("---------- Waiting for %.3fs...\n", (double) timeout_us / 1000000);
-		log_msg("Window: [%zu, %zu], buffer: %zu/%zu\n", window_start(w),
-			window_end(w), window_buffer_size(w), window_get_size(w));
+/**
+ * Reads, encodes and queues new packets until the window is full or the EOF
+ * packet has been sent. Exits on error.
+ */
+void send_new_packets(void) {
+	input_stalled = false;
+	rate_limited = false;
+	if (opts.messages) {
+		/* Only watch the input while waiting for it, it stays readable
+		 * while the window is full */
+		engine_watch(eng, -1);
+	}
 
-		/* Wait until either we receive data on the socket
-		* or the timeout expires */
-		if (select(sockfd + 1, &read_fds, NULL, NULL, &timeout_tv) == -1) {
-			exit_perror("select");
-		}
+	if (waiting_for_setup()) {
+		return;
 	}
 
-	/* Received an ACK or a NACK */
-	if (FD_ISSET(sockfd, &read_fds)) {
-		char buf[MAX_PACKET_SIZE];
-		int len = recv(sockfd, buf, MAX_PACKET_SIZE, 0);
-		if (len == -1) {
-			exit_perror("recv");
+	/* Only now, as the setup may move where the input starts */
+	if (opts.pipeline && rd == NULL && ops == NULL && manifest == NULL) {
+		rd = reader_start(fileno(infile), map, map_pos, map_end);
+		if (rd == NULL) {
+			exit_msg("Could not start reader thread\n");
 		}
-
-		pkt_t *resp = pkt_new();
-		if (resp == NULL) {
-			exit_msg("Could not allocate packet\n");
+		if (zero_runs) {
+			reader_detect_zeros(rd);
 		}
+		engine_watch(eng, reader_fd(rd));
+	}
 
-		pkt_status_code err = pkt_decode(buf, len, resp);
-
-		if (err != PKT_OK) {
-			log_msg("Error decoding packet (%s), ignoring\n",
-				pkt_code_to_str(err));
-		} else {
-			log_msg("< %s\n", pkt_repr(resp));
+	while (!window_full(w) && !sent_eof) {
+		/* Once the buckets are in debt, wait until they can take what
+		 * the window has room for, so as to send it in one batch */
+		if (nbuckets > 0 && rate_delay(0) > 0) {
+			uint64_t batch = window_available(w) * MAX_PACKET_SIZE;
+			rate_deadline = get_monotime() + rate_delay(batch);
+			rate_limited = true;
+			break;
+		}
 
-			switch (pkt_get_type(resp)) {
-			case PTYPE_DATA:
-				log_msg("Received DATA packet, ignoring\n");
-				return;
+		const char *payload;
+		size_t len;
+		/* The files of a directory are unmapped as soon as they're
+		 * sent, while their packets may still be in flight */
+		bool by_ref = map != NULL && manifest == NULL;
+		const chunk_t *chunk = NULL;
+		uint64_t zeros = 0; /* length of the run of zeros to send instead */
+		uint64_t zeros_be;
+		const delta_op_t *copy = NULL; /* copy of the basis to send instead */
+		uint64_t copy_be[2];
+		uint8_t kind = 0;
 
-			case PTYPE_ACK:
-				log_msg("Received ACK for #%d\n", pkt_get_seqnum(resp) - 1);
-				handle_ack(resp);
+		if (offset_hdr_pending) {
+			payload = (const char *) &offset_hdr;
+			len = sizeof (offset_hdr);
+			by_ref = false;
+			offset_hdr_pending = false;
+		} else if (file_hdr_len > 0) {
+			payload = file_hdr;
+			len = file_hdr_len;
+			by_ref = false;
+			kind = FILE_KIND;
+			file_hdr_len = 0;
+		} else if (ops != NULL) {
+			payload = map;
+			len = 0;
+			if (op_idx == nops) {
+				log_msg("Read EOF\n");
+			} else if (ops[op_idx].copy) {
+				copy = &ops[op_idx++];
+			} else {
+				const delta_op_t *op = &ops[op_idx];
+				payload = map + op->offset + op_pos;
+				len = MIN(op->len - op_pos, data_size);
+				op_pos += len;
+				if (op_pos == op->len) {
+					op_idx++;
+					op_pos = 0;
+				}
+			}
+		} else if (rd != NULL) {
+			chunk = reader_peek(rd);
+			if (chunk == NULL) {
+				/* We'll be woken up when there's more */
+				input_stalled = true;
 				break;
+			}
+			if (chunk->len == -1) {
+				errno = chunk->err;
+				exit_perror("read");
+			}
 
-			case PTYPE_NACK:
-				log_msg("Received NACK for #%d\n", pkt_get_seqnum(resp));
-				handle_nack(resp);
+			by_ref = chunk->ref != NULL;
+			payload = by_ref ? chunk->ref : chunk->data;
+			len = chunk->len;
+			zeros = chunk->zeros;
+			if (len == 0 && zeros == 0) {
+				log_msg("Read EOF\n");
+			}
+		} else if (opts.messages) {
+			if (!messages_ready(&len)) {
+				/* Its readability wakes us up */
+				engine_watch(eng, fileno(infile));
+				input_stalled = true;
 				break;
-
-			/* other cases guarded by pkt_decode above */
 			}
+			payload = rbuf + rbuf_pos;
+			rbuf_pos += len;
+			if (len == 0) {
+				log_msg("Read EOF\n");
+			}
+		} else if (map != NULL || manifest != NULL) {
+			size_t run = zero_runs && map != NULL ? zero_run(fileno(infile),
+				map, map_pos, map_end, data_size) : map_pos;
+			zeros = run - map_pos;
+			map_pos = run;
 
-			/* We handled an ACK or a NACK, so resize the sending
-			 * window according to the receiving window so as not to
-			 * overload the receiver. */
-			size_t swin = window_get_max_size(w);
-			size_t rwin = pkt_get_window(resp);
-			size_t new_win_size = MIN(swin, rwin);
-			assert(window_resize(w, new_win_size) == 0);
-			log_msg("New window size: %zu\n", new_win_size);
-		}
+			payload = map + map_pos;
+			len = zeros > 0 ? 0 : MIN(map_end - map_pos, data_size);
+			map_pos += len;
+			if (len == 0 && zeros == 0) {
+				log_msg("Read EOF\n");
+			}
+		} else {
+			size_t left = rbuf_len - rbuf_pos;
+			if (left == 0 || (opts.follow && left < data_size)) {
+				/* Fetch enough data for all the free slots at once,
+				 * after the partial payload held when following */
+				memmove(rbuf, rbuf + rbuf_pos, left);
+				size_t want = window_available(w) * data_size;
+				size_t n = read_input(rbuf + left, want - left);
+				if (n == 0 && !opts.follow) {
+					log_msg("Read EOF\n");
+				}
+				rbuf_len = left + n;
+				rbuf_pos = 0;
+			}
 
-		pkt_del(resp);
+			if (opts.follow && !follow_ready()) {
+				/* inotify or the hold timer wakes us up */
+				input_stalled = true;
+				break;
+			}
 
-		log_msg("Window: [%zu, %zu], buffer: %zu/%zu\n", window_start(w),
-			window_end(w), window_buffer_size(w), window_get_size(w));
-	}
+			size_t run = zero_runs ? zero_run(-1, rbuf, rbuf_pos,
+				rbuf_len, data_size) : rbuf_pos;
+			zeros = run - rbuf_pos;
+			rbuf_pos = run;
 
-	retransmit_packets();
+			payload = rbuf + rbuf_pos;
+			len = zeros > 0 ? 0 : MIN(rbuf_len - rbuf_pos, data_size);
+			rbuf_pos += len;
+		}
 
-	/* If the window isn't full and we still have data to read,
-	 * just keep filling up the buffer */
-	if (!window_full(w) && !sent_eof) {
-		char buf[MAX_PAYLOAD_SIZE] = {0};
-		size_t len = fread(buf, sizeof (*buf), MAX_PAYLOAD_SIZE, infile);
+		/* The end of a file of a directory isn't the end of the data */
+		if (manifest != NULL && len == 0 && zeros == 0 && next_entry()) {
+			continue;
+		}
 
-		if (len < MAX_PAYLOAD_SIZE) { /* either error or EOF */
-			if (ferror(infile)) {
-				exit_msg("Error reading from file\n");
-			}
-			log_msg("Read EOF\n");
+		if (zeros > 0) {
+			zeros_be = htobe64(zeros);
+			payload = (const char *) &zeros_be;
+			len = sizeof (zeros_be);
+			by_ref = false;
+			kind = ZERO_KIND;
+			zeros_elided += zeros;
+		} else if (copy != NULL) {
+			copy_be[0] = htobe64(copy->offset);
+			copy_be[1] = htobe64(copy->len);
+			payload = (const char *) copy_be;
+			len = sizeof (copy_be);
+			by_ref = false;
+			kind = COPY_KIND;
+			copied += copy->len;
 		}
 
 		pkt_t *pkt = pkt_new();
@@ -238,18 +1669,28 @@ void main_loop(void) {
 		pkt_status_code err = PKT_OK;
 		err = err || pkt_set_type(pkt, PTYPE_DATA);
 		err = err || pkt_set_seqnum(pkt, next);
-		/* The sender has no receiving window */
-		err = err || pkt_set_window(pkt, 0);
-		err = err || pkt_set_timestamp(pkt, get_monotime() + TIMER);
-		err = err || pkt_set_payload(pkt, buf, len);
+		/* The sender has no receiving window, the field tells what the
+		 * payload is */
+		err = err || pkt_set_window(pkt, kind);
+		err = err || pkt_set_timestamp(pkt, get_monotime());
+		if (by_ref) {
+			err = err || pkt_set_payload_ref(pkt, payload, len);
+		} else {
+			err = err || pkt_set_payload(pkt, payload, len);
+		}
+		if (chunk != NULL) {
+			/* Computed by the reader thread already */
+			if (chunk->len > 0) {
+				err = err || pkt_set_crc2(pkt, chunk->crc2);
+			}
+			reader_release(rd);
+		}
 
 		if (err != PKT_OK) {
 			exit_msg("Could not create packet: %d\n", err);
 		}
 
-		if (send_packet(sockfd, pkt) == -1) {
-			exit_perror("send");
-		}
+		send_data(pkt);
 
 		/* Packet is in-flight and non-acknowledged,
 		 * hence add it to the buffer */
@@ -257,7 +1698,11 @@ void main_loop(void) {
 			exit_msg("Could not add packet to buffer\n");
 		}
 
+		deadlines[pkt_get_seqnum(pkt)] = get_monotime() + opts.lifetime;
 		next = (next + 1) % 256;
+		if (streaming()) {
+			keepalive_deadline = get_monotime() + KEEPALIVE;
+		}
 
 		log_msg("> %s\n", pkt_repr(pkt));
 		log_msg("Added packet #%d to buffer\n", pkt_get_seqnum(pkt));
@@ -269,30 +1714,234 @@ void main_loop(void) {
 	}
 }
 
-int main(int argc, char **argv) {
-	parse_args(argc, argv, &hostname, &port, &filename);
+/**
+ * Receives and handles one ACK, NACK or batch of signatures. Exits on error.
+ */
+void receive_response(void) {
+	char buf[MAX_PACKET_SIZE];
+	int len = engine_recv(eng, buf, MAX_PACKET_SIZE);
+	if (len == -1) {
+		exit_perror("recv");
+	}
 
-	/* Initial window assumed to be 1, will be updated on ACKs */
-	w = window_create(1, MAX_WINDOW_SIZE, 255);
-	if (w == NULL) {
-		exit_msg("Could not create window\n");
+	pkt_t *resp = pkt_new();
+	if (resp == NULL) {
+		exit_msg("Could not allocate packet\n");
+	}
+
+	pkt_status_code err = pkt_decode(buf, len, resp);
+
+	if (err != PKT_OK) {
+		log_msg("Error decoding packet (%s), ignoring\n",
+			pkt_code_to_str(err));
+	} else {
+		log_msg("< %s\n", pkt_repr(resp));
+
+		/* Data sent back comes with an ACK, handled as if it came alone */
+		bool fresh = true; /* whether its timestamp measures an RTT */
+		if (duplex && pkt_get_type(resp) == PTYPE_DATA &&
+		    pkt_get_window(resp) != SIG_KIND && !pkt_get_tr(resp)) {
+			pkt_t *ack = pkt_new();
+			if (ack == NULL) {
+				exit_msg("Could not allocate packet\n");
+			}
+			int taken = piggyback_take(resp, ack);
+			if (taken == -1) {
+				log_msg("Data sent back without an ACK, ignoring\n");
+				pkt_del(ack);
+				pkt_del(resp);
+				return;
+			}
+			handle_back_data(resp);
+			resp = ack;
+			fresh = taken;
+		}
+
+		switch (pkt_get_type(resp)) {
+		case PTYPE_DATA:
+			if (pkt_get_window(resp) == SIG_KIND) {
+				handle_signatures(resp);
+			} else {
+				log_msg("Received DATA packet, ignoring\n");
+			}
+			pkt_del(resp);
+			return;
+
+		case PTYPE_ACK:
+			/* The answer to our setup has the longest payload */
+			if (pkt_get_length(resp) >= SETUP_SIZE) {
+				log_msg("Received setup answer\n");
+				handle_setup_answer(resp);
+				break;
+			}
+			log_msg("Received ACK for #%d\n", pkt_get_seqnum(resp) - 1);
+			if (ecn && pkt_get_length(resp) == ECN_ECHO_SIZE) {
+				handle_ecn_echo(resp);
+				grow_cwnd();
+			}
+			handle_ack(resp);
+			break;
+
+		case PTYPE_NACK:
+			log_msg("Received NACK for #%d\n", pkt_get_seqnum(resp));
+			handle_nack(resp);
+			/* Its timestamp isn't ours (the receiver leaves it at 0) */
+			fresh = false;
+			break;
+
+		/* other cases guarded by pkt_decode above */
+		}
+
+		if (fresh) {
+			sample_rtt(pkt_get_timestamp(resp));
+		}
+
+		/* We handled an ACK or a NACK, so resize the sending
+		 * window according to the receiving window so as not to
+		 * overload the receiver, nor the path if it is congested. */
+		size_t swin = window_get_max_size(w);
+		size_t rwin = pkt_get_window(resp);
+		last_rwin = rwin;
+		size_t new_win_size = MIN(MIN(swin, rwin), cwnd);
+		assert(window_resize(w, new_win_size) == 0);
+		log_msg("New window size: %zu\n", new_win_size);
+	}
+
+	pkt_del(resp);
+
+	log_msg("Window: [%zu, %zu], buffer: %zu/%zu\n", window_start(w),
+		window_end(w), window_buffer_size(w), window_get_size(w));
+}
+
+/**
+ * Called inside a loop that terminates on (!sent_eof || !window_empty(w) ||
+ * receiving_back()).
+ * Exits on error.
+ */
+void main_loop(void) {
+	int ready;
+
+	if (!sent_eof && window_buffer_size(w) == 0 && window_get_size(w) == 0) {
+		/* The receiver has no room. Nothing in flight means no timer, so
+		 * if the ACK opening its window again was lost, we'd wait forever:
+		 * probe its window, less and less often. */
+		uint32_t now = get_monotime();
+		if (persist_backoff == 0) {
+			persist_backoff = PERSIST_MIN;
+			persist_deadline = now + persist_backoff;
+		} else if (!time_before(now, persist_deadline)) {
+			send_window_probe();
+			persist_backoff = MIN(2 * persist_backoff, PERSIST_MAX);
+			persist_deadline = now + persist_backoff;
+		}
+
+		log_msg("---------- Zero window, probing in %.3fs...\n",
+			(double) (persist_deadline - now) / 1000000);
+		log_msg("Window: [%zu, %zu], buffer: %zu/%zu\n", window_start(w),
+			window_end(w), window_buffer_size(w), window_get_size(w));
+
+		ready = engine_wait(eng, persist_deadline - now);
+	} else {
+		persist_backoff = 0;
+
+		/* Timeout will be zero unless the buffer is full, EOF was sent
+		 * or we're waiting for the reader */
+		int64_t timeout_us = get_timeout();
+
+		if (timeout_us < 0) {
+			log_msg("---------- Waiting indefinitely...\n");
+		} else {
+			log_msg("---------- Waiting for %.3fs...\n", (double) timeout_us / 1000000);
+		}
+		log_msg("Window: [%zu, %zu], buffer: %zu/%zu\n", window_start(w),
+			window_end(w), window_buffer_size(w), window_get_size(w));
+
+		/* Wait until either we receive data on the socket
+		* or the timeout expires */
+		ready = engine_wait(eng, timeout_us);
+	}
+
+	if (ready == -1) {
+		exit_perror("select");
+	}
+
+	/* Received ACKs or NACKs. Handle all those the engine already has
+	 * before sending, so that the window opens by as many slots as
+	 * possible and the new packets go out in a single batch. */
+	if (ready) {
+		do {
+			receive_response();
+		} while (engine_pending(eng) > 0);
+	}
+
+	skip_expired();
+	retransmit_packets();
+	request_signatures();
+
+	if (nbuckets > 0 && bucket_clock() - report_time >= RATE_REPORT) {
+		report_rate();
+	}
+
+	/* Let the receiver (and anything on the path keeping state) know we're
+	 * still there while the input doesn't grow */
+	if (streaming() && !time_before(get_monotime(), keepalive_deadline)) {
+		send_window_probe();
+		keepalive_deadline = get_monotime() + KEEPALIVE;
+	}
+
+	/* If the window isn't full and we still have data to read,
+	 * just keep filling up the buffer */
+	send_new_packets();
+
+	/* None of it could carry the ACK of the data sent back */
+	if (back_ack_pending) {
+		send_back_ack();
 	}
+}
+
+int main(int argc, char **argv) {
+	parse_args(argc, argv, &hostname, &port, &filename, &opts);
 
 	struct sockaddr_in6 dst_addr;
 	const char *err = real_address(hostname, &dst_addr);
 	if (err != NULL) {
 		exit_msg("real_address: %s\n", err);
 	}
+	dst = dst_addr.sin6_addr;
 
-	/* Connect the socket. This tells the socket both to send to this
-	 * address by default and to only receive from this address. */
-	sockfd = create_socket(NULL, -1, &dst_addr, port);
-	if (sockfd == -1) {
-		exit_msg("Could not create socket\n");
+	unsigned initial_window = opts.initial_window;
+	if (opts.cache != NULL) {
+		unsigned cached = load_metrics();
+		if (initial_window == 0) {
+			initial_window = cached;
+		}
+	} else if (initial_window == 0) {
+		initial_window = INITIAL_WINDOW;
+	}
+
+	/* Start sending at the initial window right away, it will be updated
+	 * by the setup answer and ACKs */
+	w = window_create(initial_window, MAX_WINDOW_SIZE, 255);
+	if (w == NULL) {
+		exit_msg("Could not create window\n");
+	}
+
+	if (opts.back_output != NULL) {
+		backfile = fopen(opts.back_output, "wb");
+		if (backfile == NULL) {
+			exit_perror("fopen");
+		}
+		back_w = window_create(MAX_WINDOW_SIZE, MAX_WINDOW_SIZE, 255);
+		if (back_w == NULL) {
+			exit_msg("Could not create window\n");
+		}
 	}
 
+	struct stat st;
 	if (filename == NULL) {
 		infile = stdin;
+	} else if (stat(filename, &st) == 0 && S_ISDIR(st.st_mode)) {
+		scan_input_dir();
 	} else {
 		infile = fopen(filename, "rb");
 		if (infile == NULL) {
@@ -300,18 +1949,101 @@ int main(int argc, char **argv) {
 		}
 	}
 
+	/* A followed input grows past any mapping, messages come as they're
+	 * written */
+	if (manifest == NULL && !opts.follow && !opts.messages) {
+		map_input();
+	}
+
+	/* Before forking, for the stripes to share the bucket of the transfer */
+	open_buckets();
+
+	if (opts.stripes > 0) {
+		fork_stripes();
+	}
+
+	/* Connect the socket. This tells the socket both to send to this
+	 * address by default and to only receive from this address. */
+	sockfd = create_socket(NULL, -1, &dst_addr, port);
+	if (sockfd == -1) {
+		exit_msg("Could not create socket\n");
+	}
+	ecn_capable = set_ecn(sockfd, ECN_ECT0) == 0;
+
+	eng = engine_create(opts.engine, sockfd, infile);
+	if (eng == NULL) {
+		exit_msg("Could not create I/O engine\n");
+	}
+	log_msg("Using %s I/O engine\n", engine_name(engine_get_type(eng)));
+
+	if (opts.follow) {
+		start_following();
+	}
+	if (opts.messages) {
+		start_messages();
+	}
+
+	/* A striping receiver only hands the flow over to its own worker when
+	 * answering the setup, when resuming, the answer tells where to start,
+	 * a delta needs the size of the basis, a directory needs a receiver
+	 * that takes one, and whether ACKs ride on data must be settled: don't
+	 * send data before (nor before a file is accepted, see send_setup) */
+	setup_wait = opts.stripes > 0 || opts.resume || opts.delta || manifest != NULL ||
+		opts.back_output != NULL;
+	start_time = report_time = bucket_clock();
+	send_setup();
+
 	/* If we haven't sent the EOF packet, we still have data to read.
 	 * If the window isn't empty, there are still unacknowledged packets
-	 * that we'll potentially have to resend. */
-	while (!sent_eof || !window_empty(w)) {
+	 * that we'll potentially have to resend. Then the receiver may still
+	 * be sending data back. */
+	while (!sent_eof || !window_empty(w) || receiving_back()) {
 		/* This is probably the line you're looking for */
 		main_loop();
 	}
 
 	log_msg("EOF acknowledged, quitting\n");
+	if (zeros_elided > 0) {
+		log_msg("Sent %llu bytes of zeros as runs\n", (unsigned long long) zeros_elided);
+	}
+	if (copied > 0) {
+		log_msg("Sent %llu bytes as copies of the basis\n", (unsigned long long) copied);
+	}
+	if (bytes_skipped > 0) {
+		log_msg("Gave up on %llu bytes that expired\n", (unsigned long long) bytes_skipped);
+	}
+	if (duplex) {
+		log_msg("Received %llu bytes sent back\n", (unsigned long long) back_bytes);
+	}
 
+	if (rd != NULL) {
+		reader_stop(rd);
+	}
+	engine_free(eng);
+	log_cpu_usage(packets_sent);
+	log_rate(bytes_sent, (double) (bucket_clock() - start_time) / 1000000);
+	if (opts.cache != NULL) {
+		store_metrics();
+	}
+	for (size_t i = 0; i < nbuckets; i++) {
+		bucket_close(buckets[i]);
+	}
+	pkt_del(setup_pkt);
+	free(ops);
 	window_free(w);
-	fclose(infile);
+	if (map != NULL) {
+		munmap((void *) map, map_len);
+	}
+	if (infile != NULL) {
+		fclose(infile);
+	}
+	if (manifest != NULL) {
+		manifest_free(manifest);
+	}
+	if (backfile != NULL) {
+		fclose(backfile);
+		window_free(back_w);
+	}
 
 	return 0;
 }
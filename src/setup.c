@@ -0,0 +1,131 @@
+#include <endian.h>
+#include <netinet/in.h>
+#include <string.h>
+
+#include "packet_interface.h"
+#include "setup.h"
+
+void setup_init(setup_t *s, uint8_t window) {
+	memset(s, 0, sizeof (*s));
+	s->version = SETUP_VERSION;
+	s->checksum = SETUP_CSUM_CRC32;
+	s->window = window;
+	s->payload_size = MAX_PAYLOAD_SIZE;
+	s->extensions = SETUP_EXT_ZEROS; // the others depend on options
+}
+
+/*
+ * Layout (big-endian):
+ * 0: version, 1: checksum, 2: window, 3: refusal,
+ * 4: payload_size (16 bits), 6: reserved (16 bits), 8: extensions (32 bits),
+ * 12: resume_crc (32 bits), 16: resume_offset (64 bits),
+ * 24: basis_size (64 bits)
+ * With SETUP_EXT_METADATA, followed by:
+ * 32: file_size (64 bits), 40: file_mtime (64 bits), 48: file_mode (32 bits),
+ * 52: file_name (the rest)
+ */
+size_t setup_encode(const setup_t *s, char *buf) {
+	memset(buf, 0, SETUP_SIZE);
+	buf[0] = s->version;
+	buf[1] = s->checksum;
+	buf[2] = s->window;
+	buf[3] = s->refusal;
+
+	uint16_t payload_size = htons(s->payload_size);
+	memcpy(buf + 4, &payload_size, sizeof (payload_size));
+	uint32_t extensions = htonl(s->extensions);
+	memcpy(buf + 8, &extensions, sizeof (extensions));
+	uint32_t resume_crc = htonl(s->resume_crc);
+	memcpy(buf + 12, &resume_crc, sizeof (resume_crc));
+	uint64_t resume_offset = htobe64(s->resume_offset);
+	memcpy(buf + 16, &resume_offset, sizeof (resume_offset));
+	uint64_t basis_size = htobe64(s->basis_size);
+	memcpy(buf + 24, &basis_size, sizeof (basis_size));
+
+	if (!(s->extensions & SETUP_EXT_METADATA)) {
+		return SETUP_SIZE;
+	}
+	uint64_t file_size = htobe64(s->file_size);
+	memcpy(buf + 32, &file_size, sizeof (file_size));
+	uint64_t file_mtime = htobe64(s->file_mtime);
+	memcpy(buf + 40, &file_mtime, sizeof (file_mtime));
+	uint32_t file_mode = htonl(s->file_mode);
+	memcpy(buf + 48, &file_mode, sizeof (file_mode));
+	size_t name_len = strnlen(s->file_name, SETUP_NAME_MAX);
+	memcpy(buf + SETUP_SIZE + SETUP_META_SIZE, s->file_name, name_len);
+	return SETUP_SIZE + SETUP_META_SIZE + name_len;
+}
+
+int setup_decode(const char *buf, size_t len, setup_t *s) {
+	/* Later versions may append fields */
+	if (len < SETUP_SIZE) {
+		return -1;
+	}
+
+	s->version = buf[0];
+	s->checksum = buf[1];
+	s->window = buf[2];
+	s->refusal = buf[3];
+
+	uint16_t payload_size;
+	memcpy(&payload_size, buf + 4, sizeof (payload_size));
+	s->payload_size = ntohs(payload_size);
+	uint32_t extensions;
+	memcpy(&extensions, buf + 8, sizeof (extensions));
+	s->extensions = ntohl(extensions);
+	uint32_t resume_crc;
+	memcpy(&resume_crc, buf + 12, sizeof (resume_crc));
+	s->resume_crc = ntohl(resume_crc);
+	uint64_t resume_offset;
+	memcpy(&resume_offset, buf + 16, sizeof (resume_offset));
+	s->resume_offset = be64toh(resume_offset);
+	uint64_t basis_size;
+	memcpy(&basis_size, buf + 24, sizeof (basis_size));
+	s->basis_size = be64toh(basis_size);
+
+	s->file_size = 0;
+	s->file_mtime = 0;
+	s->file_mode = 0;
+	s->file_name[0] = '\0';
+	if (!(s->extensions & SETUP_EXT_METADATA)) {
+		return 0;
+	}
+	size_t name_len = len - SETUP_SIZE - SETUP_META_SIZE;
+	if (len < SETUP_SIZE + SETUP_META_SIZE || name_len > SETUP_NAME_MAX) {
+		return -1;
+	}
+	uint64_t file_size;
+	memcpy(&file_size, buf + 32, sizeof (file_size));
+	s->file_size = be64toh(file_size);
+	uint64_t file_mtime;
+	memcpy(&file_mtime, buf + 40, sizeof (file_mtime));
+	s->file_mtime = be64toh(file_mtime);
+	uint32_t file_mode;
+	memcpy(&file_mode, buf + 48, sizeof (file_mode));
+	s->file_mode = ntohl(file_mode);
+	memcpy(s->file_name, buf + SETUP_SIZE + SETUP_META_SIZE, name_len);
+	s->file_name[name_len] = '\0';
+	return 0;
+}
+
+int setup_negotiate(const setup_t *local, const setup_t *remote, setup_t *agreed) {
+	if (local->version != remote->version || local->checksum != remote->checksum) {
+		return -1;
+	}
+
+	agreed->version = local->version;
+	agreed->checksum = local->checksum;
+	agreed->window = local->window < remote->window ? local->window : remote->window;
+	agreed->payload_size = local->payload_size < remote->payload_size
+		? local->payload_size : remote->payload_size;
+	agreed->extensions = local->extensions & remote->extensions;
+	agreed->resume_offset = local->resume_offset;
+	agreed->resume_crc = local->resume_crc;
+	agreed->basis_size = local->basis_size;
+	agreed->refusal = 0;
+	agreed->file_size = remote->file_size;
+	agreed->file_mtime = remote->file_mtime;
+	agreed->file_mode = remote->file_mode;
+	memcpy(agreed->file_name, remote->file_name, sizeof (agreed->file_name));
+	return 0;
+}
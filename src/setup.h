@@ -0,0 +1,120 @@
+#ifndef __SETUP_H_
+#define __SETUP_H_
+
+
+/**
+ * Setup exchange opening a transfer. The sender's first packet is a DATA
+ * packet whose window field is SETUP_KIND (it's 0 otherwise), outside of the
+ * sequence numbers, carrying the settings it proposes. The receiver answers
+ * with an ACK carrying the settings both agree on (normal ACKs have no
+ * payload, unless an extension gives them one that is shorter). Data doesn't need to wait for the answer unless an extension
+ * requires it.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SETUP_KIND 1 /* window field of a DATA packet carrying a setup */
+#define ZERO_KIND 2 /* window field of a DATA packet standing for a run of
+                       zeros, whose length is its payload (big-endian u64) */
+#define SIG_KIND 3 /* window field of a DATA packet outside of the sequence
+                      numbers, asking for a batch of signatures (see delta.h)
+                      or, from the receiver, carrying it */
+#define COPY_KIND 4 /* window field of a DATA packet standing for data of the
+                       basis: its offset and length (big-endian u64s) */
+#define FILE_KIND 5 /* window field of a DATA packet starting the next file
+                       of a directory, its payload is the header of the file
+                       (see manifest.h) */
+#define SKIP_KIND 6 /* window field of a DATA packet replacing one whose data
+                       expired, to be skipped: its payload is the length of
+                       that data (big-endian u64) */
+#define SETUP_VERSION 1
+#define SETUP_SIZE 32 /* encoded size, before the metadata */
+#define SETUP_META_SIZE 20 /* encoded size of the metadata, before the name */
+#define SETUP_NAME_MAX 255 /* longest name of the file */
+#define SETUP_MAX_SIZE (SETUP_SIZE + SETUP_META_SIZE + SETUP_NAME_MAX)
+
+/* Checksum modes */
+#define SETUP_CSUM_CRC32 1 /* CRC32 of the header and the payload */
+
+/* Extensions */
+#define SETUP_EXT_RESUME (1 << 0) /* receiver tells where to resume */
+#define SETUP_EXT_ZEROS (1 << 1) /* runs of zeros may be sent as ZERO_KIND */
+#define SETUP_EXT_DELTA (1 << 2) /* data may be sent as a delta against the
+                                    receiver's copy of the file */
+#define SETUP_EXT_MANIFEST (1 << 3) /* data may be a directory, whose files
+                                       start with FILE_KIND packets */
+#define SETUP_EXT_ECN (1 << 4) /* data is sent ECN-capable, and ACKs carry
+                                  the count of those marked CE */
+#define SETUP_EXT_MESSAGES (1 << 5) /* payloads are made of whole messages
+                                       (see message.h), delivered at once */
+#define SETUP_EXT_SKIP (1 << 6) /* data may be replaced by SKIP_KIND packets */
+#define SETUP_EXT_DUPLEX (1 << 7) /* the receiver sends data back, ACKs ride
+                                     on data (see duplex.h) */
+#define SETUP_EXT_PLACED (1 << 8) /* every payload of data is full but the
+                                     last, so where one goes in the file
+                                     follows from its sequence number */
+#define SETUP_EXT_METADATA (1 << 9) /* the sender tells what file it sends,
+                                       which the receiver checks it has room
+                                       for before any data */
+
+/* Reasons for the receiver to refuse a transfer */
+#define SETUP_REFUSE_SPACE 1 /* not enough free space for the file */
+
+#define ECN_ECHO_SIZE 4 /* payload of an ACK with SETUP_EXT_ECN: the number of
+                           DATA packets received marked CE (big-endian u32,
+                           wrapping) */
+
+typedef struct setup {
+	uint8_t version; /* must be the same on both ends */
+	uint8_t checksum; /* must be the same on both ends */
+	uint8_t window; /* largest window */
+	uint16_t payload_size; /* largest payload */
+	uint32_t extensions; /* bitmask of the optional features supported */
+	uint8_t refusal; /* in the receiver's answer, why it refuses the transfer
+	                    (SETUP_REFUSE_*), 0 if it doesn't */
+	/* SETUP_EXT_RESUME, in the receiver's answer: data the receiver
+	 * already has, and its CRC32 */
+	uint64_t resume_offset;
+	uint32_t resume_crc;
+	/* SETUP_EXT_DELTA, in the receiver's answer: size of its copy */
+	uint64_t basis_size;
+	/* SETUP_EXT_METADATA, in the sender's proposal (echoed by the answer):
+	 * the file sent */
+	uint64_t file_size;
+	int64_t file_mtime; /* in nanoseconds since the epoch */
+	uint32_t file_mode; /* permission bits */
+	char file_name[SETUP_NAME_MAX + 1]; /* without its directory,
+	                                       NUL-terminated */
+} setup_t;
+
+/**
+ * Fills s with the settings of this implementation, proposing the window.
+ */
+void setup_init(setup_t *s, uint8_t window);
+
+/**
+ * Encodes s in buf, which must be at least SETUP_MAX_SIZE bytes long.
+ * Returns the encoded length.
+ */
+size_t setup_encode(const setup_t *s, char *buf);
+
+/**
+ * Decodes the settings in the len bytes at buf.
+ * Returns -1 if they're too short, or the name of the file too long, and 0
+ * otherwise.
+ */
+int setup_decode(const char *buf, size_t len, setup_t *s);
+
+/**
+ * Computes the settings both ends agree on: the smallest window and payload
+ * size, and the extensions both support. The resume point and basis size
+ * are the local ones, so that the receiver's answer carries its own, while the
+ * metadata is the remote one, as the answer echoes the sender's.
+ * Returns -1 if the ends can't talk to each other (different versions or
+ * checksum modes), and 0 otherwise.
+ */
+int setup_negotiate(const setup_t *local, const setup_t *remote, setup_t *agreed);
+
+
+#endif  /* __SETUP_H_ */
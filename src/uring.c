@@ -0,0 +1,230 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+struct uring {
+	int fd;
+
+	// Submission queue
+	void *sq_ptr;
+	size_t sq_len;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	struct io_uring_sqe *sqes;
+	size_t sqes_len;
+	unsigned sqe_tail; // tail including the entries not submitted yet
+
+	// Completion queue
+	void *cq_ptr;
+	size_t cq_len;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+};
+
+uring_t *uring_create(unsigned entries) {
+	struct io_uring_params p;
+	memset(&p, 0, sizeof (p));
+
+	uring_t *r = calloc(1, sizeof (uring_t));
+	if (r == NULL) {
+		return NULL;
+	}
+
+	r->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (r->fd == -1) {
+		free(r);
+		return NULL;
+	}
+
+	/* We need to be able to wait for a completion with a timeout */
+	if (!(p.features & IORING_FEAT_EXT_ARG)) {
+		close(r->fd);
+		free(r);
+		errno = ENOSYS;
+		return NULL;
+	}
+
+	r->sq_len = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+	r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		/* Both rings share the same mapping */
+		if (r->cq_len > r->sq_len) {
+			r->sq_len = r->cq_len;
+		}
+		r->cq_len = r->sq_len;
+	}
+
+	r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_ptr == MAP_FAILED) {
+		goto fail_fd;
+	}
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		r->cq_ptr = r->sq_ptr;
+	} else {
+		r->cq_ptr = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+		if (r->cq_ptr == MAP_FAILED) {
+			goto fail_sq;
+		}
+	}
+
+	r->sqes_len = p.sq_entries * sizeof (struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED) {
+		goto fail_cq;
+	}
+
+	char *sq = r->sq_ptr;
+	r->sq_head = (unsigned *) (sq + p.sq_off.head);
+	r->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+	r->sq_mask = *(unsigned *) (sq + p.sq_off.ring_mask);
+	r->sq_entries = p.sq_entries;
+	r->sqe_tail = *r->sq_tail;
+
+	/* We always submit entries in order, so the indirection array can
+	 * simply map each slot to the entry with the same index. */
+	unsigned *array = (unsigned *) (sq + p.sq_off.array);
+	for (unsigned i = 0; i < p.sq_entries; i++) {
+		array[i] = i;
+	}
+
+	char *cq = r->cq_ptr;
+	r->cq_head = (unsigned *) (cq + p.cq_off.head);
+	r->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+	r->cq_mask = *(unsigned *) (cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+	return r;
+
+fail_cq:
+	if (r->cq_ptr != r->sq_ptr) {
+		munmap(r->cq_ptr, r->cq_len);
+	}
+fail_sq:
+	munmap(r->sq_ptr, r->sq_len);
+fail_fd:
+	close(r->fd);
+	free(r);
+	return NULL;
+}
+
+void uring_free(uring_t *r) {
+	munmap(r->sqes, r->sqes_len);
+	if (r->cq_ptr != r->sq_ptr) {
+		munmap(r->cq_ptr, r->cq_len);
+	}
+	munmap(r->sq_ptr, r->sq_len);
+	close(r->fd);
+	free(r);
+}
+
+int uring_register_buffers(uring_t *r, const struct iovec *iov, unsigned n) {
+	if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS, iov, n) == -1) {
+		return -1;
+	}
+	return 0;
+}
+
+int uring_register_files(uring_t *r, const int *fds, unsigned n) {
+	if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_FILES, fds, n) == -1) {
+		return -1;
+	}
+	return 0;
+}
+
+int uring_update_file(uring_t *r, unsigned index, int fd) {
+	struct io_uring_files_update up;
+	memset(&up, 0, sizeof (up));
+	up.offset = index;
+	up.fds = (uint64_t) (uintptr_t) &fd;
+	if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_FILES_UPDATE, &up, 1) == -1) {
+		return -1;
+	}
+	return 0;
+}
+
+struct io_uring_sqe *uring_get_sqe(uring_t *r) {
+	unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+	if (r->sqe_tail - head >= r->sq_entries) {
+		return NULL;
+	}
+
+	struct io_uring_sqe *sqe = &r->sqes[r->sqe_tail & r->sq_mask];
+	memset(sqe, 0, sizeof (*sqe));
+	r->sqe_tail++;
+	return sqe;
+}
+
+unsigned uring_pending(uring_t *r) {
+	return r->sqe_tail - *r->sq_tail;
+}
+
+int uring_submit(uring_t *r, unsigned wait_nr, int64_t timeout_us) {
+	unsigned to_submit = uring_pending(r);
+
+	/* Publish the new entries to the kernel */
+	__atomic_store_n(r->sq_tail, r->sqe_tail, __ATOMIC_RELEASE);
+
+	if (to_submit == 0 && wait_nr == 0) {
+		return 0;
+	}
+
+	unsigned flags = 0;
+	if (wait_nr > 0) {
+		flags |= IORING_ENTER_GETEVENTS;
+	}
+
+	struct __kernel_timespec ts;
+	struct io_uring_getevents_arg arg;
+	memset(&arg, 0, sizeof (arg));
+	if (wait_nr > 0 && timeout_us >= 0) {
+		ts.tv_sec = timeout_us / 1000000;
+		ts.tv_nsec = (timeout_us % 1000000) * 1000;
+		arg.ts = (uint64_t) (uintptr_t) &ts;
+	}
+	flags |= IORING_ENTER_EXT_ARG;
+
+	while (true) {
+		long ret = syscall(__NR_io_uring_enter, r->fd, to_submit, wait_nr,
+			flags, &arg, sizeof (arg));
+		if (ret >= 0) {
+			to_submit -= ret;
+			if (to_submit == 0) {
+				return 0;
+			}
+			/* The kernel didn't consume everything, try again */
+			continue;
+		}
+		if (errno == ETIME) {
+			return 0;
+		}
+		if (errno != EINTR) {
+			return -1;
+		}
+	}
+}
+
+int uring_pop_cqe(uring_t *r, struct io_uring_cqe *cqe) {
+	unsigned head = *r->cq_head;
+	unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+	if (head == tail) {
+		return -1;
+	}
+
+	*cqe = r->cqes[head & r->cq_mask];
+	__atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+	return 0;
+}
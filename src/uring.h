@@ -0,0 +1,74 @@
+#ifndef __URING_H_
+#define __URING_H_
+
+
+/**
+ * Minimal io_uring wrapper talking to the kernel through the raw system calls
+ * (we don't depend on liburing). Only what the I/O engine needs is provided.
+ */
+
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+typedef struct uring uring_t;
+
+/**
+ * Sets up a ring with the specified number of submission entries.
+ * Returns NULL on error (e.g. ENOSYS if the kernel has no io_uring support,
+ * or if it doesn't support waiting with a timeout), with errno set.
+ */
+uring_t *uring_create(unsigned entries);
+
+/**
+ * Unmaps the ring and closes its file descriptor.
+ */
+void uring_free(uring_t *r);
+
+/**
+ * Registers buffers to be used with IORING_OP_READ_FIXED/WRITE_FIXED.
+ * Returns -1 on error, and 0 otherwise.
+ */
+int uring_register_buffers(uring_t *r, const struct iovec *iov, unsigned n);
+
+/**
+ * Registers file descriptors to be used with IOSQE_FIXED_FILE.
+ * Returns -1 on error, and 0 otherwise.
+ */
+int uring_register_files(uring_t *r, const int *fds, unsigned n);
+
+/**
+ * Replaces the registered file descriptor at index by fd (-1 to leave the slot
+ * empty).
+ * Returns -1 on error, and 0 otherwise.
+ */
+int uring_update_file(uring_t *r, unsigned index, int fd);
+
+/**
+ * Returns a zeroed submission entry, or NULL if the submission queue is full.
+ * The entry is handed over to the kernel on the next call to uring_submit.
+ */
+struct io_uring_sqe *uring_get_sqe(uring_t *r);
+
+/**
+ * Returns the number of entries obtained with uring_get_sqe and not yet
+ * submitted.
+ */
+unsigned uring_pending(uring_t *r);
+
+/**
+ * Submits the pending entries and waits until at least wait_nr completions
+ * are available, in a single system call. If timeout_us is >= 0, gives up
+ * waiting after that many microseconds.
+ * Returns -1 on error, and 0 otherwise (including on timeout).
+ */
+int uring_submit(uring_t *r, unsigned wait_nr, int64_t timeout_us);
+
+/**
+ * Copies the oldest completion into cqe and consumes it.
+ * Returns -1 if there is no completion available, and 0 otherwise.
+ */
+int uring_pop_cqe(uring_t *r, struct io_uring_cqe *cqe);
+
+
+#endif  /* __URING_H_ */
@@ -1,17 +1,22 @@
 #include <errno.h>
 #include <getopt.h>
 #include <netdb.h>
+#include <netinet/udp.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
 #include <sys/time.h>
 #include <time.h>
 
+#include "bucket.h"
 #include "packet_interface.h"
+#include "util.h"
 
 char pkt_fmt_buf[1024];
+bool log_quiet; /* whether log_msg is silenced (-q) */
 
 void print_time(void) {
 	struct timespec tp;
@@ -23,6 +28,9 @@ void print_time(void) {
 }
 
 void log_msg(const char *fmt, ...) {
+	if (log_quiet) {
+		return;
+	}
 	print_time();
 	va_list args;
 	va_start(args, fmt);
@@ -35,6 +43,29 @@ void log_perror(const char *s) {
 	perror(s);
 }
 
+void log_cpu_usage(size_t packets) {
+	struct rusage ru;
+	if (getrusage(RUSAGE_SELF, &ru) == -1) {
+		return;
+	}
+
+	double user = ru.ru_utime.tv_sec + ((double) ru.ru_utime.tv_usec) / 1000000;
+	double sys = ru.ru_stime.tv_sec + ((double) ru.ru_stime.tv_usec) / 1000000;
+	double per_pkt = packets > 0 ? (user + sys) * 1000000 / packets : 0;
+
+	print_time();
+	fprintf(stderr, "CPU: %.3fs user, %.3fs system, %zu packets, %.2fus/packet\n",
+		user, sys, packets, per_pkt);
+}
+
+void log_rate(uint64_t bytes, double secs) {
+	double mbits = secs > 0 ? bytes * 8 / secs / 1000000 : 0;
+
+	print_time();
+	fprintf(stderr, "Rate: %llu bytes in %.3fs, %.3f Mbit/s\n",
+		(unsigned long long) bytes, secs, mbits);
+}
+
 void exit_msg(const char *fmt, ...) {
 	print_time();
 	va_list args;
@@ -51,7 +82,7 @@ void exit_perror(const char *s) {
 }
 
 void exit_usage(char **argv) {
-	fprintf(stderr, "Usage: %s <hostname> <port> [-f FILE]\n", argv[0]);
+	fprintf(stderr, "Usage: %s <hostname> <port> [-f FILE] [-b RATE] [-B RATE] [-c CACHE] [-d] [-D] [-e posix|gso|uring] [-i FILE] [-l LIFETIME_MS] [-m LATENCY_MS] [-n STRIPES] [-o FILE] [-p] [-q] [-r] [-s SESSIONS] [-t LATENCY_MS] [-w WINDOW] [-y SYNC_MB]\n", argv[0]);
 	exit(2);
 }
 
@@ -79,13 +110,117 @@ char *pkt_repr(pkt_t *pkt) {
 }
 
 void parse_args(int argc, char **argv,
-                char **hostname, uint16_t *port, char **filename) {
+                char **hostname, uint16_t *port, char **filename,
+                options_t *opts) {
 	int c;
-	while ((c = getopt(argc, argv, "f:h")) != -1) {
+	int ms; /* a duration in milliseconds */
+	int mb; /* a size in megabytes */
+	while ((c = getopt(argc, argv, "b:B:c:f:dDe:i:l:m:n:o:pqrs:t:w:y:h")) != -1) {
 		switch (c) {
+		case 'b':
+		case 'B':
+			if (bucket_parse_rate(optarg, c == 'b' ? &opts->rate : &opts->host_rate) == -1) {
+				fprintf(stderr, "%s: rate must be in bits per second, with an "
+					"optional k, M or G suffix\n", argv[0]);
+				exit_usage(argv);
+			}
+			break;
+		case 'c':
+			opts->cache = optarg;
+			break;
 		case 'f':
 			*filename = optarg;
 			break;
+		case 'd':
+			opts->delta = true;
+			break;
+		case 'D':
+			opts->direct = true;
+			break;
+		case 'e':
+			if (engine_parse(optarg, &opts->engine) == -1) {
+				fprintf(stderr, "%s: unknown engine '%s'\n", argv[0], optarg);
+				exit_usage(argv);
+			}
+			break;
+		case 'i':
+			opts->back_input = optarg;
+			break;
+		case 'l':
+			ms = atoi(optarg);
+			if (ms < 1 || ms > MAX_LIFETIME) {
+				fprintf(stderr, "%s: lifetime must be between 1 and %d ms\n",
+					argv[0], MAX_LIFETIME);
+				exit_usage(argv);
+			}
+			opts->lifetime = ms * 1000;
+			break;
+		case 'm':
+			opts->messages = true;
+			ms = atoi(optarg);
+			if (ms < 0 || ms > MAX_MESSAGE_LATENCY) {
+				fprintf(stderr, "%s: latency must be between 0 and %d ms\n",
+					argv[0], MAX_MESSAGE_LATENCY);
+				exit_usage(argv);
+			}
+			opts->message_latency = ms * 1000;
+			break;
+		case 'n':
+			opts->stripes = atoi(optarg);
+			if (opts->stripes < 1 || opts->stripes > MAX_STRIPES) {
+				fprintf(stderr, "%s: stripes must be between 1 and %d\n",
+					argv[0], MAX_STRIPES);
+				exit_usage(argv);
+			}
+			break;
+		case 'o':
+			opts->back_output = optarg;
+			break;
+		case 'p':
+			opts->pipeline = true;
+			break;
+		case 'q':
+			log_quiet = true;
+			break;
+		case 'r':
+			opts->resume = true;
+			break;
+		case 's':
+			opts->sessions = atoi(optarg);
+			if (opts->sessions < 1 || opts->sessions > MAX_SESSIONS) {
+				fprintf(stderr, "%s: sessions must be between 1 and %d\n",
+					argv[0], MAX_SESSIONS);
+				exit_usage(argv);
+			}
+			break;
+		case 't':
+			opts->follow = true;
+			ms = atoi(optarg);
+			if (ms < 0 || ms > MAX_FOLLOW_LATENCY) {
+				fprintf(stderr, "%s: latency must be between 0 and %d ms\n",
+					argv[0], MAX_FOLLOW_LATENCY);
+				exit_usage(argv);
+			}
+			opts->follow_latency = ms * 1000;
+			break;
+		case 'w':
+			opts->initial_window = atoi(optarg);
+			if (opts->initial_window < 1 || opts->initial_window > MAX_WINDOW_SIZE) {
+				fprintf(stderr, "%s: window must be between 1 and %d\n",
+					argv[0], MAX_WINDOW_SIZE);
+				exit_usage(argv);
+			}
+			break;
+		case 'y':
+			opts->sync = true;
+			mb = atoi(optarg);
+			if (mb < 0 || mb > MAX_SYNC_INTERVAL) {
+				fprintf(stderr, "%s: sync interval must be between 0 and %d MB\n",
+					argv[0], MAX_SYNC_INTERVAL);
+				exit_usage(argv);
+			}
+			opts->sync_interval = (uint64_t) mb << 20;
+			break;
 		case 'h':
 		case '?':
 			exit_usage(argv);
@@ -95,6 +230,55 @@ void parse_args(int argc, char **argv,
 		}
 	}
 
+	if ((opts->direct || opts->sync_interval > 0) && !opts->pipeline) {
+		fprintf(stderr, "%s: writing with O_DIRECT or syncing periodically "
+			"needs a writer thread (-p)\n", argv[0]);
+		exit_usage(argv);
+	}
+
+	if (opts->resume && opts->stripes > 0) {
+		fprintf(stderr, "%s: striped transfers can't be resumed\n", argv[0]);
+		exit_usage(argv);
+	}
+	if (opts->delta && (opts->stripes > 0 || opts->resume)) {
+		fprintf(stderr, "%s: delta transfers can't be striped or resumed\n", argv[0]);
+		exit_usage(argv);
+	}
+	if (opts->follow && (opts->stripes > 0 || opts->delta || opts->pipeline)) {
+		fprintf(stderr, "%s: followed input can't be striped, sent as a delta "
+			"or read by another thread\n", argv[0]);
+		exit_usage(argv);
+	}
+
+	if (opts->messages && (opts->stripes > 0 || opts->resume || opts->delta ||
+	                       opts->follow || opts->pipeline)) {
+		fprintf(stderr, "%s: messages can't be striped, resumed, sent as a "
+			"delta, followed or read by another thread\n", argv[0]);
+		exit_usage(argv);
+	}
+
+	if (opts->lifetime > 0 && (opts->stripes > 0 || opts->resume || opts->delta)) {
+		fprintf(stderr, "%s: data with a lifetime can't be striped, resumed "
+			"or sent as a delta\n", argv[0]);
+		exit_usage(argv);
+	}
+
+	if ((opts->back_input != NULL || opts->back_output != NULL) &&
+	    (opts->stripes > 0 || opts->resume || opts->delta || opts->follow ||
+	     opts->messages || opts->pipeline)) {
+		fprintf(stderr, "%s: data can't be sent back in striped, resumed, delta, "
+			"followed or message transfers, or read or written by another "
+			"thread\n", argv[0]);
+		exit_usage(argv);
+	}
+
+	if (opts->sessions > 0 && (opts->stripes > 0 || opts->resume || opts->delta ||
+	                           opts->back_input != NULL)) {
+		fprintf(stderr, "%s: a receiver serving many senders can't take "
+			"stripes, resume, deltas or send data back\n", argv[0]);
+		exit_usage(argv);
+	}
+
 	if (optind + 2 != argc) {
 		fprintf(stderr, "%s: wrong number of arguments\n", argv[0]);
 		exit_usage(argv);
@@ -129,14 +313,23 @@ const char *real_address(const char *address, struct sockaddr_in6 *rval) {
 	return NULL;
 }
 
-int create_socket(struct sockaddr_in6 *source_addr, int src_port,
-                  struct sockaddr_in6 *dest_addr, int dst_port) {
+/**
+ * Implements create_socket and create_shared_socket.
+ */
+int open_socket(struct sockaddr_in6 *source_addr, int src_port,
+                struct sockaddr_in6 *dest_addr, int dst_port, bool shared) {
 	int sockfd = socket(AF_INET6, SOCK_DGRAM, IPPROTO_UDP);
 	if (sockfd == -1) {
 		log_perror("socket");
 		return -1;
 	}
 
+	int one = 1;
+	if (shared && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof (one)) != 0) {
+		log_perror("setsockopt");
+		return -1;
+	}
+
 	if (source_addr != NULL && src_port > 0) {
 		source_addr->sin6_port = htons(src_port);
 		if (bind(sockfd, (struct sockaddr *) source_addr, sizeof (*source_addr)) != 0) {
@@ -156,6 +349,52 @@ int create_socket(struct sockaddr_in6 *source_addr, int src_port,
 	return sockfd;
 }
 
+int create_socket(struct sockaddr_in6 *source_addr, int src_port,
+                  struct sockaddr_in6 *dest_addr, int dst_port) {
+	return open_socket(source_addr, src_port, dest_addr, dst_port, false);
+}
+
+int create_shared_socket(struct sockaddr_in6 *source_addr, int src_port,
+                         struct sockaddr_in6 *dest_addr, int dst_port) {
+	return open_socket(source_addr, src_port, dest_addr, dst_port, true);
+}
+
+bool udp_gso_supported(int sockfd) {
+	/* Setting a default segment size fails if the kernel doesn't know
+	 * about it, then reset it as we only segment on a per-send basis */
+	int size = MAX_PACKET_SIZE;
+	if (setsockopt(sockfd, IPPROTO_UDP, UDP_SEGMENT, &size, sizeof (size)) == -1) {
+		return false;
+	}
+	size = 0;
+	setsockopt(sockfd, IPPROTO_UDP, UDP_SEGMENT, &size, sizeof (size));
+	return true;
+}
+
+bool udp_gro_enable(int sockfd) {
+	int one = 1;
+	return setsockopt(sockfd, IPPROTO_UDP, UDP_GRO, &one, sizeof (one)) == 0;
+}
+
+int set_ecn(int sockfd, uint8_t ecn) {
+	int tclass = ecn;
+	if (setsockopt(sockfd, IPPROTO_IPV6, IPV6_TCLASS, &tclass, sizeof (tclass)) == -1) {
+		return -1;
+	}
+	/* For IPv4-mapped addresses, fine to fail otherwise */
+	setsockopt(sockfd, IPPROTO_IP, IP_TOS, &tclass, sizeof (tclass));
+	return 0;
+}
+
+int report_ecn(int sockfd) {
+	int one = 1;
+	if (setsockopt(sockfd, IPPROTO_IPV6, IPV6_RECVTCLASS, &one, sizeof (one)) == -1) {
+		return -1;
+	}
+	setsockopt(sockfd, IPPROTO_IP, IP_RECVTOS, &one, sizeof (one));
+	return 0;
+}
+
 int send_packet(int sockfd, pkt_t *pkt) {
 	char buf[MAX_PACKET_SIZE];
 	size_t len = MAX_PACKET_SIZE;
@@ -208,6 +447,10 @@ uint32_t get_monotime(void) {
 	return now.tv_sec * 1000000 + now.tv_usec;
 }
 
+bool time_before(uint32_t a, uint32_t b) {
+	return (int32_t) (a - b) < 0;
+}
+
 struct timeval micro_to_timeval(uint32_t us) {
 	struct timeval tv;
 	tv.tv_sec = us / 1000000;
@@ -7,13 +7,68 @@
  */
 
 #include <netdb.h>
+#include <stdbool.h>
+
+#include "engine.h"
+
+#define MAX_STRIPES 64 /* concurrent flows of a striped transfer */
+#define MAX_SESSIONS 16384 /* senders a receiver serves at once with -s */
+#define INITIAL_WINDOW 10 /* default window before the receiver's is known */
+#define MAX_FOLLOW_LATENCY 60000 /* longest flush latency when following (in ms) */
+#define MAX_MESSAGE_LATENCY 60000 /* longest coalescing latency of messages (in ms) */
+#define MAX_LIFETIME 600000 /* longest lifetime of data with -l (in ms) */
+#define MAX_SYNC_INTERVAL 1048576 /* longest interval between syncs with -y (in MB) */
+
+/* ECN field of the traffic class (or IPv4 TOS) of a datagram */
+#define ECN_MASK 3
+#define ECN_ECT0 2 /* sent by an ECN-capable transport */
+#define ECN_CE 3 /* marked by a congested router instead of dropped */
+
+/**
+ * Optional settings given on the command line.
+ */
+typedef struct options {
+	engine_type_t engine; /* I/O engine (-e) */
+	bool pipeline; /* read the input (sender) or write the output (receiver)
+	                * from another thread (-p) */
+	bool direct; /* receiver: write the output with O_DIRECT (-D) */
+	bool sync; /* receiver: sync the output to disk once complete (-y) */
+	uint64_t sync_interval; /* receiver: and every that many bytes written,
+	                         * 0 if only then (-y) */
+	unsigned stripes; /* flows of a striped transfer, 0 if not striped (-n) */
+	unsigned sessions; /* receiver: senders served at once, each by a worker,
+	                    * 0 to serve a single one (-s) */
+	unsigned initial_window; /* sender: window until the receiver's is known, 0
+	                          * to pick one (-w) */
+	bool resume; /* resume where an interrupted transfer stopped (-r) */
+	bool delta; /* send a delta against the receiver's copy of the file (-d) */
+	bool follow; /* sender: keep sending what is appended to the input (-t) */
+	uint32_t follow_latency; /* sender: longest a partial payload waits for more
+	                          * data when following, in microseconds (-t) */
+	bool messages; /* sender: the input is a stream of messages (-m) */
+	uint32_t message_latency; /* sender: longest a message waits for others
+	                           * to share its payload, in microseconds (-m) */
+	uint32_t lifetime; /* sender: time after which data that wasn't delivered
+	                    * is given up, in microseconds, 0 if never (-l) */
+	uint64_t rate; /* sender: cap on the rate of the transfer, in bytes per
+	                * second, 0 if none (-b) */
+	uint64_t host_rate; /* sender: cap on the rate of all the transfers of the
+	                     * host that have one, 0 if none (-B) */
+	const char *cache; /* sender: file of the path metrics cache, NULL if
+	                    * none (-c) */
+	const char *back_input; /* receiver: file sent back to the sender, NULL
+	                         * if none (-i) */
+	const char *back_output; /* sender: file where what the receiver sends
+	                          * back is written, NULL if none (-o) */
+} options_t;
 
 /**
  * Parses arguments from the command line and stores them in the corresponding
  * pointer. On error, prints usage on stderr and exits.
  */
 void parse_args(int argc, char **argv,
-                char **hostname, uint16_t *port, char **filename);
+                char **hostname, uint16_t *port, char **filename,
+                options_t *opts);
 
 /**
  * Resolves the resource name to an usable IPv6 address.
@@ -36,6 +91,42 @@ const char *real_address(const char *address, struct sockaddr_in6 *rval);
 int create_socket(struct sockaddr_in6 *source_addr, int src_port,
                   struct sockaddr_in6 *dest_addr, int dst_port);
 
+/**
+ * Same as create_socket, but the socket is bound with SO_REUSEPORT so that
+ * it can share its address with other such sockets. Datagrams go to the
+ * socket connected to their source if any, and to an unconnected one
+ * otherwise.
+ */
+int create_shared_socket(struct sockaddr_in6 *source_addr, int src_port,
+                         struct sockaddr_in6 *dest_addr, int dst_port);
+
+/**
+ * Reports whether the kernel can segment trains of datagrams sent on this
+ * socket (UDP_SEGMENT).
+ */
+bool udp_gso_supported(int sockfd);
+
+/**
+ * Makes the kernel coalesce datagrams of the same size received on this
+ * socket into trains handed over at once (UDP_GRO), with their size in the
+ * ancillary data. Returns whether it's supported.
+ */
+bool udp_gro_enable(int sockfd);
+
+/**
+ * Sets the ECN field of the datagrams sent on this socket, ECN_ECT0 to have
+ * routers mark them when congested rather than drop them, 0 to clear it.
+ * Returns -1 on error, and 0 otherwise.
+ */
+int set_ecn(int sockfd, uint8_t ecn);
+
+/**
+ * Makes the socket report the traffic class of the datagrams it receives, so
+ * that the I/O engine can tell their ECN field (see engine_recv_ecn).
+ * Returns -1 on error, and 0 otherwise.
+ */
+int report_ecn(int sockfd);
+
 /**
  * Sends a packet over the specified socket.
  * Calls send and returns its value. If the packet could not be encoded,
@@ -55,13 +146,20 @@ int send_packet(int sockfd, pkt_t *pkt);
  */
 uint32_t get_monotime(void);
 
+/**
+ * Returns whether the time a (as returned by get_monotime) comes before b.
+ * The clock wraps around every 71 minutes, which is fine as long as they're
+ * less than half of that apart.
+ */
+bool time_before(uint32_t a, uint32_t b);
+
 /**
  * Converts microseconds to a struct timeval.
  */
 struct timeval micro_to_timeval(uint32_t us);
 
 /**
- * Prints a message on stderr.
+ * Prints a message on stderr, unless quiet mode (-q) is enabled.
  */
 void log_msg(const char *fmt, ...);
 
@@ -75,6 +173,18 @@ void log_perror(const char *s);
  */
 char *pkt_repr(pkt_t *pkt);
 
+/**
+ * Prints on stderr the CPU time used by the process so far, and how much
+ * that amounts to per packet. Printed even in quiet mode.
+ */
+void log_cpu_usage(size_t packets);
+
+/**
+ * Prints on stderr the number of bytes sent in secs seconds, and the rate
+ * that amounts to. Printed even in quiet mode.
+ */
+void log_rate(uint64_t bytes, double secs);
+
 /**
  * Prints a message on stderr and exits with a non-zero code.
  */
@@ -174,22 +174,19 @@ pkt_t *window_pop_node(window_t *w, struct node **node) {
 
 pkt_t *window_pop_timestamp(window_t *w, uint32_t timestamp) {
 	struct node **cur = &w->front;
-	struct node **match = cur;
-	while (*cur != NULL) {
-		if (pkt_get_timestamp((*cur)->pkt) == timestamp) {
-			match = cur;
-			break;
-		}
+	while (*cur != NULL && pkt_get_timestamp((*cur)->pkt) != timestamp) {
 		cur = &(*cur)->next;
 	}
-	return window_pop_node(w, match);
+	/* NULL at the end of the list if there's no match */
+	return window_pop_node(w, cur);
 }
 
 struct node **window_find_min_timestamp(window_t *w) {
 	struct node **cur = &w->front;
 	struct node **min = cur;
 	while (*cur != NULL) {
-		if (pkt_get_timestamp((*cur)->pkt) < pkt_get_timestamp((*min)->pkt)) {
+		/* Timestamps wrap around, see time_before */
+		if ((int32_t) (pkt_get_timestamp((*cur)->pkt) - pkt_get_timestamp((*min)->pkt)) < 0) {
 			min = cur;
 		}
 		cur = &(*cur)->next;
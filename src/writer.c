@@ -0,0 +1,475 @@
+#define _GNU_SOURCE /* O_DIRECT, vmsplice */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "packet_interface.h"
+#include "ring.h"
+#include "writer.h"
+
+#define WRITER_SLOTS 1024 /* payloads handed over ahead of the disk */
+#define WRITER_BUF_SIZE (1 << 20) /* largest write */
+#define WRITER_ALIGN 4096 /* of the offset, length and memory of direct writes */
+#define WRITER_LINGER 20 /* ms data waits for more to share its write */
+
+enum {
+	ENTRY_DATA,
+	ENTRY_FLUSH, // write out what's gathered
+	ENTRY_STOP,
+};
+
+typedef struct entry {
+	int kind;
+	bool wait; // flush: signal done_fd once written
+	bool sync; // flush: and synced
+	off_t offset; // data: where it goes
+	size_t len;
+	char data[MAX_PAYLOAD_SIZE];
+} entry_t;
+
+struct writer {
+	pthread_t thread;
+	ring_t *ring;
+	int fd;
+	int direct_fd; // same file opened with O_DIRECT, -1 if none
+	bool seekable;
+	bool pipe; // whether to vmsplice to fd
+	uint64_t sync_interval;
+	off_t pos; // producer only: offset of the next write
+
+	// Writer thread only. buf[i] holds the byte at offset base + i, base
+	// being aligned, so that aligned ranges of the file are aligned in
+	// memory as well. Its data runs from head to len.
+	char *buf;
+	off_t base;
+	size_t head;
+	size_t len;
+	uint64_t unsynced; // bytes written since the last sync
+
+	int err; // errno value of the first error of the thread, 0 if none
+
+	// As in reader.c, each side announces when it's about to sleep, waiting
+	// for the other one through an eventfd only written to in that case.
+	int data_fd; // signalled by the producer, non-blocking
+	int space_fd; // signalled by the writer thread
+	int done_fd; // signalled by the writer thread once a flush is done
+	bool producer_waiting;
+	bool writer_waiting;
+};
+
+/**
+ * Signals the eventfd if the flag was set, clearing it.
+ */
+static void wake_if_waiting(bool *waiting, int fd) {
+	/* Order our last ring operation before checking the flag, the other
+	 * side sets it before checking the ring */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(waiting, __ATOMIC_RELAXED) &&
+	    __atomic_exchange_n(waiting, false, __ATOMIC_SEQ_CST)) {
+		eventfd_write(fd, 1);
+	}
+}
+
+/**
+ * Records the error of the thread, if it's the first one.
+ */
+static void fail(writer_t *wr, int err) {
+	int none = 0;
+	__atomic_compare_exchange_n(&wr->err, &none, err, false,
+		__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Returns -1 with errno set if the thread failed, 0 otherwise.
+ */
+static int check(writer_t *wr) {
+	int err = __atomic_load_n(&wr->err, __ATOMIC_SEQ_CST);
+	if (err != 0) {
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+static char *alloc_buf(void) {
+	char *buf = mmap(NULL, WRITER_BUF_SIZE, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	return buf == MAP_FAILED ? NULL : buf;
+}
+
+/**
+ * Writes len bytes at offset (appends them if offset is -1) to fd.
+ * Returns -1 on error (with errno set), and 0 otherwise.
+ */
+static int write_all(int fd, const char *buf, size_t len, off_t offset) {
+	while (len > 0) {
+		ssize_t n = offset == -1 ? write(fd, buf, len) : pwrite(fd, buf, len, offset);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		if (n == -1) {
+			return -1;
+		}
+		buf += n;
+		len -= n;
+		if (offset != -1) {
+			offset += n;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Hands len bytes over to the pipe fd without copying them: the pipe keeps
+ * references to their pages, so the buffer is never written to again (the
+ * caller unmaps it). Falls back to copying them if vmsplice isn't supported.
+ * Returns -1 on error (with errno set), and 0 otherwise.
+ */
+static int splice_all(writer_t *wr, const char *buf, size_t len) {
+	struct iovec iov = {(void *) buf, len};
+	while (iov.iov_len > 0) {
+		ssize_t n = vmsplice(wr->fd, &iov, 1, 0);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		if (n == -1 && (errno == EINVAL || errno == ENOSYS) && iov.iov_len == len) {
+			wr->pipe = false;
+			return write_all(wr->fd, buf, len, -1);
+		}
+		if (n == -1) {
+			return -1;
+		}
+		iov.iov_base = (char *) iov.iov_base + n;
+		iov.iov_len -= n;
+	}
+	return 0;
+}
+
+/**
+ * Writes out the data gathered in the buffer. With keep_tail, the end of
+ * the data that doesn't fill an aligned block is kept for the next direct
+ * write rather than written through the page cache.
+ * Returns -1 on error (with errno set), and 0 otherwise.
+ */
+static int write_out(writer_t *wr, bool keep_tail) {
+	size_t head = wr->head;
+	size_t len = wr->len;
+	if (head == len) {
+		return 0;
+	}
+
+	int err = 0;
+	size_t done = len; /* data written up to there */
+	if (wr->pipe) {
+		err = splice_all(wr, wr->buf + head, len - head);
+		if (wr->pipe) {
+			/* The pipe owns those pages now */
+			munmap(wr->buf, WRITER_BUF_SIZE);
+			wr->buf = alloc_buf();
+			if (wr->buf == NULL) {
+				return -1;
+			}
+		}
+		wr->head = wr->len = 0;
+	} else if (!wr->seekable) {
+		err = write_all(wr->fd, wr->buf + head, len - head, -1);
+		wr->head = wr->len = 0;
+	} else {
+		/* Only whole aligned blocks can go through direct_fd */
+		size_t start = (head + WRITER_ALIGN - 1) / WRITER_ALIGN * WRITER_ALIGN;
+		size_t end = len / WRITER_ALIGN * WRITER_ALIGN;
+		done = head;
+		if (wr->direct_fd != -1 && end > start) {
+			err = err || write_all(wr->fd, wr->buf + head, start - head, wr->base + head);
+			err = err || write_all(wr->direct_fd, wr->buf + start, end - start, wr->base + start);
+			done = end;
+		}
+		if (!keep_tail || done == head) {
+			err = err || write_all(wr->fd, wr->buf + done, len - done, wr->base + done);
+			done = len;
+		}
+
+		/* Go on from the last aligned block, with what's left of the
+		 * data */
+		size_t shift = done / WRITER_ALIGN * WRITER_ALIGN;
+		memmove(wr->buf, wr->buf + shift, len - shift);
+		wr->base += shift;
+		wr->head = done - shift;
+		wr->len = len - shift;
+	}
+	if (err) {
+		return -1;
+	}
+
+	wr->unsynced += done - head;
+	if (wr->sync_interval > 0 && wr->unsynced >= wr->sync_interval) {
+		wr->unsynced = 0;
+		return fdatasync(wr->fd);
+	}
+	return 0;
+}
+
+/**
+ * Adds the data of the entry to the buffer, writing out what's there first
+ * if it doesn't follow it or if there's no room for it.
+ * Returns -1 on error (with errno set), and 0 otherwise.
+ */
+static int gather(writer_t *wr, const entry_t *e) {
+	bool follows = !wr->seekable || e->offset == wr->base + (off_t) wr->len;
+	if (!follows || wr->len + e->len > WRITER_BUF_SIZE) {
+		if (write_out(wr, follows) == -1) {
+			return -1;
+		}
+	}
+
+	if (wr->seekable && (wr->head == wr->len || !follows)) {
+		wr->base = e->offset / WRITER_ALIGN * WRITER_ALIGN;
+		wr->head = wr->len = e->offset - wr->base;
+	}
+	memcpy(wr->buf + wr->len, e->data, e->len);
+	wr->len += e->len;
+	return 0;
+}
+
+/**
+ * Waits for the producer to publish an entry, at most timeout ms (forever if
+ * timeout < 0). Returns the entry, or NULL on timeout.
+ */
+static entry_t *wait_entry(writer_t *wr, int timeout) {
+	__atomic_store_n(&wr->writer_waiting, true, __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	entry_t *e = ring_consume_slot(wr->ring);
+	if (e == NULL) {
+		struct pollfd pfd = {wr->data_fd, POLLIN, 0};
+		if (poll(&pfd, 1, timeout) > 0) {
+			eventfd_t value;
+			eventfd_read(wr->data_fd, &value);
+		}
+		e = ring_consume_slot(wr->ring);
+	}
+	__atomic_store_n(&wr->writer_waiting, false, __ATOMIC_SEQ_CST);
+	return e;
+}
+
+static void *writer_run(void *arg) {
+	writer_t *wr = arg;
+
+	while (true) {
+		entry_t *e = ring_consume_slot(wr->ring);
+		if (e == NULL) {
+			/* Write out what's gathered if nothing more comes soon */
+			e = wait_entry(wr, wr->head < wr->len ? WRITER_LINGER : -1);
+			if (e == NULL) {
+				if (check(wr) == 0 && write_out(wr, false) == -1) {
+					fail(wr, errno);
+				}
+				continue;
+			}
+		}
+
+		/* After an error, keep consuming so that the producer doesn't
+		 * block, it finds out on its next call */
+		int kind = e->kind;
+		if (check(wr) == 0) {
+			int err = 0;
+			if (kind == ENTRY_DATA) {
+				err = gather(wr, e);
+			} else {
+				err = write_out(wr, false);
+				if (err == 0 && kind == ENTRY_FLUSH && e->sync) {
+					err = fdatasync(wr->fd);
+					wr->unsynced = 0;
+				}
+			}
+			if (err == -1) {
+				fail(wr, errno);
+			}
+		}
+		bool signal = kind == ENTRY_STOP || (kind == ENTRY_FLUSH && e->wait);
+
+		ring_release(wr->ring);
+		wake_if_waiting(&wr->producer_waiting, wr->space_fd);
+		if (signal) {
+			eventfd_write(wr->done_fd, 1);
+		}
+		if (kind == ENTRY_STOP) {
+			return NULL;
+		}
+	}
+}
+
+/**
+ * Returns a free entry of the ring, blocking until there's one.
+ */
+static entry_t *produce(writer_t *wr) {
+	entry_t *e;
+	while ((e = ring_produce_slot(wr->ring)) == NULL) {
+		/* Full, sleep until the writer thread releases an entry */
+		__atomic_store_n(&wr->producer_waiting, true, __ATOMIC_SEQ_CST);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (ring_produce_slot(wr->ring) == NULL) {
+			eventfd_t value;
+			eventfd_read(wr->space_fd, &value);
+		}
+		__atomic_store_n(&wr->producer_waiting, false, __ATOMIC_SEQ_CST);
+	}
+	return e;
+}
+
+static void publish(writer_t *wr) {
+	ring_publish(wr->ring);
+	wake_if_waiting(&wr->writer_waiting, wr->data_fd);
+}
+
+writer_t *writer_start(int fd, bool direct, uint64_t sync_interval) {
+	writer_t *wr = calloc(1, sizeof (writer_t));
+	if (wr == NULL) {
+		return NULL;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) == -1) {
+		free(wr);
+		return NULL;
+	}
+	wr->fd = fd;
+	wr->pos = lseek(fd, 0, SEEK_CUR);
+	wr->seekable = wr->pos != -1;
+	wr->pipe = S_ISFIFO(st.st_mode);
+	wr->sync_interval = sync_interval;
+	wr->direct_fd = -1;
+	if (direct && wr->seekable) {
+		/* Through /proc, to get another open file description */
+		char path[64];
+		snprintf(path, sizeof (path), "/proc/self/fd/%d", fd);
+		wr->direct_fd = open(path, O_WRONLY | O_DIRECT | O_CLOEXEC);
+	}
+
+	wr->buf = alloc_buf();
+	wr->data_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	wr->space_fd = eventfd(0, EFD_CLOEXEC);
+	wr->done_fd = eventfd(0, EFD_CLOEXEC);
+	wr->ring = ring_create(WRITER_SLOTS, sizeof (entry_t));
+	if (wr->buf == NULL || wr->data_fd == -1 || wr->space_fd == -1 ||
+	    wr->done_fd == -1 || wr->ring == NULL) {
+		goto fail;
+	}
+
+	if (pthread_create(&wr->thread, NULL, writer_run, wr) != 0) {
+		goto fail;
+	}
+	return wr;
+
+fail:
+	if (wr->ring != NULL) {
+		ring_free(wr->ring);
+	}
+	if (wr->buf != NULL) {
+		munmap(wr->buf, WRITER_BUF_SIZE);
+	}
+	if (wr->direct_fd != -1) {
+		close(wr->direct_fd);
+	}
+	if (wr->data_fd != -1) {
+		close(wr->data_fd);
+	}
+	if (wr->space_fd != -1) {
+		close(wr->space_fd);
+	}
+	if (wr->done_fd != -1) {
+		close(wr->done_fd);
+	}
+	free(wr);
+	return NULL;
+}
+
+int writer_stop(writer_t *wr) {
+	entry_t *e = produce(wr);
+	e->kind = ENTRY_STOP;
+	publish(wr);
+	pthread_join(wr->thread, NULL);
+
+	int ret = check(wr);
+	int err = errno;
+	ring_free(wr->ring);
+	if (wr->buf != NULL) {
+		munmap(wr->buf, WRITER_BUF_SIZE);
+	}
+	if (wr->direct_fd != -1) {
+		close(wr->direct_fd);
+	}
+	close(wr->data_fd);
+	close(wr->space_fd);
+	close(wr->done_fd);
+	free(wr);
+	errno = err;
+	return ret;
+}
+
+int writer_write(writer_t *wr, const char *buf, size_t len) {
+	if (check(wr) == -1) {
+		return -1;
+	}
+
+	while (len > 0) {
+		size_t chunk = len < MAX_PAYLOAD_SIZE ? len : MAX_PAYLOAD_SIZE;
+		entry_t *e = produce(wr);
+		e->kind = ENTRY_DATA;
+		e->offset = wr->pos;
+		e->len = chunk;
+		memcpy(e->data, buf, chunk);
+		publish(wr);
+
+		if (wr->seekable) {
+			wr->pos += chunk;
+		}
+		buf += chunk;
+		len -= chunk;
+	}
+	return 0;
+}
+
+int writer_seek(writer_t *wr, off_t offset) {
+	if (!wr->seekable) {
+		errno = ESPIPE;
+		return -1;
+	}
+	wr->pos = offset;
+	return 0;
+}
+
+off_t writer_tell(writer_t *wr) {
+	if (!wr->seekable) {
+		errno = ESPIPE;
+		return -1;
+	}
+	return wr->pos;
+}
+
+int writer_flush(writer_t *wr, bool wait, bool sync) {
+	entry_t *e = produce(wr);
+	e->kind = ENTRY_FLUSH;
+	e->wait = wait;
+	e->sync = sync;
+	publish(wr);
+
+	if (wait) {
+		eventfd_t value;
+		eventfd_read(wr->done_fd, &value);
+	}
+	return check(wr);
+}
+
+size_t writer_space(writer_t *wr) {
+	return ring_capacity(wr->ring) - ring_count(wr->ring);
+}
@@ -0,0 +1,72 @@
+#ifndef __WRITER_H_
+#define __WRITER_H_
+
+
+/**
+ * Output writer running in its own thread, the receiver's counterpart of
+ * reader.h. The receiver hands it payloads through a lock-free ring, along
+ * with the offset they go to, and it gathers contiguous ones into large
+ * writes, so that a slow disk never holds up the thread handling the network.
+ * Aligned parts of those writes can bypass the page cache (O_DIRECT), and
+ * when the output is a pipe they're handed over to it without a copy
+ * (vmsplice).
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+typedef struct writer writer_t;
+
+/**
+ * Starts a thread writing to fd, from its current position. With direct,
+ * what can be is written with O_DIRECT (if the file system allows it). If
+ * sync_interval isn't 0, the data is synced to disk (fdatasync) every time
+ * that many more bytes are written.
+ * Returns NULL on error.
+ */
+writer_t *writer_start(int fd, bool direct, uint64_t sync_interval);
+
+/**
+ * Writes out everything handed over, waits for the thread to terminate and
+ * releases the resources of the writer (NOT fd).
+ * Returns -1 if a write failed (with errno set), and 0 otherwise.
+ */
+int writer_stop(writer_t *wr);
+
+/**
+ * Hands len bytes over to be written at the current position, which moves
+ * past them. Blocks while the ring is full.
+ * Returns -1 if a write failed (with errno set), and 0 otherwise.
+ */
+int writer_write(writer_t *wr, const char *buf, size_t len);
+
+/**
+ * Moves the position of the next write to offset, which requires a seekable
+ * file.
+ * Returns -1 on error (with errno set), and 0 otherwise.
+ */
+int writer_seek(writer_t *wr, off_t offset);
+
+/**
+ * Returns the position of the next write, which requires a seekable file,
+ * or -1 on error (with errno set).
+ */
+off_t writer_tell(writer_t *wr);
+
+/**
+ * Makes the thread write out what was handed over without waiting for more
+ * to gather. If wait, returns once it's in the file, and if sync as well,
+ * on disk.
+ * Returns -1 if a write failed (with errno set), and 0 otherwise.
+ */
+int writer_flush(writer_t *wr, bool wait, bool sync);
+
+/**
+ * Returns the number of payloads (of at most MAX_PAYLOAD_SIZE bytes) that
+ * can be handed over without blocking. It can only grow until the next one.
+ */
+size_t writer_space(writer_t *wr);
+
+
+#endif  /* __WRITER_H_ */
@@ -0,0 +1,90 @@
+#define _GNU_SOURCE /* SEEK_DATA, SEEK_HOLE */
+
+#include <errno.h>
+#include <unistd.h>
+#include <zlib.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "zero.h"
+
+bool is_zero(const char *buf, size_t len) {
+	size_t i = 0;
+
+#ifdef __SSE2__
+	/* 64 bytes at a time, checking the OR of them all */
+	const __m128i zero = _mm_setzero_si128();
+	for (; i + 64 <= len; i += 64) {
+		const __m128i *v = (const __m128i *) (buf + i);
+		__m128i acc = _mm_or_si128(
+			_mm_or_si128(_mm_loadu_si128(v), _mm_loadu_si128(v + 1)),
+			_mm_or_si128(_mm_loadu_si128(v + 2), _mm_loadu_si128(v + 3)));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xffff) {
+			return false;
+		}
+	}
+#endif
+
+	for (; i < len; i++) {
+		if (buf[i] != 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+size_t zero_run(int fd, const char *buf, size_t pos, size_t end, size_t block) {
+	bool checked_hole = false;
+
+	while (pos < end) {
+		size_t n = end - pos < block ? end - pos : block;
+		if (!is_zero(buf + pos, n)) {
+			break;
+		}
+		pos += n;
+
+		/* Holes read as zeros: once we've found some, look for where
+		 * the data starts again rather than scanning the hole. A single
+		 * system call per run is enough for the usual layout. */
+		if (fd != -1 && !checked_hole) {
+			checked_hole = true;
+			off_t data = lseek(fd, pos, SEEK_DATA);
+			if (data == -1 && errno == ENXIO) {
+				data = end; // hole up to the end of the file
+			}
+			if (data > (off_t) pos) {
+				/* Holes are aligned on file system blocks, which are
+				 * multiples of ours */
+				pos = (size_t) data < end ? (size_t) data : end;
+			}
+		}
+	}
+	return pos;
+}
+
+bool has_holes(int fd, size_t len) {
+	/* The end of the file counts as a hole */
+	off_t hole = lseek(fd, 0, SEEK_HOLE);
+	return hole != -1 && (size_t) hole < len;
+}
+
+uint32_t crc_zeros(uint64_t len) {
+	/* Double the run bit by bit, from the most significant one */
+	static const char zero_byte = 0;
+	uint32_t one = crc32(0, (const unsigned char *) &zero_byte, 1);
+	uint32_t crc = 0;
+	uint64_t done = 0;
+
+	for (int bit = 63; bit >= 0; bit--) {
+		if (done > 0) {
+			crc = crc32_combine(crc, crc, done);
+			done *= 2;
+		}
+		if (len & ((uint64_t) 1 << bit)) {
+			crc = crc32_combine(crc, one, 1);
+			done++;
+		}
+	}
+	return crc;
+}
@@ -0,0 +1,39 @@
+#ifndef __ZERO_H_
+#define __ZERO_H_
+
+
+/**
+ * Detection of runs of zeros in the input, which are sent as their length
+ * rather than as payloads.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Returns whether the len bytes at buf are all zero.
+ */
+bool is_zero(const char *buf, size_t len);
+
+/**
+ * Returns the end of the run of zeros starting at offset pos in the data at
+ * buf, made of whole blocks of block bytes (the last one may be cut short by
+ * end). Returns pos if there is none.
+ * If fd isn't -1, buf is the mapping of the file fd, whose holes are skipped
+ * without reading them.
+ */
+size_t zero_run(int fd, const char *buf, size_t pos, size_t end, size_t block);
+
+/**
+ * Returns whether the file fd, len bytes long, has holes before its end.
+ */
+bool has_holes(int fd, size_t len);
+
+/**
+ * Returns the CRC32 of len zero bytes, without going through them.
+ */
+uint32_t crc_zeros(uint64_t len);
+
+
+#endif  /* __ZERO_H_ */
@@ -0,0 +1,42 @@
+#!/bin/sh
+# Loopback benchmark: transfers the same random file with each I/O engine
+# and prints the CPU usage per packet of the sender and of the receiver.
+#
+# Usage: tests/bench.sh [SIZE_IN_MB] [ENGINES...]
+# Extra options can be given in SENDER_OPTS and RECEIVER_OPTS (e.g. -p), and
+# the file is striped across that many flows if STRIPES is set.
+
+SIZE_MB=${1:-50}
+[ $# -gt 0 ] && shift
+ENGINES=${*:-posix gso uring}
+PORT=64321
+INPUT=$(mktemp)
+OUTPUT=$(mktemp)
+RECEIVER_LOG=$(mktemp)
+STRIPE_OPTS=${STRIPES:+-n $STRIPES}
+
+head -c $((SIZE_MB * 1024 * 1024)) /dev/urandom > "$INPUT"
+
+for engine in $ENGINES; do
+	./receiver ::1 $PORT -q -e "$engine" $RECEIVER_OPTS $STRIPE_OPTS -f "$OUTPUT" 2> "$RECEIVER_LOG" &
+	receiver=$!
+	sleep 0.2
+
+	start=$(date +%s.%N)
+	./sender ::1 $PORT -q -e "$engine" $SENDER_OPTS $STRIPE_OPTS -f "$INPUT" 2>&1 | sed "s/^/$engine sender: /"
+	end=$(date +%s.%N)
+
+	pkill -P $receiver # striping workers
+	kill $receiver
+	wait $receiver 2>/dev/null
+	grep CPU "$RECEIVER_LOG" | sed "s/^/$engine receiver: /"
+
+	if cmp -s "$INPUT" "$OUTPUT"; then
+		awk -v e="$engine" -v mb="$SIZE_MB" -v s="$start" -v t="$end" \
+			'BEGIN { printf "%s: %dMB in %.3fs\n", e, mb, t - s }'
+	else
+		echo "$engine: output differs from input"
+	fi
+done
+
+rm -f "$INPUT" "$OUTPUT" "$RECEIVER_LOG"
@@ -0,0 +1,44 @@
+#!/bin/sh
+# Duplex test: transfers a random file while the receiver sends another one
+# back in the same session (-i/-o), through tests/reorder, which reorders
+# datagrams both ways, then checks both outputs. A sender still waiting for
+# data sent back after a minute counts as a failure.
+#
+# Usage: tests/duplex.sh [SIZE_IN_KB] [BACK_SIZE_IN_KB] [REORDER_PERCENT]
+
+SIZE_KB=${1:-1000}
+BACK_KB=${2:-1000}
+PERCENT=${3:-30}
+PORT=64341
+INPUT=$(mktemp)
+OUTPUT=$(mktemp)
+BACK_INPUT=$(mktemp)
+BACK_OUTPUT=$(mktemp)
+
+head -c $((SIZE_KB * 1024)) /dev/urandom > "$INPUT"
+head -c $((BACK_KB * 1024)) /dev/urandom > "$BACK_INPUT"
+
+./receiver ::1 $PORT -q -f "$OUTPUT" -i "$BACK_INPUT" &
+receiver=$!
+./tests/reorder $((PORT + 1)) $PORT $PERCENT &
+reorder=$!
+sleep 0.2
+
+timeout 60 ./sender ::1 $((PORT + 1)) -q -f "$INPUT" -o "$BACK_OUTPUT"
+sleep 0.2
+kill $receiver $reorder
+wait $receiver $reorder 2>/dev/null
+
+status=0
+if ! cmp -s "$INPUT" "$OUTPUT"; then
+	echo "duplex: output differs from input"
+	status=1
+fi
+if ! cmp -s "$BACK_INPUT" "$BACK_OUTPUT"; then
+	echo "duplex: data sent back differs"
+	status=1
+fi
+[ $status -eq 0 ] && echo "duplex: both ways OK"
+
+rm -f "$INPUT" "$OUTPUT" "$BACK_INPUT" "$BACK_OUTPUT"
+exit $status
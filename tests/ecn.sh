@@ -0,0 +1,38 @@
+#!/bin/sh
+# ECN test: transfers a random file through tests/marker, a bottleneck that
+# marks ECN-capable packets CE once its queue builds up (and drops the
+# others), then checks the output and counts the sender's retransmissions.
+# With ECN working, the sender backs off on the marks and loses nothing.
+#
+# Usage: tests/ecn.sh [SIZE_IN_KB] [RATE_BYTES_PER_SEC] [MARK_QUEUE]
+
+SIZE_KB=${1:-1000}
+RATE=${2:-500000}
+MARK_QUEUE=${3:-8}
+PORT=64331
+INPUT=$(mktemp)
+OUTPUT=$(mktemp)
+LOG=$(mktemp)
+
+head -c $((SIZE_KB * 1024)) /dev/urandom > "$INPUT"
+
+./receiver ::1 $PORT -q -f "$OUTPUT" &
+receiver=$!
+./tests/marker $((PORT + 1)) $PORT $RATE $MARK_QUEUE &
+marker=$!
+sleep 0.2
+
+./sender ::1 $((PORT + 1)) -f "$INPUT" 2> "$LOG"
+sleep 0.2
+kill $receiver $marker
+wait $receiver $marker 2>/dev/null
+
+echo "ecn: $(grep -c 'congestion window reduced' "$LOG") reductions, $(grep -c '> RETR' "$LOG") retransmissions"
+status=0
+if ! cmp -s "$INPUT" "$OUTPUT"; then
+	echo "ecn: output differs from input"
+	status=1
+fi
+
+rm -f "$INPUT" "$OUTPUT" "$LOG"
+exit $status
@@ -1,8 +1,20 @@
 #include "CUnit/CUnit.h"
 #include "CUnit/Basic.h"
 
+#include "test_bucket.h"
+#include "test_checkpoint.h"
+#include "test_delta.h"
+#include "test_duplex.h"
+#include "test_manifest.h"
+#include "test_message.h"
+#include "test_metrics.h"
 #include "test_packet.h"
+#include "test_peers.h"
+#include "test_ring.h"
+#include "test_setup.h"
 #include "test_window.h"
+#include "test_writer.h"
+#include "test_zero.h"
 
 int main(void) {
 	if (CU_initialize_registry() != CUE_SUCCESS) {
@@ -10,8 +22,20 @@ int main(void) {
 	}
 
 	CU_SuiteInfo suites[] = {
+		{"bucket", NULL, NULL, NULL, NULL, bucket_tests},
+		{"checkpoint", NULL, NULL, setup_checkpoint, teardown_checkpoint, checkpoint_tests},
+		{"delta", NULL, NULL, NULL, NULL, delta_tests},
+		{"duplex", NULL, NULL, NULL, NULL, duplex_tests},
+		{"manifest", init_manifest, clean_manifest, NULL, NULL, manifest_tests},
+		{"message", NULL, NULL, NULL, NULL, message_tests},
+		{"metrics", NULL, NULL, setup_metrics, teardown_metrics, metrics_tests},
 		{"packet", NULL, NULL, pkt_setup, pkt_teardown, packet_tests},
+		{"peers", NULL, NULL, NULL, NULL, peers_tests},
+		{"ring", NULL, NULL, setup_ring, teardown_ring, ring_tests},
+		{"setup", NULL, NULL, NULL, NULL, setup_tests},
 		{"window", NULL, NULL, setup_window, teardown_window, window_tests},
+		{"writer", NULL, NULL, NULL, teardown_writer, writer_tests},
+		{"zero", NULL, NULL, NULL, NULL, zero_tests},
 		CU_SUITE_INFO_NULL,
 	};
 
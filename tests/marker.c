@@ -0,0 +1,181 @@
+/**
+ * Stand-in for a congested router between the sender and the receiver, to
+ * test ECN: datagrams from the sender go through a bottleneck of a given rate
+ * (datagrams of the receiver go straight back). Once more than a given number
+ * of them are queued, ECN-capable ones are marked CE and the others dropped,
+ * as an AQM would. It prints what it did when interrupted.
+ *
+ * Usage: marker LISTEN_PORT RECEIVER_PORT RATE_BYTES_PER_SEC MARK_QUEUE
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_DATAGRAM 2048
+#define MAX_QUEUE 64 /* datagrams beyond which all are dropped */
+
+typedef struct queued {
+	char buf[MAX_DATAGRAM];
+	size_t len;
+	int tclass;
+	int64_t departure; /* when it leaves the bottleneck */
+} queued_t;
+
+queued_t queue[MAX_QUEUE];
+size_t head;
+size_t count;
+
+volatile sig_atomic_t stop;
+unsigned long ect, not_ect, marked, dropped;
+
+static int64_t now_us(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void on_signal(int sig) {
+	(void) sig;
+	stop = 1;
+}
+
+static int udp_socket(int port, int connect_port) {
+	int fd = socket(AF_INET6, SOCK_DGRAM, 0);
+	if (fd == -1) {
+		return -1;
+	}
+	struct sockaddr_in6 addr = {.sin6_family = AF_INET6, .sin6_addr = IN6ADDR_LOOPBACK_INIT};
+	if (port > 0) {
+		addr.sin6_port = htons(port);
+		if (bind(fd, (struct sockaddr *) &addr, sizeof (addr)) == -1) {
+			return -1;
+		}
+	} else {
+		addr.sin6_port = htons(connect_port);
+		if (connect(fd, (struct sockaddr *) &addr, sizeof (addr)) == -1) {
+			return -1;
+		}
+	}
+	return fd;
+}
+
+/**
+ * Queues a datagram from the sender, marking or dropping it if the queue is
+ * too long already.
+ */
+static void enqueue(const char *buf, size_t len, int tclass, double rate, size_t mark_queue) {
+	if ((tclass & 3) != 0) {
+		ect++;
+	} else {
+		not_ect++;
+	}
+	if (count == MAX_QUEUE || (count >= mark_queue && (tclass & 3) == 0)) {
+		dropped++;
+		return;
+	}
+	if (count >= mark_queue) {
+		tclass |= 3;
+		marked++;
+	}
+
+	int64_t start = now_us();
+	if (count > 0) {
+		int64_t last = queue[(head + count - 1) % MAX_QUEUE].departure;
+		start = last > start ? last : start;
+	}
+	queued_t *q = &queue[(head + count) % MAX_QUEUE];
+	memcpy(q->buf, buf, len);
+	q->len = len;
+	q->tclass = tclass;
+	q->departure = start + (int64_t) (len * 1000000 / rate);
+	count++;
+}
+
+int main(int argc, char **argv) {
+	if (argc != 5) {
+		fprintf(stderr, "Usage: %s LISTEN_PORT RECEIVER_PORT RATE MARK_QUEUE\n", argv[0]);
+		return 2;
+	}
+	double rate = atof(argv[3]);
+	size_t mark_queue = atoi(argv[4]);
+
+	int front = udp_socket(atoi(argv[1]), 0);
+	int back = udp_socket(0, atoi(argv[2]));
+	int one = 1;
+	if (front == -1 || back == -1 ||
+	    setsockopt(front, IPPROTO_IPV6, IPV6_RECVTCLASS, &one, sizeof (one)) == -1) {
+		perror("socket");
+		return 1;
+	}
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	struct sockaddr_in6 client;
+	socklen_t client_len = 0;
+	while (!stop) {
+		int timeout = -1;
+		if (count > 0) {
+			int64_t left = queue[head].departure - now_us();
+			timeout = left > 0 ? (left + 999) / 1000 : 0;
+		}
+		struct pollfd fds[] = {{front, POLLIN, 0}, {back, POLLIN, 0}};
+		if (poll(fds, 2, timeout) == -1 && errno != EINTR) {
+			perror("poll");
+			return 1;
+		}
+
+		char buf[MAX_DATAGRAM];
+		if (fds[0].revents & POLLIN) {
+			char ctrl[64];
+			struct iovec iov = {buf, sizeof (buf)};
+			struct msghdr msg = {&client, sizeof (client), &iov, 1, ctrl, sizeof (ctrl), 0};
+			ssize_t len = recvmsg(front, &msg, 0);
+			if (len >= 0) {
+				client_len = msg.msg_namelen;
+				int tclass = 0;
+				for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+					if (cm->cmsg_level == IPPROTO_IPV6 && cm->cmsg_type == IPV6_TCLASS) {
+						memcpy(&tclass, CMSG_DATA(cm), sizeof (tclass));
+					}
+				}
+				enqueue(buf, len, tclass, rate, mark_queue);
+			}
+		}
+		if (fds[1].revents & POLLIN) {
+			ssize_t len = recv(back, buf, sizeof (buf), 0);
+			if (len >= 0 && client_len > 0) {
+				sendto(front, buf, len, 0, (struct sockaddr *) &client, client_len);
+			}
+		}
+
+		int64_t now = now_us();
+		while (count > 0 && queue[head].departure <= now) {
+			queued_t *q = &queue[head];
+			char ctrl[CMSG_SPACE(sizeof (int))];
+			struct iovec iov = {q->buf, q->len};
+			struct msghdr msg = {NULL, 0, &iov, 1, ctrl, sizeof (ctrl), 0};
+			struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+			cm->cmsg_level = IPPROTO_IPV6;
+			cm->cmsg_type = IPV6_TCLASS;
+			cm->cmsg_len = CMSG_LEN(sizeof (int));
+			memcpy(CMSG_DATA(cm), &q->tclass, sizeof (int));
+			sendmsg(back, &msg, 0);
+			head = (head + 1) % MAX_QUEUE;
+			count--;
+		}
+	}
+
+	fprintf(stderr, "marker: %lu ECN-capable, %lu not, %lu marked CE, %lu dropped\n",
+		ect, not_ect, marked, dropped);
+	return 0;
+}
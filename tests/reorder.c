@@ -0,0 +1,153 @@
+/**
+ * Stand-in for a path reordering datagrams between the sender and the
+ * receiver, in both directions: each datagram is held back with a given
+ * probability, for a random time of up to HOLD_US, while later ones in the
+ * same direction go through (as many as a window or more). It prints what it
+ * did when interrupted.
+ *
+ * Usage: reorder LISTEN_PORT RECEIVER_PORT PERCENT
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_DATAGRAM 2048
+#define HOLD_US 10000 /* longest a datagram is held back */
+
+typedef struct held {
+	char buf[MAX_DATAGRAM];
+	size_t len;
+	int64_t until; /* when it goes, 0 if none is held back */
+} held_t;
+
+held_t held[2]; /* towards the receiver, towards the sender */
+
+volatile sig_atomic_t stop;
+unsigned long forwarded, reordered;
+
+static int64_t now_us(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void on_signal(int sig) {
+	(void) sig;
+	stop = 1;
+}
+
+static int udp_socket(int port, int connect_port) {
+	int fd = socket(AF_INET6, SOCK_DGRAM, 0);
+	if (fd == -1) {
+		return -1;
+	}
+	struct sockaddr_in6 addr = {.sin6_family = AF_INET6, .sin6_addr = IN6ADDR_LOOPBACK_INIT};
+	if (port > 0) {
+		addr.sin6_port = htons(port);
+		if (bind(fd, (struct sockaddr *) &addr, sizeof (addr)) == -1) {
+			return -1;
+		}
+	} else {
+		addr.sin6_port = htons(connect_port);
+		if (connect(fd, (struct sockaddr *) &addr, sizeof (addr)) == -1) {
+			return -1;
+		}
+	}
+	return fd;
+}
+
+/**
+ * Sends the datagram held back in direction dir, if any.
+ */
+static void release(int dir, int fd, struct sockaddr_in6 *to, socklen_t to_len) {
+	held_t *h = &held[dir];
+	if (h->until == 0) {
+		return;
+	}
+	sendto(fd, h->buf, h->len, 0, (struct sockaddr *) to, to_len);
+	h->until = 0;
+}
+
+/**
+ * Forwards a datagram in direction dir, or holds it back for later ones to
+ * overtake it.
+ */
+static void forward(int dir, const char *buf, size_t len, int percent, int fd,
+		struct sockaddr_in6 *to, socklen_t to_len) {
+	forwarded++;
+	if (held[dir].until == 0 && rand() % 100 < percent) {
+		memcpy(held[dir].buf, buf, len);
+		held[dir].len = len;
+		held[dir].until = now_us() + 1 + rand() % HOLD_US;
+		reordered++;
+		return;
+	}
+	sendto(fd, buf, len, 0, (struct sockaddr *) to, to_len);
+}
+
+int main(int argc, char **argv) {
+	if (argc != 4) {
+		fprintf(stderr, "Usage: %s LISTEN_PORT RECEIVER_PORT PERCENT\n", argv[0]);
+		return 2;
+	}
+	int percent = atoi(argv[3]);
+
+	int front = udp_socket(atoi(argv[1]), 0);
+	int back = udp_socket(0, atoi(argv[2]));
+	if (front == -1 || back == -1) {
+		perror("socket");
+		return 1;
+	}
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+	srand(getpid());
+
+	struct sockaddr_in6 client;
+	socklen_t client_len = 0;
+	while (!stop) {
+		int timeout = held[0].until != 0 || held[1].until != 0 ? 1 : -1;
+		struct pollfd fds[] = {{front, POLLIN, 0}, {back, POLLIN, 0}};
+		if (poll(fds, 2, timeout) == -1 && errno != EINTR) {
+			perror("poll");
+			return 1;
+		}
+
+		char buf[MAX_DATAGRAM];
+		if (fds[0].revents & POLLIN) {
+			socklen_t len_addr = sizeof (client);
+			ssize_t len = recvfrom(front, buf, sizeof (buf), 0,
+				(struct sockaddr *) &client, &len_addr);
+			if (len >= 0) {
+				client_len = len_addr;
+				forward(0, buf, len, percent, back, NULL, 0);
+			}
+		}
+		if (fds[1].revents & POLLIN) {
+			ssize_t len = recv(back, buf, sizeof (buf), 0);
+			if (len >= 0 && client_len > 0) {
+				forward(1, buf, len, percent, front, &client, client_len);
+			}
+		}
+
+		int64_t now = now_us();
+		if (held[0].until != 0 && now >= held[0].until) {
+			release(0, back, NULL, 0);
+		}
+		if (held[1].until != 0 && now >= held[1].until) {
+			release(1, front, &client, client_len);
+		}
+	}
+
+	fprintf(stderr, "reorder: %lu datagrams, %lu held back\n", forwarded, reordered);
+	return 0;
+}
@@ -0,0 +1,50 @@
+#!/bin/sh
+# Sessions test: runs many senders at once against a receiver serving them
+# each from its own worker (-s), for some of them to reuse the port of one
+# that finished while its worker still lingers, then checks that all of them
+# were served and their outputs. A sender still running after a minute
+# counts as a failure.
+#
+# Usage: tests/sessions.sh [SENDERS] [SIZE_IN_KB]
+
+SENDERS=${1:-400}
+SIZE_KB=${2:-100}
+PORT=64351
+INPUT=$(mktemp)
+OUTDIR=$(mktemp -d)
+STATUSES=$(mktemp -d)
+
+head -c $((SIZE_KB * 1024)) /dev/urandom > "$INPUT"
+
+./receiver ::1 $PORT -q -s 1000 -f "$OUTDIR" &
+receiver=$!
+sleep 0.2
+
+i=0
+while [ $i -lt "$SENDERS" ]; do
+	(timeout 60 ./sender ::1 $PORT -q -f "$INPUT" 2>/dev/null; echo $? > "$STATUSES/$i") &
+	senders="$senders $!"
+	i=$((i + 1))
+done
+wait $senders
+# The workers linger after their transfer
+pkill -P $receiver
+kill $receiver
+wait $receiver 2>/dev/null
+
+status=0
+failed=$(grep -lvx 0 "$STATUSES"/* | wc -l)
+if [ "$failed" -ne 0 ]; then
+	echo "sessions: $failed of $SENDERS senders failed"
+	status=1
+fi
+for output in "$OUTDIR"/*; do
+	if ! cmp -s "$INPUT" "$output"; then
+		echo "sessions: $(basename "$output") differs from input"
+		status=1
+	fi
+done
+[ $status -eq 0 ] && echo "sessions: $SENDERS senders OK"
+
+rm -rf "$INPUT" "$OUTDIR" "$STATUSES"
+exit $status
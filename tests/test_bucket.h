@@ -0,0 +1,89 @@
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "CUnit/CUnit.h"
+#include "CUnit/Basic.h"
+
+#include "../src/bucket.h"
+
+void test_bucket_parse_rate(void) {
+	uint64_t rate;
+
+	CU_ASSERT_EQUAL(bucket_parse_rate("8000", &rate), 0);
+	CU_ASSERT_EQUAL(rate, 1000);
+	CU_ASSERT_EQUAL(bucket_parse_rate("100M", &rate), 0);
+	CU_ASSERT_EQUAL(rate, 12500000);
+	CU_ASSERT_EQUAL(bucket_parse_rate("1.5G", &rate), 0);
+	CU_ASSERT_EQUAL(rate, 187500000);
+	CU_ASSERT_EQUAL(bucket_parse_rate("64k", &rate), 0);
+	CU_ASSERT_EQUAL(rate, 8000);
+
+	CU_ASSERT_EQUAL(bucket_parse_rate("", &rate), -1);
+	CU_ASSERT_EQUAL(bucket_parse_rate("M", &rate), -1);
+	CU_ASSERT_EQUAL(bucket_parse_rate("10Mb", &rate), -1);
+	CU_ASSERT_EQUAL(bucket_parse_rate("0", &rate), -1);
+	CU_ASSERT_EQUAL(bucket_parse_rate("-5M", &rate), -1);
+	CU_ASSERT_EQUAL(bucket_parse_rate("nan", &rate), -1);
+}
+
+void test_bucket_take(void) {
+	bucket_t *b = bucket_create(1000, 500);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(b);
+	uint64_t now = bucket_clock();
+
+	// Test the burst goes through at once, and the debt is paid off in time
+	CU_ASSERT_EQUAL(bucket_delay(b, 0, now), 0);
+	bucket_take(b, 400, now);
+	CU_ASSERT_EQUAL(bucket_delay(b, 0, now), 0);
+	bucket_take(b, 200, now);
+	CU_ASSERT_EQUAL(bucket_delay(b, 0, now), 100000);
+	CU_ASSERT_EQUAL(bucket_delay(b, 0, now + 40000), 60000);
+	CU_ASSERT_EQUAL(bucket_delay(b, 0, now + 100000), 0);
+	// Test waiting for more is capped by the burst
+	CU_ASSERT_EQUAL(bucket_delay(b, 300, now + 100000), 300000);
+	CU_ASSERT_EQUAL(bucket_delay(b, 1000, now + 100000), 500000);
+
+	// Test idle time fills it no more than the burst
+	bucket_take(b, 600, now + 10000000);
+	CU_ASSERT_EQUAL(bucket_delay(b, 0, now + 10000000), 100000);
+	CU_ASSERT_EQUAL(bucket_total(b), 1200);
+
+	bucket_close(b);
+}
+
+void test_bucket_shared(void) {
+	char name[64];
+	snprintf(name, sizeof (name), "/test_bucket.%d", getpid());
+
+	bucket_t *b = bucket_open(name, 1000, 500);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(b);
+
+	// Test another process draws from the same bucket, and sets its rate
+	pid_t pid = fork();
+	if (pid == 0) {
+		bucket_t *other = bucket_open(name, 2000, 2000);
+		if (other == NULL) {
+			_exit(1);
+		}
+		bucket_take(other, 300, bucket_clock());
+		bucket_close(other);
+		_exit(0);
+	}
+	int status;
+	CU_ASSERT_EQUAL(waitpid(pid, &status, 0), pid);
+	CU_ASSERT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	CU_ASSERT_EQUAL(bucket_total(b), 300);
+	CU_ASSERT_EQUAL(bucket_rate(b), 2000);
+
+	bucket_close(b);
+	shm_unlink(name);
+}
+
+CU_TestInfo bucket_tests[] = {
+	{"bucket_parse_rate", test_bucket_parse_rate},
+	{"bucket_take", test_bucket_take},
+	{"bucket_shared", test_bucket_shared},
+	CU_TEST_INFO_NULL,
+};
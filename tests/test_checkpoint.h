@@ -0,0 +1,59 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "CUnit/CUnit.h"
+#include "CUnit/Basic.h"
+
+#include "../src/checkpoint.h"
+
+const char *ckpt_path = "/tmp/test_checkpoint";
+
+void setup_checkpoint(void) {
+	FILE *f = fopen(ckpt_path, "wb"); // empty
+	if (f != NULL) {
+		fclose(f);
+	}
+}
+
+void teardown_checkpoint(void) {
+	unlink(ckpt_path);
+}
+
+void test_checkpoint_save_load(void) {
+	checkpoint_t c = {0x123456789, 0xdeadbeef};
+	checkpoint_t d = {0, 0};
+
+	CU_ASSERT_EQUAL_FATAL(checkpoint_save(ckpt_path, &c), 0);
+	CU_ASSERT_EQUAL_FATAL(checkpoint_load(ckpt_path, &d), 0);
+	CU_ASSERT_EQUAL(d.offset, c.offset);
+	CU_ASSERT_EQUAL(d.crc, c.crc);
+
+	// Test a new checkpoint replaces the old one
+	c.offset = 42;
+	CU_ASSERT_EQUAL_FATAL(checkpoint_save(ckpt_path, &c), 0);
+	CU_ASSERT_EQUAL_FATAL(checkpoint_load(ckpt_path, &d), 0);
+	CU_ASSERT_EQUAL(d.offset, 42);
+}
+
+void test_checkpoint_load_invalid(void) {
+	checkpoint_t c;
+
+	// Test an empty file isn't a checkpoint
+	CU_ASSERT_EQUAL(checkpoint_load(ckpt_path, &c), -1);
+
+	FILE *f = fopen(ckpt_path, "wb");
+	CU_ASSERT_PTR_NOT_NULL_FATAL(f);
+	fputs("not a checkpoint", f);
+	fclose(f);
+	CU_ASSERT_EQUAL(checkpoint_load(ckpt_path, &c), -1);
+
+	unlink(ckpt_path);
+	CU_ASSERT_EQUAL(checkpoint_load(ckpt_path, &c), -1);
+}
+
+CU_TestInfo checkpoint_tests[] = {
+	{"checkpoint_save_load", test_checkpoint_save_load},
+	{"checkpoint_load_invalid", test_checkpoint_load_invalid},
+	CU_TEST_INFO_NULL,
+};
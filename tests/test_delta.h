@@ -0,0 +1,157 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "CUnit/CUnit.h"
+#include "CUnit/Basic.h"
+
+#include "../src/delta.h"
+
+/**
+ * Fills buf with pseudo-random bytes.
+ */
+static void fill_random(char *buf, size_t len, unsigned seed) {
+	srand(seed);
+	for (size_t i = 0; i < len; i++) {
+		buf[i] = rand();
+	}
+}
+
+void test_delta_weak(void) {
+	char buf[1000];
+	fill_random(buf, sizeof (buf), 1);
+
+	// Test the vectorized sums against the definition, for all tails
+	for (size_t len = 0; len <= 100; len++) {
+		uint32_t a = 0, b = 0;
+		for (size_t i = 0; i < len; i++) {
+			a += (unsigned char) buf[i];
+			b += (len - i) * (unsigned char) buf[i];
+		}
+		CU_ASSERT_EQUAL(delta_weak(buf, len), (a & 0xffff) | (b << 16));
+	}
+}
+
+void test_delta_roll(void) {
+	char buf[1000];
+	fill_random(buf, sizeof (buf), 2);
+	const size_t len = 100;
+
+	uint32_t weak = delta_weak(buf, len);
+	for (size_t pos = 0; pos + len < sizeof (buf); pos++) {
+		weak = delta_roll(weak, len, buf[pos], buf[pos + len]);
+		CU_ASSERT_EQUAL_FATAL(weak, delta_weak(buf + pos + 1, len));
+	}
+}
+
+void test_delta_signature(void) {
+	const size_t len = 10 * DELTA_BLOCK_SIZE + 100;
+	char *basis = malloc(len);
+	delta_sig_t one[10], many[10];
+	CU_ASSERT_PTR_NOT_NULL_FATAL(basis);
+	fill_random(basis, len, 3);
+
+	// Test threads change nothing, even more threads than blocks
+	CU_ASSERT_EQUAL_FATAL(delta_signature(basis, len, one, 1), 0);
+	CU_ASSERT_EQUAL_FATAL(delta_signature(basis, len, many, 16), 0);
+	for (size_t i = 0; i < 10; i++) {
+		const char *block = basis + i * DELTA_BLOCK_SIZE;
+		CU_ASSERT_EQUAL(one[i].weak, delta_weak(block, DELTA_BLOCK_SIZE));
+		CU_ASSERT_EQUAL(one[i].strong, delta_strong(block, DELTA_BLOCK_SIZE));
+		CU_ASSERT_EQUAL(many[i].weak, one[i].weak);
+		CU_ASSERT_EQUAL(many[i].strong, one[i].strong);
+	}
+
+	free(basis);
+}
+
+void test_delta_batch(void) {
+	const size_t count = SIGS_PER_BATCH + 3;
+	delta_sig_t sigs[SIGS_PER_BATCH + 3], decoded[SIGS_PER_BATCH + 3];
+	char buf[MAX_PAYLOAD_SIZE];
+	uint32_t batch;
+
+	for (size_t i = 0; i < count; i++) {
+		sigs[i].weak = i * 0x01010101;
+		sigs[i].strong = i * 0x0101010101010101ULL;
+	}
+
+	size_t len = delta_batch_encode(sigs, count, 0, buf);
+	CU_ASSERT_EQUAL(len, 4 + SIGS_PER_BATCH * SIG_SIZE);
+	CU_ASSERT(len <= MAX_PAYLOAD_SIZE);
+	CU_ASSERT_EQUAL(delta_batch_decode(buf, len, decoded, count, &batch), 0);
+	CU_ASSERT_EQUAL(batch, 0);
+
+	// Test the last batch is shorter
+	len = delta_batch_encode(sigs, count, 1, buf);
+	CU_ASSERT_EQUAL(len, 4 + 3 * SIG_SIZE);
+	CU_ASSERT_EQUAL(delta_batch_decode(buf, len, decoded, count, &batch), 0);
+	CU_ASSERT_EQUAL(batch, 1);
+	for (size_t i = 0; i < count; i++) {
+		CU_ASSERT_EQUAL(decoded[i].weak, sigs[i].weak);
+		CU_ASSERT_EQUAL(decoded[i].strong, sigs[i].strong);
+	}
+
+	// Test batches of the wrong length or out of range are rejected
+	CU_ASSERT_EQUAL(delta_batch_decode(buf, len - 1, decoded, count, &batch), -1);
+	CU_ASSERT_EQUAL(delta_batch_decode(buf, len, decoded, SIGS_PER_BATCH, &batch), -1);
+}
+
+void test_delta_compute(void) {
+	const size_t B = DELTA_BLOCK_SIZE;
+	const size_t len = 8 * B;
+	char *basis = malloc(len);
+	char *data = malloc(len + 10);
+	char *rebuilt = malloc(len + 10);
+	delta_sig_t sigs[8];
+	CU_ASSERT_PTR_NOT_NULL_FATAL(basis);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(data);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(rebuilt);
+
+	// The new data has a byte changed and 10 bytes inserted
+	fill_random(basis, len, 4);
+	memcpy(data, basis, 3 * B);
+	memcpy(data + 3 * B + 10, basis + 3 * B, len - 3 * B);
+	memset(data + 3 * B, 'x', 10);
+	data[6 * B + 10 + 5] ^= 1;
+	CU_ASSERT_EQUAL_FATAL(delta_signature(basis, len, sigs, 1), 0);
+
+	size_t nops;
+	delta_op_t *ops = delta_compute(data, len + 10, sigs, 8, &nops);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(ops);
+
+	size_t pos = 0, copied = 0;
+	for (size_t i = 0; i < nops; i++) {
+		const char *src = ops[i].copy ? basis : data;
+		memcpy(rebuilt + pos, src + ops[i].offset, ops[i].len);
+		pos += ops[i].len;
+		copied += ops[i].copy ? ops[i].len : 0;
+	}
+	CU_ASSERT_EQUAL(pos, len + 10);
+	CU_ASSERT_EQUAL(memcmp(rebuilt, data, len + 10), 0);
+	// Test only the changes are sent as literal data: the 10 bytes and
+	// the block with the changed byte
+	CU_ASSERT_EQUAL(copied, 7 * B);
+	// Test contiguous blocks are copied in one piece
+	CU_ASSERT_EQUAL(nops, 5);
+	free(ops);
+
+	// Test there are no copies without a basis
+	ops = delta_compute(data, len + 10, sigs, 0, &nops);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(ops);
+	CU_ASSERT_EQUAL(nops, 1);
+	CU_ASSERT_FALSE(ops[0].copy);
+	free(ops);
+
+	free(basis);
+	free(data);
+	free(rebuilt);
+}
+
+CU_TestInfo delta_tests[] = {
+	{"weak", test_delta_weak},
+	{"roll", test_delta_roll},
+	{"signature", test_delta_signature},
+	{"batch", test_delta_batch},
+	{"compute", test_delta_compute},
+	CU_TEST_INFO_NULL,
+};
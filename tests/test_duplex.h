@@ -0,0 +1,85 @@
+#include <endian.h>
+#include <string.h>
+
+#include "CUnit/CUnit.h"
+#include "CUnit/Basic.h"
+
+#include "../src/duplex.h"
+#include "../src/packet_interface.h"
+#include "../src/setup.h"
+
+void test_piggyback_roundtrip(void) {
+	pkt_t *data = pkt_new();
+	pkt_t *ack = pkt_new();
+	pkt_t *taken = pkt_new();
+	char payload[DUPLEX_PAYLOAD_SIZE];
+	memset(payload, 'd', sizeof (payload));
+	uint32_t ce = htobe32(7);
+
+	pkt_set_type(data, PTYPE_DATA);
+	pkt_set_seqnum(data, 42);
+	pkt_set_timestamp(data, 1234);
+	pkt_set_payload(data, payload, sizeof (payload));
+	pkt_set_type(ack, PTYPE_ACK);
+	pkt_set_seqnum(ack, 200);
+	pkt_set_window(ack, 17);
+	pkt_set_timestamp(ack, 0xdeadbeef);
+	pkt_set_payload(ack, (const char *) &ce, sizeof (ce));
+
+	pkt_t *wrapped = piggyback_wrap(data, ack, true);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(wrapped);
+	CU_ASSERT_EQUAL(pkt_get_length(wrapped), MAX_PAYLOAD_SIZE);
+	CU_ASSERT_EQUAL(pkt_get_seqnum(wrapped), 42);
+	CU_ASSERT_EQUAL(pkt_get_timestamp(wrapped), 1234);
+
+	CU_ASSERT_EQUAL(piggyback_take(wrapped, taken), 1);
+	CU_ASSERT_EQUAL(pkt_get_type(taken), PTYPE_ACK);
+	CU_ASSERT_EQUAL(pkt_get_seqnum(taken), 200);
+	CU_ASSERT_EQUAL(pkt_get_window(taken), 17);
+	CU_ASSERT_EQUAL(pkt_get_timestamp(taken), 0xdeadbeef);
+	CU_ASSERT_EQUAL(pkt_get_length(taken), ECN_ECHO_SIZE);
+	CU_ASSERT_EQUAL(memcmp(pkt_get_payload(taken), &ce, sizeof (ce)), 0);
+	CU_ASSERT_EQUAL(pkt_get_length(wrapped), sizeof (payload));
+	CU_ASSERT_EQUAL(memcmp(pkt_get_payload(wrapped), payload, sizeof (payload)), 0);
+
+	// Test payloads leaving no room aren't wrapped
+	char full[MAX_PAYLOAD_SIZE] = {0};
+	pkt_set_payload(data, full, sizeof (full));
+	CU_ASSERT_PTR_NULL(piggyback_wrap(data, ack, true));
+
+	pkt_del(data);
+	pkt_del(ack);
+	pkt_del(taken);
+	pkt_del(wrapped);
+}
+
+void test_piggyback_eof(void) {
+	pkt_t *eof = pkt_new();
+	pkt_t *ack = pkt_new();
+	pkt_t *taken = pkt_new();
+	pkt_set_type(eof, PTYPE_DATA);
+	pkt_set_type(ack, PTYPE_ACK);
+	pkt_set_seqnum(ack, 3);
+
+	// Test an empty payload stays empty, without an ECN echo
+	pkt_t *wrapped = piggyback_wrap(eof, ack, false);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(wrapped);
+	CU_ASSERT_EQUAL(pkt_get_length(wrapped), PIGGYBACK_SIZE);
+	CU_ASSERT_EQUAL(piggyback_take(wrapped, taken), 0);
+	CU_ASSERT_EQUAL(pkt_get_seqnum(taken), 3);
+	CU_ASSERT_EQUAL(pkt_get_length(wrapped), 0);
+
+	// Test payloads too short to carry one are rejected
+	CU_ASSERT_EQUAL(piggyback_take(wrapped, taken), -1);
+
+	pkt_del(eof);
+	pkt_del(ack);
+	pkt_del(taken);
+	pkt_del(wrapped);
+}
+
+CU_TestInfo duplex_tests[] = {
+	{"piggyback_roundtrip", test_piggyback_roundtrip},
+	{"piggyback_eof", test_piggyback_eof},
+	CU_TEST_INFO_NULL,
+};
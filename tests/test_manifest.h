@@ -0,0 +1,119 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "CUnit/CUnit.h"
+#include "CUnit/Basic.h"
+
+#include "../src/manifest.h"
+
+#define TEST_MANIFEST_DIR "/tmp/test_manifest"
+
+int clean_manifest(void) {
+	unlink(TEST_MANIFEST_DIR "/link");
+	unlink(TEST_MANIFEST_DIR "/sub/b");
+	unlink(TEST_MANIFEST_DIR "/a");
+	rmdir(TEST_MANIFEST_DIR "/sub/empty");
+	rmdir(TEST_MANIFEST_DIR "/sub");
+	rmdir(TEST_MANIFEST_DIR);
+	return 0;
+}
+
+int init_manifest(void) {
+	clean_manifest(); // leftovers of an interrupted run
+	if (mkdir(TEST_MANIFEST_DIR, 0700) == -1 ||
+	    mkdir(TEST_MANIFEST_DIR "/sub", 0700) == -1 ||
+	    mkdir(TEST_MANIFEST_DIR "/sub/empty", 0700) == -1) {
+		return -1;
+	}
+
+	const char *files[] = {TEST_MANIFEST_DIR "/a", TEST_MANIFEST_DIR "/sub/b"};
+	for (size_t i = 0; i < 2; i++) {
+		FILE *f = fopen(files[i], "wb");
+		if (f == NULL) {
+			return -1;
+		}
+		fclose(f);
+	}
+	return symlink("a", TEST_MANIFEST_DIR "/link");
+}
+
+/**
+ * Returns the index of the entry with the name in m, or -1.
+ */
+static int find_entry(const manifest_t *m, const char *name) {
+	for (size_t i = 0; i < m->count; i++) {
+		if (strcmp(m->entries[i].name, name) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+void test_manifest_scan(void) {
+	manifest_t *m = manifest_scan(TEST_MANIFEST_DIR);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(m);
+
+	CU_ASSERT_EQUAL(m->count, 4);
+	// Test the symbolic link is skipped
+	CU_ASSERT_EQUAL(m->skipped, 1);
+
+	int a = find_entry(m, "a");
+	int sub = find_entry(m, "sub");
+	int b = find_entry(m, "sub/b");
+	int empty = find_entry(m, "sub/empty");
+	CU_ASSERT(a != -1 && sub != -1 && b != -1 && empty != -1);
+	// Test directories come before what they contain
+	CU_ASSERT(sub < b && sub < empty);
+	CU_ASSERT(S_ISDIR(m->entries[sub].mode));
+	CU_ASSERT(S_ISREG(m->entries[b].mode));
+	CU_ASSERT_STRING_EQUAL(m->entries[b].path, TEST_MANIFEST_DIR "/sub/b");
+
+	manifest_free(m);
+
+	CU_ASSERT_PTR_NULL(manifest_scan(TEST_MANIFEST_DIR "/missing"));
+}
+
+void test_file_hdr_encode_decode(void) {
+	file_hdr_t h = {.size = 0x123456789, .mode = S_IFREG | 0644}, d;
+	char buf[MAX_PAYLOAD_SIZE];
+	strcpy(h.name, "dir/file");
+
+	size_t len = file_hdr_encode(&h, buf);
+	CU_ASSERT_EQUAL(len, FILE_HDR_MIN + 8);
+	CU_ASSERT_EQUAL_FATAL(file_hdr_decode(buf, len, &d), 0);
+	CU_ASSERT_EQUAL(d.size, h.size);
+	CU_ASSERT_EQUAL(d.mode, h.mode);
+	CU_ASSERT_STRING_EQUAL(d.name, "dir/file");
+}
+
+void test_file_hdr_decode_invalid(void) {
+	const char *names[] = {"", "/etc/passwd", "..", "a/../../b", "a//b",
+		"./a", "a/", "a/."};
+	file_hdr_t h = {.size = 0, .mode = S_IFREG | 0644}, d;
+	char buf[MAX_PAYLOAD_SIZE];
+
+	// Test names leading out of the directory are rejected
+	for (size_t i = 0; i < sizeof (names) / sizeof (*names); i++) {
+		strcpy(h.name, names[i]);
+		size_t len = file_hdr_encode(&h, buf);
+		CU_ASSERT_EQUAL(file_hdr_decode(buf, len, &d), -1);
+	}
+
+	// Test names with a NUL and other file types are rejected
+	strcpy(h.name, "a");
+	size_t len = file_hdr_encode(&h, buf);
+	buf[len++] = '\0';
+	CU_ASSERT_EQUAL(file_hdr_decode(buf, len, &d), -1);
+	h.mode = S_IFLNK | 0777;
+	len = file_hdr_encode(&h, buf);
+	CU_ASSERT_EQUAL(file_hdr_decode(buf, len, &d), -1);
+}
+
+CU_TestInfo manifest_tests[] = {
+	{"scan", test_manifest_scan},
+	{"file_hdr_encode_decode", test_file_hdr_encode_decode},
+	{"file_hdr_decode_invalid", test_file_hdr_decode_invalid},
+	CU_TEST_INFO_NULL,
+};
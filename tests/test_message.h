@@ -0,0 +1,83 @@
+#include <string.h>
+
+#include "CUnit/CUnit.h"
+#include "CUnit/Basic.h"
+
+#include "../src/message.h"
+
+/**
+ * Appends a message of len bytes to buf, at *pos.
+ */
+static void put_message(char *buf, size_t *pos, size_t len) {
+	buf[(*pos)++] = len >> 8;
+	buf[(*pos)++] = len & 0xff;
+	memset(buf + *pos, 'm', len);
+	*pos += len;
+}
+
+void test_message_pack(void) {
+	char buf[2048] = {0};
+	size_t len = 0;
+	bool full;
+
+	// Test partial messages aren't taken
+	CU_ASSERT_EQUAL(message_pack(buf, 0, MAX_PAYLOAD_SIZE, &full), 0);
+	CU_ASSERT_FALSE(full);
+	put_message(buf, &len, 200);
+	CU_ASSERT_EQUAL(message_pack(buf, 1, MAX_PAYLOAD_SIZE, &full), 0);
+	CU_ASSERT_EQUAL(message_pack(buf, 100, MAX_PAYLOAD_SIZE, &full), 0);
+	CU_ASSERT_FALSE(full);
+	CU_ASSERT_EQUAL(message_pack(buf, len, MAX_PAYLOAD_SIZE, &full), 202);
+	CU_ASSERT_FALSE(full);
+
+	// Test messages are packed while they fit, a payload being full once
+	// the next one is known not to
+	put_message(buf, &len, 250);
+	CU_ASSERT_EQUAL(message_pack(buf, len, MAX_PAYLOAD_SIZE, &full), 454);
+	CU_ASSERT_FALSE(full);
+	put_message(buf, &len, 100);
+	CU_ASSERT_EQUAL(message_pack(buf, 456, MAX_PAYLOAD_SIZE, &full), 454);
+	CU_ASSERT_TRUE(full);
+	CU_ASSERT_EQUAL(message_pack(buf + 202, len - 202, MAX_PAYLOAD_SIZE, &full), 354);
+	CU_ASSERT_FALSE(full);
+
+	// Test the longest message fills a payload by itself
+	len = 0;
+	put_message(buf, &len, MSG_MAX_SIZE);
+	put_message(buf, &len, 1);
+	CU_ASSERT_EQUAL(message_pack(buf, len, MAX_PAYLOAD_SIZE, &full), MAX_PAYLOAD_SIZE);
+	CU_ASSERT_TRUE(full);
+
+	// Test invalid lengths
+	len = 0;
+	put_message(buf, &len, 10);
+	buf[len++] = 0;
+	buf[len++] = 0;
+	CU_ASSERT_EQUAL(message_pack(buf, len, MAX_PAYLOAD_SIZE, &full), -1);
+	buf[len - 2] = (char) ((MSG_MAX_SIZE + 1) >> 8);
+	buf[len - 1] = (char) ((MSG_MAX_SIZE + 1) & 0xff);
+	CU_ASSERT_EQUAL(message_pack(buf, len, MAX_PAYLOAD_SIZE, &full), -1);
+}
+
+void test_message_count(void) {
+	char buf[MAX_PAYLOAD_SIZE] = {0};
+	size_t len = 0;
+
+	CU_ASSERT_EQUAL(message_count(buf, 0), 0);
+	put_message(buf, &len, 100);
+	put_message(buf, &len, 1);
+	put_message(buf, &len, 300);
+	CU_ASSERT_EQUAL(message_count(buf, len), 3);
+
+	// Test payloads that end in the middle of a message
+	CU_ASSERT_EQUAL(message_count(buf, len - 1), -1);
+	CU_ASSERT_EQUAL(message_count(buf, 103), -1);
+	buf[0] = buf[1] = 0;
+	CU_ASSERT_EQUAL(message_count(buf, len), -1);
+}
+
+CU_TestInfo message_tests[] = {
+	{"message_pack", test_message_pack},
+	{"message_count", test_message_count},
+	CU_TEST_INFO_NULL,
+};
@@ -0,0 +1,141 @@
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "CUnit/CUnit.h"
+#include "CUnit/Basic.h"
+
+#include "../src/metrics.h"
+
+#define TEST_METRICS_FILE "/tmp/test_metrics"
+
+static metrics_cache_t *metrics_cache;
+
+void setup_metrics(void) {
+	unlink(TEST_METRICS_FILE);
+	metrics_cache = metrics_open(TEST_METRICS_FILE);
+}
+
+void teardown_metrics(void) {
+	if (metrics_cache != NULL) {
+		metrics_close(metrics_cache);
+	}
+	unlink(TEST_METRICS_FILE);
+}
+
+static struct in6_addr metrics_addr(const char *str) {
+	struct in6_addr addr;
+	inet_pton(AF_INET6, str, &addr);
+	return addr;
+}
+
+void test_metrics_lookup(void) {
+	CU_ASSERT_PTR_NOT_NULL_FATAL(metrics_cache);
+	struct in6_addr a = metrics_addr("::1");
+	struct in6_addr b = metrics_addr("2001:db8::1");
+	path_metrics_t m = {.srtt = 20000, .rttvar = 5000, .rate = 1000000,
+		.payload_size = 512, .window = 31};
+	path_metrics_t got;
+
+	// Test unknown addresses miss, and known ones hit
+	CU_ASSERT_EQUAL(metrics_lookup(metrics_cache, &a, 1000, &got), -1);
+	CU_ASSERT_EQUAL(metrics_update(metrics_cache, &a, 1000, &m), 0);
+	CU_ASSERT_EQUAL(metrics_lookup(metrics_cache, &a, 1000, &got), 0);
+	CU_ASSERT_EQUAL(memcmp(&got, &m, sizeof (m)), 0);
+	CU_ASSERT_EQUAL(metrics_lookup(metrics_cache, &b, 1000, &got), -1);
+
+	// Test addresses don't mix
+	path_metrics_t other = {.srtt = 100000};
+	CU_ASSERT_EQUAL(metrics_update(metrics_cache, &b, 1000, &other), 0);
+	CU_ASSERT_EQUAL(metrics_lookup(metrics_cache, &b, 1000, &got), 0);
+	CU_ASSERT_EQUAL(got.srtt, 100000);
+	CU_ASSERT_EQUAL(got.rate, 0);
+	CU_ASSERT_EQUAL(metrics_lookup(metrics_cache, &a, 1000, &got), 0);
+	CU_ASSERT_EQUAL(got.srtt, 20000);
+}
+
+void test_metrics_merge(void) {
+	CU_ASSERT_PTR_NOT_NULL_FATAL(metrics_cache);
+	struct in6_addr a = metrics_addr("::1");
+	path_metrics_t m = {.srtt = 20000, .rttvar = 5000, .rate = 1000000,
+		.payload_size = 512, .window = 31};
+	path_metrics_t got;
+	CU_ASSERT_EQUAL(metrics_update(metrics_cache, &a, 1000, &m), 0);
+
+	// Test known values are averaged, and unknown ones left alone
+	path_metrics_t next = {.srtt = 40000, .payload_size = 256, .window = 10};
+	CU_ASSERT_EQUAL(metrics_update(metrics_cache, &a, 1010, &next), 0);
+	CU_ASSERT_EQUAL(metrics_lookup(metrics_cache, &a, 1010, &got), 0);
+	CU_ASSERT_EQUAL(got.srtt, 30000);
+	CU_ASSERT_EQUAL(got.rttvar, 5000);
+	CU_ASSERT_EQUAL(got.rate, 1000000);
+	CU_ASSERT_EQUAL(got.payload_size, 256);
+	CU_ASSERT_EQUAL(got.window, 10);
+}
+
+void test_metrics_age(void) {
+	CU_ASSERT_PTR_NOT_NULL_FATAL(metrics_cache);
+	struct in6_addr a = metrics_addr("::1");
+	path_metrics_t m = {.srtt = 20000, .rate = 1000000};
+	path_metrics_t got;
+	CU_ASSERT_EQUAL(metrics_update(metrics_cache, &a, 1000, &m), 0);
+
+	// Test old entries are ignored, then replaced rather than merged
+	CU_ASSERT_EQUAL(metrics_lookup(metrics_cache, &a, 1000 + METRICS_MAX_AGE, &got), 0);
+	CU_ASSERT_EQUAL(metrics_lookup(metrics_cache, &a, 1001 + METRICS_MAX_AGE, &got), -1);
+	path_metrics_t next = {.srtt = 40000};
+	CU_ASSERT_EQUAL(metrics_update(metrics_cache, &a, 1001 + METRICS_MAX_AGE, &next), 0);
+	CU_ASSERT_EQUAL(metrics_lookup(metrics_cache, &a, 1001 + METRICS_MAX_AGE, &got), 0);
+	CU_ASSERT_EQUAL(got.srtt, 40000);
+	CU_ASSERT_EQUAL(got.rate, 0);
+}
+
+void test_metrics_persist(void) {
+	CU_ASSERT_PTR_NOT_NULL_FATAL(metrics_cache);
+	struct in6_addr a = metrics_addr("::1");
+	path_metrics_t m = {.srtt = 20000};
+	path_metrics_t got;
+	CU_ASSERT_EQUAL(metrics_update(metrics_cache, &a, 1000, &m), 0);
+
+	// Test entries are seen by other users of the file, and survive closing it
+	metrics_cache_t *other = metrics_open(TEST_METRICS_FILE);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(other);
+	CU_ASSERT_EQUAL(metrics_lookup(other, &a, 1000, &got), 0);
+	CU_ASSERT_EQUAL(got.srtt, 20000);
+	metrics_close(metrics_cache);
+	metrics_cache = NULL;
+	m.srtt = 40000;
+	CU_ASSERT_EQUAL(metrics_update(other, &a, 1000, &m), 0);
+	metrics_close(other);
+
+	metrics_cache = metrics_open(TEST_METRICS_FILE);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(metrics_cache);
+	CU_ASSERT_EQUAL(metrics_lookup(metrics_cache, &a, 1000, &got), 0);
+	CU_ASSERT_EQUAL(got.srtt, 30000);
+}
+
+void test_metrics_invalid(void) {
+	CU_ASSERT_PTR_NOT_NULL_FATAL(metrics_cache);
+	metrics_close(metrics_cache);
+
+	// Test a file that isn't a cache is emptied rather than trusted
+	FILE *f = fopen(TEST_METRICS_FILE, "wb");
+	CU_ASSERT_PTR_NOT_NULL_FATAL(f);
+	fputs("not a cache", f);
+	fclose(f);
+	metrics_cache = metrics_open(TEST_METRICS_FILE);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(metrics_cache);
+	struct in6_addr a = metrics_addr("::1");
+	path_metrics_t got;
+	CU_ASSERT_EQUAL(metrics_lookup(metrics_cache, &a, 1000, &got), -1);
+}
+
+CU_TestInfo metrics_tests[] = {
+	{"metrics_lookup", test_metrics_lookup},
+	{"metrics_merge", test_metrics_merge},
+	{"metrics_age", test_metrics_age},
+	{"metrics_persist", test_metrics_persist},
+	{"metrics_invalid", test_metrics_invalid},
+	CU_TEST_INFO_NULL,
+};
@@ -351,6 +351,86 @@ void test_pkt_encode_empty(void) {
 	CU_ASSERT_EQUAL(pkt_encode(pkt, buf, &len), E_TYPE);
 }
 
+void test_pkt_set_payload_ref(void) {
+	char hello[] = "hello";
+	CU_ASSERT_EQUAL(pkt_set_payload_ref(pkt, hello, strlen(hello)), PKT_OK);
+	CU_ASSERT_TRUE(pkt_has_payload_ref(pkt));
+	CU_ASSERT_PTR_EQUAL(pkt_get_payload(pkt), hello);
+	CU_ASSERT_EQUAL(pkt_get_length(pkt), strlen(hello));
+
+	// Test a copied payload replaces the reference
+	CU_ASSERT_EQUAL(pkt_set_payload(pkt, hello, strlen(hello)), PKT_OK);
+	CU_ASSERT_FALSE(pkt_has_payload_ref(pkt));
+	CU_ASSERT_PTR_NOT_EQUAL(pkt_get_payload(pkt), hello);
+
+	CU_ASSERT_EQUAL(pkt_set_payload_ref(pkt, NULL, 10), PKT_OK);
+	CU_ASSERT_FALSE(pkt_has_payload_ref(pkt));
+	CU_ASSERT_PTR_NULL(pkt_get_payload(pkt));
+}
+
+void test_pkt_encode_payload_ref(void) {
+	char copied[MAX_PACKET_SIZE] = {0};
+	char referenced[MAX_PACKET_SIZE] = {0};
+	char hello_world[] = "hello world";
+	size_t n_copied = MAX_PACKET_SIZE;
+	size_t n_referenced = MAX_PACKET_SIZE;
+
+	CU_ASSERT_EQUAL(pkt_set_type(pkt, PTYPE_DATA), PKT_OK);
+	CU_ASSERT_EQUAL(pkt_set_seqnum(pkt, 0x7b), PKT_OK);
+	CU_ASSERT_EQUAL(pkt_set_payload(pkt, hello_world, strlen(hello_world)), PKT_OK);
+	CU_ASSERT_EQUAL(pkt_encode(pkt, copied, &n_copied), PKT_OK);
+
+	CU_ASSERT_EQUAL(pkt_set_payload_ref(pkt, hello_world, strlen(hello_world)), PKT_OK);
+	CU_ASSERT_EQUAL(pkt_encode(pkt, referenced, &n_referenced), PKT_OK);
+
+	// Test both encode to the same bytes
+	CU_ASSERT_EQUAL_FATAL(n_copied, n_referenced);
+	CU_ASSERT_NSTRING_EQUAL(copied, referenced, n_copied);
+}
+
+void test_pkt_encode_header(void) {
+	char expected[MAX_PACKET_SIZE] = {0};
+	char hdr[HEADER_SIZE] = {0};
+	char crc2[4] = {0};
+	char hello_world[] = "hello world";
+	size_t n = MAX_PACKET_SIZE;
+
+	CU_ASSERT_EQUAL(pkt_set_type(pkt, PTYPE_DATA), PKT_OK);
+	CU_ASSERT_EQUAL(pkt_set_window(pkt, 28), PKT_OK);
+	CU_ASSERT_EQUAL(pkt_set_seqnum(pkt, 0x7b), PKT_OK);
+	CU_ASSERT_EQUAL(pkt_set_timestamp(pkt, 0x17), PKT_OK);
+	CU_ASSERT_EQUAL(pkt_set_payload_ref(pkt, hello_world, strlen(hello_world)), PKT_OK);
+	CU_ASSERT_EQUAL(pkt_encode(pkt, expected, &n), PKT_OK);
+	CU_ASSERT_EQUAL(pkt_encode_header(pkt, hdr, crc2), PKT_OK);
+
+	// Test the parts match the corresponding bytes of the whole packet
+	CU_ASSERT_EQUAL_FATAL(n, HEADER_SIZE + strlen(hello_world) + 4);
+	CU_ASSERT_NSTRING_EQUAL(hdr, expected, HEADER_SIZE);
+	CU_ASSERT_NSTRING_EQUAL(crc2, expected + n - 4, 4);
+}
+
+void test_pkt_encode_given_crc2(void) {
+	char buf[MAX_PACKET_SIZE] = {0};
+	char hello_world[] = "hello world";
+	size_t n = MAX_PACKET_SIZE;
+	char crc2[] = "\xde\xad\xbe\xef"; // network byte order
+
+	CU_ASSERT_EQUAL(pkt_set_type(pkt, PTYPE_DATA), PKT_OK);
+	CU_ASSERT_EQUAL(pkt_set_payload(pkt, hello_world, strlen(hello_world)), PKT_OK);
+	CU_ASSERT_EQUAL(pkt_set_crc2(pkt, 0xdeadbeef), PKT_OK);
+	CU_ASSERT_EQUAL(pkt_encode(pkt, buf, &n), PKT_OK);
+
+	// Test the given CRC2 is used as is
+	CU_ASSERT_EQUAL_FATAL(n, HEADER_SIZE + strlen(hello_world) + 4);
+	CU_ASSERT_NSTRING_EQUAL(buf + n - 4, crc2, 4);
+
+	// Test changing the payload computes it again
+	n = MAX_PACKET_SIZE;
+	CU_ASSERT_EQUAL(pkt_set_payload(pkt, hello_world, strlen(hello_world)), PKT_OK);
+	CU_ASSERT_EQUAL(pkt_encode(pkt, buf, &n), PKT_OK);
+	CU_ASSERT_EQUAL(pkt_decode(buf, n, pkt), PKT_OK);
+}
+
 CU_TestInfo packet_tests[] = {
 	{"pkt_new", test_pkt_new},
 	{"pkt_set_type", test_pkt_set_type},
@@ -372,5 +452,9 @@ CU_TestInfo packet_tests[] = {
 	{"pkt_encode_length0", test_pkt_encode_length0},
 	{"pkt_encode_computes_crc1_with_tr0", test_pkt_encode_computes_crc1_with_tr0},
 	{"pkt_encode_empty", test_pkt_encode_empty},
+	{"pkt_set_payload_ref", test_pkt_set_payload_ref},
+	{"pkt_encode_payload_ref", test_pkt_encode_payload_ref},
+	{"pkt_encode_header", test_pkt_encode_header},
+	{"pkt_encode_given_crc2", test_pkt_encode_given_crc2},
 	CU_TEST_INFO_NULL,
 };
@@ -0,0 +1,72 @@
+#include <arpa/inet.h>
+#include <string.h>
+
+#include "CUnit/CUnit.h"
+#include "CUnit/Basic.h"
+
+#include "../src/peers.h"
+
+static struct sockaddr_in6 peer_addr(const char *str, in_port_t port) {
+	struct sockaddr_in6 addr;
+	memset(&addr, 0, sizeof (addr));
+	addr.sin6_family = AF_INET6;
+	inet_pton(AF_INET6, str, &addr.sin6_addr);
+	addr.sin6_port = htons(port);
+	return addr;
+}
+
+void test_peers_find(void) {
+	peers_t *p = peers_create(4);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(p);
+	struct sockaddr_in6 a = peer_addr("::1", 1000);
+	struct sockaddr_in6 b = peer_addr("::1", 1001);
+	struct sockaddr_in6 c = peer_addr("2001:db8::1", 1000);
+
+	CU_ASSERT_EQUAL(peers_find(p, &a), -1);
+	CU_ASSERT_EQUAL(peers_add(p, &a, 10), 0);
+	CU_ASSERT_EQUAL(peers_add(p, &b, 11), 0);
+	CU_ASSERT_EQUAL(peers_add(p, &c, 12), 0);
+	CU_ASSERT_EQUAL(peers_count(p), 3);
+
+	// Test senders are told apart by address and port
+	CU_ASSERT_EQUAL(peers_find(p, &a), 10);
+	CU_ASSERT_EQUAL(peers_find(p, &b), 11);
+	CU_ASSERT_EQUAL(peers_find(p, &c), 12);
+
+	CU_ASSERT_TRUE(peers_remove(p, 11));
+	CU_ASSERT_FALSE(peers_remove(p, 11));
+	CU_ASSERT_EQUAL(peers_find(p, &b), -1);
+	CU_ASSERT_EQUAL(peers_find(p, &c), 12);
+	CU_ASSERT_EQUAL(peers_count(p), 2);
+
+	peers_free(p);
+}
+
+void test_peers_full(void) {
+	peers_t *p = peers_create(64);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(p);
+
+	// Test the table takes as many senders as asked, again once emptied
+	for (int round = 0; round < 3; round++) {
+		for (int i = 0; i < 64; i++) {
+			struct sockaddr_in6 a = peer_addr("::1", 2000 + i);
+			CU_ASSERT_EQUAL(peers_add(p, &a, 100 + i), 0);
+		}
+		struct sockaddr_in6 extra = peer_addr("::2", 2000);
+		CU_ASSERT_EQUAL(peers_add(p, &extra, 1), -1);
+		for (int i = 0; i < 64; i++) {
+			struct sockaddr_in6 a = peer_addr("::1", 2000 + i);
+			CU_ASSERT_EQUAL(peers_find(p, &a), 100 + i);
+			CU_ASSERT_TRUE(peers_remove(p, 100 + i));
+		}
+		CU_ASSERT_EQUAL(peers_count(p), 0);
+	}
+
+	peers_free(p);
+}
+
+CU_TestInfo peers_tests[] = {
+	{"peers_find", test_peers_find},
+	{"peers_full", test_peers_full},
+	CU_TEST_INFO_NULL,
+};
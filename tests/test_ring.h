@@ -0,0 +1,87 @@
+#include <stdlib.h>
+
+#include "CUnit/CUnit.h"
+#include "CUnit/Basic.h"
+
+#include "../src/ring.h"
+
+ring_t *r;
+
+void setup_ring(void) {
+	r = ring_create(3, sizeof (int)); // rounded up to 4 slots
+}
+
+void teardown_ring(void) {
+	ring_free(r);
+	r = NULL;
+}
+
+/**
+ * Produces the value, returns whether there was a free slot.
+ */
+bool ring_test_push(int value) {
+	int *slot = ring_produce_slot(r);
+	if (slot == NULL) {
+		return false;
+	}
+	*slot = value;
+	ring_publish(r);
+	return true;
+}
+
+void test_ring_create(void) {
+	CU_ASSERT_PTR_NOT_NULL_FATAL(r);
+	CU_ASSERT_EQUAL(ring_capacity(r), 4);
+	CU_ASSERT_EQUAL(ring_count(r), 0);
+	CU_ASSERT_PTR_NULL(ring_create(0, sizeof (int)));
+}
+
+void test_ring_empty(void) {
+	CU_ASSERT_PTR_NULL(ring_consume_slot(r));
+
+	// Test a slot being filled isn't visible before it's published
+	CU_ASSERT_PTR_NOT_NULL(ring_produce_slot(r));
+	CU_ASSERT_PTR_NULL(ring_consume_slot(r));
+	ring_publish(r);
+	CU_ASSERT_PTR_NOT_NULL(ring_consume_slot(r));
+}
+
+void test_ring_full(void) {
+	for (int i = 0; i < 4; i++) {
+		CU_ASSERT_TRUE(ring_test_push(i));
+	}
+	CU_ASSERT_EQUAL(ring_count(r), 4);
+	CU_ASSERT_FALSE(ring_test_push(4));
+
+	// Test a slot is only given back once released
+	CU_ASSERT_PTR_NOT_NULL(ring_consume_slot(r));
+	CU_ASSERT_FALSE(ring_test_push(4));
+	ring_release(r);
+	CU_ASSERT_TRUE(ring_test_push(4));
+}
+
+void test_ring_order(void) {
+	// Go around the ring several times
+	int expected = 0;
+	for (int i = 0; i < 10; i++) {
+		CU_ASSERT_TRUE(ring_test_push(2 * i));
+		CU_ASSERT_TRUE(ring_test_push(2 * i + 1));
+
+		for (int j = 0; j < 2; j++) {
+			int *slot = ring_consume_slot(r);
+			CU_ASSERT_PTR_NOT_NULL_FATAL(slot);
+			CU_ASSERT_EQUAL(*slot, expected);
+			ring_release(r);
+			expected++;
+		}
+	}
+	CU_ASSERT_EQUAL(ring_count(r), 0);
+}
+
+CU_TestInfo ring_tests[] = {
+	{"ring_create", test_ring_create},
+	{"ring_empty", test_ring_empty},
+	{"ring_full", test_ring_full},
+	{"ring_order", test_ring_order},
+	CU_TEST_INFO_NULL,
+};
@@ -0,0 +1,120 @@
+#include <string.h>
+
+#include "CUnit/CUnit.h"
+#include "CUnit/Basic.h"
+
+#include "../src/packet_interface.h"
+#include "../src/setup.h"
+
+void test_setup_encode_decode(void) {
+	setup_t s, d;
+	char buf[SETUP_MAX_SIZE];
+
+	setup_init(&s, 10);
+	s.extensions = 0x80000001;
+	s.refusal = SETUP_REFUSE_SPACE;
+	s.resume_offset = 0x123456789;
+	s.resume_crc = 0xdeadbeef;
+	s.basis_size = 0x987654321;
+	CU_ASSERT_EQUAL(setup_encode(&s, buf), SETUP_SIZE);
+
+	CU_ASSERT_EQUAL_FATAL(setup_decode(buf, SETUP_SIZE, &d), 0);
+	CU_ASSERT_EQUAL(d.version, SETUP_VERSION);
+	CU_ASSERT_EQUAL(d.checksum, SETUP_CSUM_CRC32);
+	CU_ASSERT_EQUAL(d.window, 10);
+	CU_ASSERT_EQUAL(d.payload_size, MAX_PAYLOAD_SIZE);
+	CU_ASSERT_EQUAL(d.extensions, 0x80000001);
+	CU_ASSERT_EQUAL(d.refusal, SETUP_REFUSE_SPACE);
+	CU_ASSERT_EQUAL(d.resume_offset, 0x123456789);
+	CU_ASSERT_EQUAL(d.resume_crc, 0xdeadbeef);
+	CU_ASSERT_EQUAL(d.basis_size, 0x987654321);
+
+	// Test fields are big-endian
+	CU_ASSERT_EQUAL(buf[4], MAX_PAYLOAD_SIZE >> 8);
+	CU_ASSERT_EQUAL(buf[11], 1);
+}
+
+void test_setup_metadata(void) {
+	setup_t s, d;
+	char buf[SETUP_MAX_SIZE];
+
+	setup_init(&s, 10);
+	s.extensions |= SETUP_EXT_METADATA;
+	s.file_size = 0x123456789;
+	s.file_mtime = -1000000001;
+	s.file_mode = 0640;
+	strcpy(s.file_name, "data.bin");
+	size_t len = setup_encode(&s, buf);
+	CU_ASSERT_EQUAL(len, SETUP_SIZE + SETUP_META_SIZE + strlen("data.bin"));
+
+	CU_ASSERT_EQUAL_FATAL(setup_decode(buf, len, &d), 0);
+	CU_ASSERT_EQUAL(d.file_size, 0x123456789);
+	CU_ASSERT_EQUAL(d.file_mtime, -1000000001);
+	CU_ASSERT_EQUAL(d.file_mode, 0640);
+	CU_ASSERT_STRING_EQUAL(d.file_name, "data.bin");
+
+	// Test the metadata must be there, and the name may be empty
+	CU_ASSERT_EQUAL(setup_decode(buf, SETUP_SIZE, &d), -1);
+	CU_ASSERT_EQUAL_FATAL(setup_decode(buf, SETUP_SIZE + SETUP_META_SIZE, &d), 0);
+	CU_ASSERT_STRING_EQUAL(d.file_name, "");
+
+	// Test a name too long is rejected
+	memset(s.file_name, 'a', SETUP_NAME_MAX);
+	s.file_name[SETUP_NAME_MAX] = '\0';
+	len = setup_encode(&s, buf);
+	CU_ASSERT_EQUAL(len, SETUP_MAX_SIZE);
+	CU_ASSERT_EQUAL(setup_decode(buf, len, &d), 0);
+	char long_buf[SETUP_MAX_SIZE + 1];
+	memcpy(long_buf, buf, len);
+	long_buf[len] = 'a';
+	CU_ASSERT_EQUAL(setup_decode(long_buf, len + 1, &d), -1);
+
+	// Test the answer echoes the metadata of the sender
+	setup_t local, agreed;
+	setup_init(&local, 31);
+	local.extensions |= SETUP_EXT_METADATA;
+	CU_ASSERT_EQUAL_FATAL(setup_negotiate(&local, &s, &agreed), 0);
+	CU_ASSERT_EQUAL(agreed.file_size, 0x123456789);
+	CU_ASSERT_EQUAL(agreed.file_mode, 0640);
+	CU_ASSERT_EQUAL(strlen(agreed.file_name), SETUP_NAME_MAX);
+}
+
+void test_setup_decode_short(void) {
+	setup_t s;
+	char buf[SETUP_SIZE] = {0};
+
+	CU_ASSERT_EQUAL(setup_decode(buf, SETUP_SIZE - 1, &s), -1);
+	CU_ASSERT_EQUAL(setup_decode(buf, 0, &s), -1);
+}
+
+void test_setup_negotiate(void) {
+	setup_t local, remote, agreed;
+	setup_init(&local, 31);
+	setup_init(&remote, 10);
+	local.extensions = 0x3;
+	local.resume_offset = 1024;
+	remote.extensions = 0x6;
+	remote.payload_size = 256;
+	remote.resume_offset = 512;
+
+	CU_ASSERT_EQUAL_FATAL(setup_negotiate(&local, &remote, &agreed), 0);
+	CU_ASSERT_EQUAL(agreed.window, 10);
+	CU_ASSERT_EQUAL(agreed.payload_size, 256);
+	CU_ASSERT_EQUAL(agreed.extensions, 0x2);
+	CU_ASSERT_EQUAL(agreed.resume_offset, 1024);
+
+	// Test ends with different versions or checksums can't agree
+	remote.version = SETUP_VERSION + 1;
+	CU_ASSERT_EQUAL(setup_negotiate(&local, &remote, &agreed), -1);
+	remote.version = SETUP_VERSION;
+	remote.checksum = SETUP_CSUM_CRC32 + 1;
+	CU_ASSERT_EQUAL(setup_negotiate(&local, &remote, &agreed), -1);
+}
+
+CU_TestInfo setup_tests[] = {
+	{"setup_encode_decode", test_setup_encode_decode},
+	{"setup_metadata", test_setup_metadata},
+	{"setup_decode_short", test_setup_decode_short},
+	{"setup_negotiate", test_setup_negotiate},
+	CU_TEST_INFO_NULL,
+};
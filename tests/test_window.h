@@ -72,10 +72,44 @@ void test_window_resize(void) {
 	pkt_del(p);
 }
 
+void test_window_min_timestamp(void) {
+	/* The one set just before the clock wrapped around comes first */
+	pkt_t *before = pkt_new();
+	pkt_t *after = pkt_new();
+	pkt_set_timestamp(before, 0xffffff00);
+	pkt_set_timestamp(after, 0x100);
+	window_push(w, after);
+	window_push(w, before);
+
+	CU_ASSERT_PTR_EQUAL(window_peek_min_timestamp(w), before);
+	CU_ASSERT_PTR_EQUAL(window_pop_min_timestamp(w), before);
+	CU_ASSERT_PTR_EQUAL(window_pop_min_timestamp(w), after);
+
+	pkt_del(before);
+	pkt_del(after);
+}
+
+void test_window_pop_timestamp(void) {
+	pkt_t *p = pkt_new();
+	pkt_set_timestamp(p, 42);
+	window_resize(w, 2);
+	window_push(w, p);
+
+	/* Stamps of earlier transmissions match nothing, not another packet */
+	CU_ASSERT_PTR_NULL(window_pop_timestamp(w, 41));
+	CU_ASSERT_EQUAL(window_buffer_size(w), 1);
+	CU_ASSERT_PTR_EQUAL(window_pop_timestamp(w, 42), p);
+	CU_ASSERT_TRUE(window_empty(w));
+
+	pkt_del(p);
+}
+
 CU_TestInfo window_tests[] = {
 	{"window_has", test_window_has},
 	{"window_slide", test_window_slide},
 	{"window_push", test_window_push},
 	{"window_resize", test_window_resize},
+	{"window_min_timestamp", test_window_min_timestamp},
+	{"window_pop_timestamp", test_window_pop_timestamp},
 	CU_TEST_INFO_NULL,
 };
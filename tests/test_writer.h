@@ -0,0 +1,98 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "CUnit/CUnit.h"
+#include "CUnit/Basic.h"
+
+#include "../src/writer.h"
+
+const char *writer_path = "/tmp/test_writer";
+
+void teardown_writer(void) {
+	unlink(writer_path);
+}
+
+void test_writer_file(void) {
+	size_t size = 3 << 20; // a few full buffers
+	char *expected = calloc(size, 1);
+	char *actual = malloc(size);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(expected);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(actual);
+	for (size_t i = 0; i < size; i++) {
+		expected[i] = rand();
+	}
+
+	int fd = open(writer_path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	CU_ASSERT_FATAL(fd != -1);
+	writer_t *wr = writer_start(fd, true, 1 << 20);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(wr);
+
+	// Test payloads of any size add up, past aligned blocks and buffers
+	size_t hole = 1000000;
+	size_t pos = 0;
+	while (pos < hole) {
+		size_t len = 1 + rand() % 512;
+		len = pos + len > hole ? hole - pos : len;
+		CU_ASSERT_EQUAL(writer_write(wr, expected + pos, len), 0);
+		pos += len;
+	}
+	CU_ASSERT_EQUAL(writer_tell(wr), (off_t) hole);
+
+	// Test skipping a range leaves a hole, and writing before is in place
+	memset(expected + hole, 0, 5000);
+	CU_ASSERT_EQUAL(writer_seek(wr, hole + 5000), 0);
+	CU_ASSERT_EQUAL(writer_write(wr, expected + hole + 5000, size - hole - 5000), 0);
+	CU_ASSERT_EQUAL(writer_flush(wr, true, false), 0);
+	memset(expected + 100, 'x', 700);
+	CU_ASSERT_EQUAL(writer_seek(wr, 100), 0);
+	CU_ASSERT_EQUAL(writer_write(wr, expected + 100, 700), 0);
+	CU_ASSERT_EQUAL(writer_stop(wr), 0);
+
+	CU_ASSERT_EQUAL(pread(fd, actual, size, 0), (ssize_t) size);
+	CU_ASSERT_EQUAL(memcmp(actual, expected, size), 0);
+	char c;
+	CU_ASSERT_EQUAL(pread(fd, &c, 1, size), 0);
+
+	close(fd);
+	free(expected);
+	free(actual);
+}
+
+void test_writer_pipe(void) {
+	int fds[2];
+	CU_ASSERT_EQUAL_FATAL(pipe(fds), 0);
+	writer_t *wr = writer_start(fds[1], false, 0);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(wr);
+
+	// Test a pipe has no position
+	CU_ASSERT_EQUAL(writer_tell(wr), -1);
+	CU_ASSERT_EQUAL(writer_seek(wr, 0), -1);
+
+	// Test data flows through it in order, without waiting for more
+	char out[50000];
+	char in[sizeof (out)];
+	for (size_t i = 0; i < sizeof (out); i++) {
+		out[i] = i % 251;
+	}
+	CU_ASSERT_EQUAL(writer_write(wr, out, sizeof (out)), 0);
+	CU_ASSERT_EQUAL(writer_flush(wr, false, false), 0);
+	size_t got = 0;
+	while (got < sizeof (in)) {
+		ssize_t n = read(fds[0], in + got, sizeof (in) - got);
+		CU_ASSERT_FATAL(n > 0);
+		got += n;
+	}
+	CU_ASSERT_EQUAL(memcmp(in, out, sizeof (out)), 0);
+
+	CU_ASSERT_EQUAL(writer_stop(wr), 0);
+	close(fds[0]);
+	close(fds[1]);
+}
+
+CU_TestInfo writer_tests[] = {
+	{"writer_file", test_writer_file},
+	{"writer_pipe", test_writer_pipe},
+	CU_TEST_INFO_NULL,
+};
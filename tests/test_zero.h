@@ -0,0 +1,88 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "CUnit/CUnit.h"
+#include "CUnit/Basic.h"
+
+#include "../src/zero.h"
+
+void test_is_zero(void) {
+	char buf[200] = {0};
+
+	CU_ASSERT_TRUE(is_zero(buf, sizeof (buf)));
+	CU_ASSERT_TRUE(is_zero(buf, 0));
+
+	// Test a single byte is found anywhere, in vectors or in the tail
+	for (size_t i = 0; i < sizeof (buf); i += 7) {
+		buf[i] = 1;
+		CU_ASSERT_FALSE(is_zero(buf, sizeof (buf)));
+		CU_ASSERT_TRUE(is_zero(buf, i));
+		buf[i] = 0;
+	}
+}
+
+void test_zero_run(void) {
+	char buf[100] = {0};
+	buf[50] = 1;
+
+	CU_ASSERT_EQUAL(zero_run(-1, buf, 0, 100, 10), 50);
+	CU_ASSERT_EQUAL(zero_run(-1, buf, 50, 100, 10), 50);
+	CU_ASSERT_EQUAL(zero_run(-1, buf, 60, 100, 10), 100);
+	// Test the block with the byte isn't part of the run
+	CU_ASSERT_EQUAL(zero_run(-1, buf, 0, 100, 40), 40);
+	// Test the last block may be cut short
+	CU_ASSERT_EQUAL(zero_run(-1, buf, 60, 95, 10), 95);
+}
+
+void test_zero_run_hole(void) {
+	const char *path = "/tmp/test_zero";
+	const size_t hole = 1 << 20;
+
+	// Test a hole followed by data is found through the file
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	CU_ASSERT_NOT_EQUAL_FATAL(fd, -1);
+	CU_ASSERT_EQUAL(pwrite(fd, "data", 4, hole), 4);
+
+	const char *map = mmap(NULL, hole + 4, PROT_READ, MAP_PRIVATE, fd, 0);
+	CU_ASSERT_NOT_EQUAL_FATAL(map, MAP_FAILED);
+	CU_ASSERT_EQUAL(zero_run(fd, map, 0, hole + 4, 512), hole);
+	CU_ASSERT_EQUAL(zero_run(fd, map, 0, hole / 2, 512), hole / 2);
+	CU_ASSERT_EQUAL(zero_run(fd, map, hole, hole + 4, 512), hole);
+
+	munmap((void *) map, hole + 4);
+
+	// Test a hole is found, even past data, but not the end of the file
+	CU_ASSERT_TRUE(has_holes(fd, hole + 4));
+	CU_ASSERT_EQUAL(pwrite(fd, "x", 1, 0), 1);
+	CU_ASSERT_TRUE(has_holes(fd, hole + 4));
+	close(fd);
+
+	fd = open(path, O_RDWR | O_TRUNC);
+	CU_ASSERT_NOT_EQUAL_FATAL(fd, -1);
+	CU_ASSERT_EQUAL(pwrite(fd, "data", 4, 0), 4);
+	CU_ASSERT_FALSE(has_holes(fd, 4));
+	close(fd);
+	unlink(path);
+}
+
+void test_crc_zeros(void) {
+	char buf[5000] = {0};
+	size_t lens[] = {0, 1, 2, 3, 511, 512, 4096, 5000};
+
+	for (size_t i = 0; i < sizeof (lens) / sizeof (*lens); i++) {
+		uint32_t expected = crc32(0, (const unsigned char *) buf, lens[i]);
+		CU_ASSERT_EQUAL(crc_zeros(lens[i]), expected);
+	}
+}
+
+CU_TestInfo zero_tests[] = {
+	{"is_zero", test_is_zero},
+	{"zero_run", test_zero_run},
+	{"zero_run_hole", test_zero_run_hole},
+	{"crc_zeros", test_crc_zeros},
+	CU_TEST_INFO_NULL,
+};